@@ -1,12 +1,444 @@
 const { randomUUID } = require("crypto");
 const WebSocket = require("ws");
 const net = require("net");
+const { isUtf8 } = require("buffer");
 const { type } = require("os");
 
+// Binära ramar: typbyte, längden på resten som varint och därefter innehållet.
+// Textrader börjar alltid med '{', så första byte avgör hur ramen ska läsas.
+//
+// Game-ram från klienten: flaggor, [destinationens handtag], data
+// Game-ram till klienten: flaggor, messageId, avsändarens handtag, data
+// JSON-ram:               ett helt meddelande, samma innehåll som en rad
+//
+// Handtagen är små heltal per session i stället för clientId. data är
+// JSON-text om inte GAME_COMPACT är satt.
+const FRAME_GAME = 0x47; // 'G'
+const FRAME_JSON = 0x4a; // 'J'
+const GAME_DIRECTED = 0x01;
+const GAME_COMPACT = 0x02; // reserverad för kompakt kodning av data
+const MAX_FRAME = 16 * 1024 * 1024;
+const SCAN_DEPTH = 1024;
+const EMPTY_DATA = Buffer.from("{}");
+
+function varintLength(value) {
+	let n = 1;
+	while (value >= 0x80) {
+		value = Math.floor(value / 128);
+		n++;
+	}
+	return n;
+}
+
+function writeVarint(buf, offset, value) {
+	while (value >= 0x80) {
+		buf[offset++] = (value % 128) | 0x80;
+		value = Math.floor(value / 128);
+	}
+	buf[offset++] = value;
+	return offset;
+}
+
+// Returnerar { value, offset } eller null om varinten inte är komplett.
+// Längre än fem byte räknas som trasig och ger value Infinity.
+function readVarint(buf, offset, end) {
+	let value = 0;
+	let scale = 1;
+	for (let i = 0; i < 5; i++) {
+		if (offset >= end) return null;
+		const b = buf[offset++];
+		value += (b & 0x7f) * scale;
+		if ((b & 0x80) === 0) return { value, offset };
+		scale *= 128;
+	}
+	return { value: Infinity, offset };
+}
+
+// --- Snabbväg för game ---
+//
+// Game-meddelanden skickas vidare utan att tolkas. Meddelandet gås igenom en
+// gång utan att några objekt byggs, och data skickas vidare som de byte
+// klienten skickade. Allt som inte är enkelt tolkas fullt ut som tidigare.
+
+function skipSpace(buf, i, end, state) {
+	while (i < end) {
+		const c = buf[i];
+		if (c === 0x20 || c === 0x09 || c === 0x0d) {
+			i++;
+		} else if (c === 0x0a) {
+			state.newline = true;
+			i++;
+		} else {
+			break;
+		}
+	}
+	return i;
+}
+
+function isHex(c) {
+	return (c >= 0x30 && c <= 0x39) || (c >= 0x41 && c <= 0x46) || (c >= 0x61 && c <= 0x66);
+}
+
+// buf[i] är '"'. Returnerar positionen efter strängen eller -1. UTF-8
+// kontrolleras inte här utan för hela data på en gång.
+function skipString(buf, i, end, state) {
+	i++;
+	for (;;) {
+		let c = 0;
+		while (i < end && (c = buf[i]) !== 0x22 && c !== 0x5c && c >= 0x20) i++;
+		if (i >= end || c < 0x20) return -1;
+		i++;
+		if (c === 0x22) return i;
+
+		state.escaped = true;
+		if (i >= end) return -1;
+		const e = buf[i++];
+		if (e === 0x75) {
+			if (i + 4 > end || !isHex(buf[i]) || !isHex(buf[i + 1]) || !isHex(buf[i + 2]) || !isHex(buf[i + 3])) return -1;
+			i += 4;
+		} else if (e !== 0x22 && e !== 0x5c && e !== 0x2f && e !== 0x62 && e !== 0x66 && e !== 0x6e && e !== 0x72 && e !== 0x74) {
+			return -1;
+		}
+	}
+}
+
+// Utan buffer.isUtf8 (äldre Node) räcker det att allt är ASCII
+function isValidUtf8(buf) {
+	if (isUtf8) return isUtf8(buf);
+	for (let i = 0; i < buf.length; i++) {
+		if (buf[i] >= 0x80) return false;
+	}
+	return true;
+}
+
+// Jämför utan att skapa någon sträng
+function bytesAre(buf, i, end, text) {
+	if (end - i < text.length) return false;
+	for (let k = 0; k < text.length; k++) {
+		if (buf[i + k] !== text.charCodeAt(k)) return false;
+	}
+	return true;
+}
+
+function skipDigits(buf, i, end) {
+	const start = i;
+	while (i < end && buf[i] >= 0x30 && buf[i] <= 0x39) i++;
+	return i > start ? i : -1;
+}
+
+// Tal, true, false eller null
+function skipScalar(buf, i, end, state) {
+	const c = buf[i];
+	if (c === 0x74) return bytesAre(buf, i, end, "true") ? i + 4 : -1;
+	if (c === 0x66) return bytesAre(buf, i, end, "false") ? i + 5 : -1;
+	if (c === 0x6e) return bytesAre(buf, i, end, "null") ? i + 4 : -1;
+
+	const start = i;
+	if (c === 0x2d) i++;
+	if (i < end && buf[i] === 0x30) {
+		i++;
+	} else {
+		i = skipDigits(buf, i, end);
+		if (i < 0) return -1;
+	}
+	if (i < end && buf[i] === 0x2e) {
+		i = skipDigits(buf, i + 1, end);
+		if (i < 0) return -1;
+	}
+	if (i < end && (buf[i] === 0x65 || buf[i] === 0x45)) {
+		i++;
+		if (i < end && (buf[i] === 0x2b || buf[i] === 0x2d)) i++;
+		i = skipDigits(buf, i, end);
+		if (i < 0) return -1;
+		state.wideNumber = true;
+	}
+	// Långa tal kanske inte ryms hos en mottagare som använder jansson
+	if (i - start > 15) state.wideNumber = true;
+	return i;
+}
+
+// Nyckel och ':' i ett objekt. Returnerar positionen efter ':' eller -1.
+function skipKey(buf, i, end, state) {
+	i = skipSpace(buf, i, end, state);
+	if (i >= end || buf[i] !== 0x22) return -1;
+	i = skipString(buf, i, end, state);
+	if (i < 0) return -1;
+	i = skipSpace(buf, i, end, state);
+	return i < end && buf[i] === 0x3a ? i + 1 : -1;
+}
+
+// Nästlingen hålls i en egen stack så att djup data inte kan spränga
+// anropsstacken. Den delas, skipValue anropar aldrig sig själv.
+const scanStack = new Uint8Array(SCAN_DEPTH);
+
+// Går igenom ett JSON-värde utan att bygga något. Returnerar positionen
+// efter värdet eller -1 om det inte är giltig JSON.
+function skipValue(buf, i, end, state) {
+	let depth = 0;
+
+	for (;;) {
+		i = skipSpace(buf, i, end, state);
+		if (i >= end) return -1;
+
+		const c = buf[i];
+		if (c === 0x7b || c === 0x5b) {
+			i = skipSpace(buf, i + 1, end, state);
+			// '}' och ']' ligger två steg efter '{' och '['
+			if (i < end && buf[i] === c + 2) {
+				i++;
+			} else {
+				if (depth >= SCAN_DEPTH) return -1;
+				scanStack[depth++] = c;
+				if (c === 0x7b && (i = skipKey(buf, i, end, state)) < 0) return -1;
+				continue;
+			}
+		} else if (c === 0x22) {
+			i = skipString(buf, i, end, state);
+		} else {
+			i = skipScalar(buf, i, end, state);
+		}
+		if (i < 0) return -1;
+
+		// Efter ett värde kommer ',' eller slutet på behållaren
+		for (;;) {
+			if (depth === 0) return i;
+
+			i = skipSpace(buf, i, end, state);
+			if (i >= end) return -1;
+
+			const top = scanStack[depth - 1];
+			if (buf[i] === 0x2c) {
+				i++;
+				if (top === 0x7b && (i = skipKey(buf, i, end, state)) < 0) return -1;
+				break;
+			}
+			if (buf[i] !== top + 2) return -1;
+			depth--;
+			i++;
+		}
+	}
+}
+
+function keyIs(buf, start, end, name) {
+	return end - start === name.length && bytesAre(buf, start, end, name);
+}
+
+// Data som ska skickas vidare: det klienten skickade om det är ett objekt
+// (eller array och null när det kommer som text, precis som typeof "object"),
+// annars {}. Returnerar null om det måste tolkas fullt ut.
+function forwardData(buf, start, end, state, allowAny) {
+	// Rader får inte innehålla radbrytningar, ogiltig UTF-8 ska ersättas och
+	// stora tal skrivas om precis som när det tolkas
+	if (state.newline || state.wideNumber) return null;
+
+	if (start < 0) return EMPTY_DATA;
+	const c = buf[start];
+	if (c === 0x7b || (allowAny && (c === 0x5b || c === 0x6e))) {
+		const data = buf.subarray(start, end);
+		if (!isValidUtf8(data)) return null;
+		return Buffer.from(data);
+	}
+	return EMPTY_DATA;
+}
+
+// Plockar ut session, destination och data ur ett game-meddelande.
+// Returnerar null om det inte är ett game-meddelande som kan tas den snabba vägen.
+function scanGameMessage(buf) {
+	const end = buf.length;
+	const state = { newline: false, escaped: false, wideNumber: false };
+
+	let isGame = false;
+	let identifier = false;
+	let session = null;
+	let destination = null;
+	let dataStart = -1;
+	let dataEnd = -1;
+
+	let i = skipSpace(buf, 0, end, state);
+	if (i >= end || buf[i] !== 0x7b) return null;
+	i = skipSpace(buf, i + 1, end, state);
+
+	if (i < end && buf[i] !== 0x7d) {
+		for (;;) {
+			if (i >= end || buf[i] !== 0x22) return null;
+
+			state.escaped = false;
+			const keyStart = i + 1;
+			i = skipString(buf, i, end, state);
+			if (i < 0 || state.escaped) return null;
+			const keyEnd = i - 1;
+
+			i = skipSpace(buf, i, end, state);
+			if (i >= end || buf[i] !== 0x3a) return null;
+			i = skipSpace(buf, i + 1, end, state);
+
+			state.escaped = false;
+			const valueStart = i;
+			const isString = i < end && buf[i] === 0x22;
+			i = skipValue(buf, i, end, state);
+			if (i < 0) return null;
+
+			// Som vid JSON.parse gäller den sista av flera likadana nycklar
+			if (keyIs(buf, keyStart, keyEnd, "cmd")) {
+				if (isString && state.escaped) return null;
+				isGame = isString && keyIs(buf, valueStart + 1, i - 1, "game");
+			} else if (keyIs(buf, keyStart, keyEnd, "identifier")) {
+				identifier = isString;
+			} else if (keyIs(buf, keyStart, keyEnd, "session")) {
+				if (isString && state.escaped) return null;
+				session = isString ? buf.toString("utf8", valueStart + 1, i - 1) : null;
+			} else if (keyIs(buf, keyStart, keyEnd, "destination")) {
+				if (isString && state.escaped) return null;
+				destination = isString ? buf.toString("utf8", valueStart + 1, i - 1) : null;
+			} else if (keyIs(buf, keyStart, keyEnd, "data")) {
+				dataStart = valueStart;
+				dataEnd = i;
+			}
+
+			i = skipSpace(buf, i, end, state);
+			if (i < end && buf[i] === 0x2c) {
+				i = skipSpace(buf, i + 1, end, state);
+				continue;
+			}
+			if (i >= end || buf[i] !== 0x7d) return null;
+			break;
+		}
+	}
+
+	if (skipSpace(buf, i + 1, end, state) !== end) return null;
+
+	// Saknad identifier ger ett felsvar, det sköts av den vanliga vägen
+	if (!isGame || !identifier) return null;
+
+	const data = forwardData(buf, dataStart, dataEnd, state, true);
+	if (!data) return null;
+
+	return { session, destination, data };
+}
+
+// Samlar inkommande data utan att slå ihop den för varje paket. Rader söks
+// bara igenom en gång och ramar kopieras först när de är kompletta, så en
+// lång rad eller stor ram som kommer i många delar blir inte kvadratisk.
+class FrameReader {
+	chunks = [];
+	first = 0;        // index för första chunk som inte är förbrukad
+	length = 0;       // olästa byte
+	scanChunk = 0;    // var sökningen efter '\n' i en påbörjad rad fortsätter
+	scanPosition = 0; // olästa byte före scanChunk
+	needed = 0;       // storlek på påbörjad ram, 0 om den inte är känd
+
+	push(chunk) {
+		this.chunks.push(chunk);
+		this.length += chunk.length;
+	}
+
+	// Returnerar { type, body } där type är 0 för en rad, null om mer data
+	// behövs och false om ramen är trasig
+	next() {
+		if (this.length === 0 || this.length < this.needed) return null;
+
+		const type = this.chunks[this.first][0];
+		if (type === FRAME_GAME || type === FRAME_JSON) {
+			const head = this.peek(6);
+			const header = readVarint(head, 1, Math.min(6, head.length));
+			if (!header) return null;
+			if (header.value > MAX_FRAME) return false;
+
+			const total = header.offset + header.value;
+			if (this.length < total) {
+				this.needed = total;
+				return null;
+			}
+
+			const frame = this.take(total);
+			return { type, body: frame.subarray(header.offset) };
+		}
+
+		// Rad: sök bara igenom det som tillkommit sedan förra gången
+		while (this.scanChunk < this.chunks.length) {
+			const chunk = this.chunks[this.scanChunk];
+			const index = chunk.indexOf(0x0a);
+			if (index !== -1) {
+				const line = this.take(this.scanPosition + index + 1);
+				return { type: 0, body: line.subarray(0, line.length - 1) };
+			}
+
+			this.scanPosition += chunk.length;
+			this.scanChunk++;
+		}
+
+		if (this.length > MAX_FRAME) return false;
+		return null;
+	}
+
+	// Minst de första n byten om så många finns, utan att ta bort dem
+	peek(n) {
+		if (this.chunks[this.first].length >= n) return this.chunks[this.first];
+
+		const parts = [];
+		let count = 0;
+		for (let i = this.first; i < this.chunks.length && count < n; i++) {
+			parts.push(this.chunks[i]);
+			count += this.chunks[i].length;
+		}
+		return Buffer.concat(parts);
+	}
+
+	// Tar ut de första n byten, kopierar bara om de ligger i flera delar
+	take(n) {
+		let out;
+		const head = this.chunks[this.first];
+		if (head.length >= n) {
+			out = head.subarray(0, n);
+			this.consume(n);
+		} else {
+			out = Buffer.allocUnsafe(n);
+			let copied = 0;
+			while (copied < n) {
+				const chunk = this.chunks[this.first];
+				const count = Math.min(chunk.length, n - copied);
+				chunk.copy(out, copied, 0, count);
+				copied += count;
+				this.consume(count);
+			}
+		}
+
+		this.length -= n;
+		this.scanChunk = this.first;
+		this.scanPosition = 0;
+		this.needed = 0;
+		return out;
+	}
+
+	consume(count) {
+		const chunk = this.chunks[this.first];
+		if (count < chunk.length) {
+			this.chunks[this.first] = chunk.subarray(count);
+			return;
+		}
+
+		this.chunks[this.first++] = null;
+		if (this.first === this.chunks.length) {
+			this.chunks = [];
+			this.first = 0;
+		} else if (this.first >= 1024 && this.first * 2 >= this.chunks.length) {
+			this.chunks = this.chunks.slice(this.first);
+			this.first = 0;
+		}
+	}
+}
+
 class mpapiServer {
 	servers = [];
 	sessions = new Map();
 
+	// Klienter som kan återuppta sin session, nyckel resumeToken
+	resumeTokens = new Map();
+
+	// Publika sessioner per identifier, i den ordning de blev publika. Varje
+	// session har sin post i list-svaret färdig i session.listEntry.
+	publicSessions = new Map();
+
 	wss = null;
 	tcpServer = null;
 
@@ -19,6 +451,11 @@ class mpapiServer {
 		this.path = options.path || "/net";
 		this.tcpPort = options.tcpPort;
 
+		// Hur länge en tappad klient får vara borta, och hur många game-meddelanden
+		// per session som sparas för att kunna skickas om
+		this.resumeGraceMs = typeof options.resumeGraceMs === "number" ? options.resumeGraceMs : 30000;
+		this.replayLimit = typeof options.replayLimit === "number" ? options.replayLimit : 1024;
+
 		this.wss = new WebSocket.Server(
 			{
 				noServer: true
@@ -87,7 +524,7 @@ class mpapiServer {
 			isOpen: () => ws.readyState === WebSocket.OPEN
 		};
 
-		ws.on("message", (message) => this.handleMessage(client, message.toString()));
+		ws.on("message", (message) => this.handleMessage(client, Buffer.isBuffer(message) ? message : Buffer.from(message.toString())));
 		ws.on("close", () => this.handleClose(client));
 		ws.on("error", () => this.handleClose(client));
 	}
@@ -97,33 +534,54 @@ class mpapiServer {
 	handleTcpConnection(socket) {
 		console.log("New TCP mpapi connection");
 
-		socket.setEncoding("utf8");
-
 		const client = {
 			type: "tcp",
 			socket,
-			buffer: "",
+			reader: new FrameReader(),
 			sessionId: null,
 			clientId: randomUUID(),
 			isHost: false,
 			messageId: 0,
+			binary: false,
+			framing: "newline",
 			send: (jsonString) => {
-				if (!socket.destroyed) {
+				if (socket.destroyed) return;
+
+				if (client.framing === "length") {
+					const length = Buffer.byteLength(jsonString);
+					const frame = Buffer.allocUnsafe(1 + varintLength(length) + length);
+					frame[0] = FRAME_JSON;
+					frame.write(jsonString, writeVarint(frame, 1, length));
+					socket.write(frame);
+				} else {
 					// Varje JSON‑meddelande avslutas med '\n'
 					socket.write(jsonString + "\n");
 				}
 			},
+			writeFrame: (frame) => {
+				if (!socket.destroyed) {
+					socket.write(frame);
+				}
+			},
 			isOpen: () => !socket.destroyed
 		};
 
+		// Data tas emot som Buffer så att textrader och ramar kan blandas;
+		// text avkodas som UTF-8 först när meddelandet är komplett
 		socket.on("data", (chunk) => {
-			client.buffer += chunk.toString();
-			let index;
-			while ((index = client.buffer.indexOf("\n")) !== -1) {
-				const line = client.buffer.slice(0, index).trim();
-				client.buffer = client.buffer.slice(index + 1);
-				if (line.length > 0) {
-					this.handleMessage(client, line);
+			client.reader.push(chunk);
+
+			let frame;
+			while ((frame = client.reader.next()) !== null) {
+				if (frame === false) {
+					socket.destroy();
+					return;
+				}
+
+				if (frame.type === FRAME_GAME) {
+					this.handleGameFrame(client, frame.body);
+				} else {
+					this.handleMessage(client, frame.body);
 				}
 			}
 		});
@@ -136,6 +594,19 @@ class mpapiServer {
 	// --- Gemensam meddelandehantering ---
 
 	handleMessage(client, message) {
+		if (Buffer.isBuffer(message)) {
+			// Game skickas vidare utan att tolkas och utan att loggas
+			const game = scanGameMessage(message);
+			if (game) {
+				const session = game.session !== null ? this.sessions.get(game.session) : null;
+				if (session) this.routeGame(client, session, game.destination, game.data);
+				return;
+			}
+
+			message = message.toString("utf8").trim();
+			if (message.length === 0) return;
+		}
+
 		let payload;
 		try {
 			if (typeof message !== "string") {
@@ -164,6 +635,9 @@ class mpapiServer {
 		let sessionId = typeof payload.session === "string" ? payload.session : null;
 		const clientId = client.clientId;
 
+		// Skickas tillbaka i svaret så att klienten kan para ihop svar och förfrågan
+		const requestId = typeof payload.requestId === "number" || typeof payload.requestId === "string" ? payload.requestId : undefined;
+
 		console.log("Identifier:", identifier, "Command:", cmd, "Session ID:", sessionId, "Client ID:", clientId);
 
 		switch (cmd) {
@@ -188,23 +662,32 @@ class mpapiServer {
 						hostMigration: data.hostMigration === true ? true : false,
 						host: client,
 						payload: data.payload || null,
-						clients: [client]
+						clients: [client],
+						nextHandle: 1
 					};
 
 					this.sessions.set(sessionId, session);
+					this.updateListing(sessionId, session);
 
 					client.sessionId = sessionId;
+					client.handle = 0;
 
 					client.send(JSON.stringify({
 						session: sessionId,
 						cmd: "host",
+						requestId,
 						clientId: client.clientId,
 						name: session.name,
 						maxClients: session.maxClients,
 						hostMigration: session.hostMigration,
 						isPrivate: session.isPrivate,
 						clients: session.clients.map(c => c.clientId),
+						handle: client.handle,
+						handles: session.clients.map(c => c.handle),
 						payload: data.payload || {},
+						resumeToken: this.enableResume(client, payload),
+						binary: this.enableBinary(client, payload),
+						framing: this.enableFraming(client, payload)
 					}));
 				} break;
 
@@ -216,6 +699,7 @@ class mpapiServer {
 					client.send(JSON.stringify({
 						session: sessionId,
 						cmd: "host_setup",
+						requestId,
 						clientId: client.clientId,
 						data: { status: "error", reason: "identifier_mismatch" }
 					}));
@@ -226,6 +710,7 @@ class mpapiServer {
 					client.send(JSON.stringify({
 						session: sessionId,
 						cmd: "host_setup",
+						requestId,
 						clientId: client.clientId,
 						data: { status: "error", reason: "not_host" }
 					}));
@@ -253,9 +738,12 @@ class mpapiServer {
 					session.payload = data.payload;
 				}
 
+				this.updateListing(sessionId, session);
+
 				client.send(JSON.stringify({
 					session: sessionId,
 					cmd: "host_setup",
+					requestId,
 					clientId: client.clientId,
 					data: { status: "ok" }
 				}));
@@ -269,6 +757,7 @@ class mpapiServer {
 						client.send(JSON.stringify({
 							session: sessionId,
 							cmd: "join",
+							requestId,
 							clientId: client.clientId,
 							error: "session_not_found"
 						}));
@@ -279,6 +768,7 @@ class mpapiServer {
 						client.send(JSON.stringify({
 							session: sessionId,
 							cmd: "join",
+							requestId,
 							clientId: client.clientId,
 							error: "identifier_mismatch"
 						}));
@@ -289,6 +779,7 @@ class mpapiServer {
 						client.send(JSON.stringify({
 							session: sessionId,
 							cmd: "join",
+							requestId,
 							clientId: client.clientId,
 							error: "session_full"
 						}));
@@ -299,6 +790,7 @@ class mpapiServer {
 						client.send(JSON.stringify({
 							session: sessionId,
 							cmd: "join",
+							requestId,
 							clientId: client.clientId,
 							error: "already_joined"
 						}));
@@ -306,10 +798,12 @@ class mpapiServer {
 					}
 
 					client.sessionId = sessionId;
+					client.handle = session.nextHandle++;
 
 					client.send(JSON.stringify({
 						session: sessionId,
 						cmd: "join",
+						requestId,
 						clientId: client.clientId,
 						hostId: session.host.clientId,
 						name: session.name,
@@ -317,13 +811,19 @@ class mpapiServer {
 						hostMigration: session.hostMigration,
 						isPrivate: session.isPrivate,
 						clients: session.clients.map(c => c.clientId),
-						payload: session.payload || {}
+						handle: client.handle,
+						handles: session.clients.map(c => c.handle),
+						payload: session.payload || {},
+						resumeToken: this.enableResume(client, payload),
+						binary: this.enableBinary(client, payload),
+						framing: this.enableFraming(client, payload)
 					}));
 
 					const joinedData = JSON.stringify({
 						session: sessionId,
 						cmd: "joined",
 						clientId: client.clientId,
+						handle: client.handle,
 						data
 					});
 
@@ -335,6 +835,7 @@ class mpapiServer {
 					});
 
 					session.clients.push(client);
+					this.updateListing(sessionId, session);
 
 				} break;
 
@@ -346,6 +847,7 @@ class mpapiServer {
 					let index = session.clients.indexOf(client);
 					if (index !== -1) {
 						session.clients.splice(index, 1);
+						this.updateListing(sessionId, session);
 					}
 
 					const leavedData = JSON.stringify({
@@ -360,63 +862,384 @@ class mpapiServer {
 						}
 					});
 
+					// Den som lämnar frivilligt ska inte kunna återuppta
+					this.dropResume(client);
 					this.handleClose(client);
 
 				} break;
 
 			case "list":
+				client.send(this.listSessions(identifier, requestId, data));
+				break;
+
+			case "game":
 				{
-					let data = {
-						cmd: "list",
-						data: {
-							list: []
-						}
-					};
+					let session = this.sessions.get(sessionId);
+					if (!session) return;
 
-					for (const [key, session] of this.sessions) {
+					const destination = typeof payload.destination === "string" ? payload.destination : null;
+					this.routeGame(client, session, destination, Buffer.from(JSON.stringify(data)));
+				} break;
 
-						if (!session.isPrivate && session.identifier === identifier) {
-							data.data.list.push({
-								id: key,
-								name: session.name,
-								clients: session.clients.map(c => c.clientId)
-							});
-						}
-					}
+			case "resume":
+				this.resumeClient(client, identifier, requestId, sessionId, data, payload);
+				break;
+		}
 
+	}
 
-					client.send(JSON.stringify(data));
+	// --- Sessionslistan ---
 
-				} break;
+	// Uppdaterar sessionens post i listan. Anropas när namn, synlighet eller
+	// klienter ändrats och när sessionen tas bort.
+	updateListing(sessionId, session, removed = false) {
+		let index = this.publicSessions.get(session.identifier);
 
-			case "game":
-				{
-					let session = this.sessions.get(sessionId);
-					if (!session) return;
+		if (removed || session.isPrivate) {
+			if (index && index.delete(sessionId) && index.size === 0) {
+				this.publicSessions.delete(session.identifier);
+			}
+			return;
+		}
 
-					const destination = typeof payload.destination === "string" ? payload.destination : null;
+		session.listEntry = JSON.stringify({
+			id: sessionId,
+			name: session.name,
+			clients: session.clients.map(c => c.clientId)
+		});
 
-					const serialized = JSON.stringify({
-						cmd: "game",
-						messageId: session.messageId++,
-						clientId: client.clientId,
-						broadcast: destination ? false : true,
-						data
-					});
+		if (!index) {
+			index = new Map();
+			this.publicSessions.set(session.identifier, index);
+		}
+		if (!index.has(sessionId)) index.set(sessionId, session);
+	}
+
+	// Svaret på list byggs av de färdiga posterna. Urvalet kan begränsas med
+	// offset och limit (sidor), notFull och namePrefix i data.
+	listSessions(identifier, requestId, data) {
+		const options = data || {};
+		const offset = Number.isInteger(options.offset) && options.offset > 0 ? options.offset : 0;
+		const limit = Number.isInteger(options.limit) && options.limit > 0 ? options.limit : Infinity;
+		const notFull = options.notFull === true;
+		const prefix = typeof options.namePrefix === "string" ? options.namePrefix : "";
+
+		const entries = [];
+		let skipped = 0;
+		const index = this.publicSessions.get(identifier);
+		if (index) {
+			for (const session of index.values()) {
+				if (entries.length >= limit) break;
+				if (notFull && session.maxClients > 0 && session.clients.length >= session.maxClients) continue;
+				if (prefix && !session.name.startsWith(prefix)) continue;
+				if (skipped < offset) {
+					skipped++;
+					continue;
+				}
+				entries.push(session.listEntry);
+			}
+		}
 
-					for (let other of session.clients) {
-						if (!destination || other.clientId === destination) {
-							if (other.isOpen())
-								other.send(serialized);
+		return '{"cmd":"list"' + (requestId !== undefined ? ',"requestId":' + JSON.stringify(requestId) : "") +
+			',"data":{"list":[' + entries.join(",") + "]}}";
+	}
 
-						}
-					}
-				} break;
+	// --- Game-meddelanden ---
+
+	// Binär game-ram från en klient som förhandlat fram binärt läge.
+	// Sessionen ges av anslutningen, så identifier och session behövs inte.
+	handleGameFrame(client, body) {
+		const session = client.sessionId ? this.sessions.get(client.sessionId) : null;
+		if (!session || body.length === 0) return;
+
+		const flags = body[0];
+		let offset = 1;
+
+		if (flags & GAME_COMPACT) return;
+
+		let destination = null;
+		if (flags & GAME_DIRECTED) {
+			const handle = readVarint(body, offset, body.length);
+			if (!handle) return;
+			offset = handle.offset;
+
+			const target = session.clients.find(c => c.handle === handle.value);
+			if (!target) return;
+			destination = target.clientId;
+		}
+
+		// Data som inte är ett objekt skickas vidare som {} precis som för text
+		const state = { newline: false, escaped: false, wideNumber: false };
+		const start = skipSpace(body, offset, body.length, state);
+		const end = skipValue(body, start, body.length, state);
+		if (end < 0 || skipSpace(body, end, body.length, state) !== body.length) return;
+
+		let data = forwardData(body, start, end, state, false);
+		if (!data) {
+			let parsed;
+			try {
+				parsed = JSON.parse(body.toString("utf8", offset));
+			} catch (e) {
+				return;
+			}
+			data = parsed && typeof parsed === "object" && !Array.isArray(parsed) ? Buffer.from(JSON.stringify(parsed)) : EMPTY_DATA;
 		}
 
+		this.routeGame(client, session, destination, data);
+	}
+
+	// data är JSON-text i en Buffer utan radbrytningar. Den tolkas aldrig,
+	// utan fogas in som den är i både text och binära ramar.
+	routeGame(client, session, destination, data) {
+		const entry = {
+			messageId: session.messageId++,
+			destination,
+			clientId: client.clientId,
+			handle: client.handle,
+			data
+		};
+
+		let resumable = false;
+		for (let other of session.clients) {
+			if (other.resumeToken) resumable = true;
+			if (!destination || other.clientId === destination) {
+				if (other.isOpen())
+					this.sendGame(other, entry);
+
+			}
+		}
+
+		// Sparas så att en klient som återansluter kan få det den missat
+		if (resumable) {
+			if (!session.replay) session.replay = new Array(this.replayLimit);
+			session.replay[entry.messageId % this.replayLimit] = entry;
+		}
+	}
+
+	// Textformen och den binära ramen byggs först när någon behöver dem,
+	// och högst en gång per meddelande
+	sendGame(client, entry) {
+		if (client.binary) {
+			if (!entry.frame) entry.frame = this.buildGameFrame(entry);
+			client.writeFrame(entry.frame);
+		} else {
+			if (!entry.serialized) {
+				entry.serialized = '{"cmd":"game","messageId":' + entry.messageId +
+					',"clientId":' + JSON.stringify(entry.clientId) +
+					',"broadcast":' + (entry.destination ? "false" : "true") +
+					',"data":' + entry.data.toString("utf8") + "}";
+			}
+			client.send(entry.serialized);
+		}
+	}
+
+	buildGameFrame(entry) {
+		const payload = entry.data;
+		const bodyLength = 1 + varintLength(entry.messageId) + varintLength(entry.handle) + payload.length;
+
+		const frame = Buffer.allocUnsafe(1 + varintLength(bodyLength) + bodyLength);
+		let offset = 0;
+		frame[offset++] = FRAME_GAME;
+		offset = writeVarint(frame, offset, bodyLength);
+		frame[offset++] = entry.destination ? GAME_DIRECTED : 0;
+		offset = writeVarint(frame, offset, entry.messageId);
+		offset = writeVarint(frame, offset, entry.handle);
+		payload.copy(frame, offset);
+		return frame;
+	}
+
+	// Längdprefixerade JSON-meddelanden för TCP-klienter som bett om det med
+	// framing: "length". Svaret där det bekräftas skickas redan som ram.
+	enableFraming(client, payload) {
+		if (client.type !== "tcp") return undefined;
+		client.framing = payload.framing === "length" ? "length" : "newline";
+		return client.framing === "length" ? "length" : undefined;
+	}
+
+	// Binära ramar bara för TCP-klienter som bett om det med binary: 1
+	enableBinary(client, payload) {
+		client.binary = payload.binary === 1 && typeof client.writeFrame === "function";
+		return client.binary ? 1 : undefined;
+	}
+
+	// --- Återupptagning av sessioner ---
+
+	// Ger klienten en resumeToken om den bett om det med resumable: true
+	enableResume(client, payload) {
+		if (payload.resumable !== true) return undefined;
+
+		if (!client.resumeToken) {
+			client.resumeToken = randomUUID();
+			this.resumeTokens.set(client.resumeToken, client);
+		}
+		// Det som skickades innan klienten kom med ska inte spelas upp igen
+		const session = this.sessions.get(client.sessionId);
+		client.resumeFrom = session ? session.messageId : 0;
+		return client.resumeToken;
+	}
+
+	dropResume(client) {
+		if (client.resumeToken) {
+			this.resumeTokens.delete(client.resumeToken);
+			client.resumeToken = null;
+		}
+		if (client.resumeTimer) {
+			clearTimeout(client.resumeTimer);
+			client.resumeTimer = null;
+		}
+	}
+
+	// Klienten ligger kvar i sessionen utan anslutning. Det som skickas till
+	// den sparas tills den återansluter eller tiden går ut.
+	detachClient(client) {
+		console.log("Client detached:", client.clientId);
+
+		const session = this.sessions.get(client.sessionId);
+		const socket = client.socket;
+
+		client.detached = true;
+		client.detachedAt = session.messageId;
+		// Det som hålls kvar sparas som text, den nya anslutningen kan ta emot båda
+		client.binary = false;
+		client.held = [];
+		client.send = (jsonString) => {
+			if (client.held.length < this.replayLimit) {
+				client.held.push(jsonString);
+			} else {
+				client.heldOverflow = true;
+			}
+		};
+		client.isOpen = () => true;
+
+		client.resumeTimer = setTimeout(() => {
+			client.resumeTimer = null;
+			this.expireClient(client);
+		}, this.resumeGraceMs);
+
+		// Den gamla anslutningen kan fortfarande vara halvöppen
+		try {
+			if (client.type === "tcp") socket.destroy();
+			else socket.terminate();
+		} catch (e) {
+
+		}
+	}
+
+	expireClient(client) {
+		this.dropResume(client);
+		client.send = () => { };
+		client.isOpen = () => false;
+		this.finishClose(client);
+	}
+
+	resumeClient(client, identifier, requestId, sessionId, data, payload) {
+		const token = typeof data.resumeToken === "string" ? data.resumeToken : null;
+		let lastMessageId = typeof data.lastMessageId === "number" ? data.lastMessageId : -1;
+		const old = token ? this.resumeTokens.get(token) : null;
+		const session = old ? this.sessions.get(old.sessionId) : null;
+
+		const reject = (reason) => {
+			client.send(JSON.stringify({
+				session: sessionId,
+				cmd: "resume",
+				requestId,
+				clientId: client.clientId,
+				error: reason
+			}));
+		};
+
+		if (!old || !session || old === client) {
+			reject("unknown_token");
+			return;
+		}
+		lastMessageId = Math.max(lastMessageId, old.resumeFrom - 1);
+
+		if (session.identifier !== identifier) {
+			reject("identifier_mismatch");
+			return;
+		}
+
+		// Servern har inte märkt att den gamla anslutningen är död
+		if (!old.detached) {
+			this.detachClient(old);
+		}
+
+		// Allt mellan lastMessageId och frånkopplingen måste finnas kvar
+		for (let id = lastMessageId + 1; id < old.detachedAt; id++) {
+			const entry = session.replay ? session.replay[id % this.replayLimit] : null;
+			if (!entry || entry.messageId !== id) {
+				reject("replay_unavailable");
+				this.expireClient(old);
+				return;
+			}
+		}
+
+		if (old.heldOverflow) {
+			reject("replay_unavailable");
+			this.expireClient(old);
+			return;
+		}
+
+		clearTimeout(old.resumeTimer);
+		old.resumeTimer = null;
+
+		// Den nya anslutningen tar över klientens identitet och plats i sessionen
+		client.clientId = old.clientId;
+		client.sessionId = old.sessionId;
+		client.handle = old.handle;
+		client.resumeToken = old.resumeToken;
+		client.resumeFrom = old.resumeFrom;
+		this.resumeTokens.set(client.resumeToken, client);
+
+		const index = session.clients.indexOf(old);
+		if (index !== -1) {
+			session.clients[index] = client;
+		}
+		if (session.host === old) {
+			session.host = client;
+		}
+
+		const held = old.held;
+		old.send = () => { };
+		old.isOpen = () => false;
+
+		console.log("Client resumed:", client.clientId);
+
+		client.send(JSON.stringify({
+			session: client.sessionId,
+			cmd: "resume",
+			requestId,
+			clientId: client.clientId,
+			hostId: session.host.clientId,
+			resumeToken: client.resumeToken,
+			binary: this.enableBinary(client, payload),
+			framing: this.enableFraming(client, payload)
+		}));
+
+		for (let id = lastMessageId + 1; id < old.detachedAt; id++) {
+			const entry = session.replay[id % this.replayLimit];
+			if (!entry.destination || entry.destination === client.clientId) {
+				this.sendGame(client, entry);
+			}
+		}
+
+		held.forEach((jsonString) => client.send(jsonString));
 	}
 
 	handleClose(client) {
+		// Anropas för både end, close och error
+		if (client.detached) return;
+
+		// Klienter med resumeToken får en stund på sig att återansluta
+		if (client.resumeToken && client.sessionId && this.sessions.has(client.sessionId)) {
+			this.detachClient(client);
+			return;
+		}
+
+		this.finishClose(client);
+	}
+
+	finishClose(client) {
 		console.log("Client disconnected:", client.clientId);
 
 		// Ta bort klienten från dess session
@@ -426,6 +1249,12 @@ class mpapiServer {
 			const index = session.clients.indexOf(client);
 			if (index !== -1) {
 				session.clients.splice(index, 1);
+				this.updateListing(sessionId, session);
+			}
+
+			// Replay-ringen behövs bara så länge någon i sessionen kan återuppta
+			if (session.replay && !session.clients.some((other) => other.resumeToken)) {
+				session.replay = null;
 			}
 
 			// Om klienten var host, ta bort hela sessionen och informera övriga klienter
@@ -460,6 +1289,7 @@ class mpapiServer {
 					});
 
 					this.sessions.delete(sessionId);
+					this.updateListing(sessionId, session, true);
 				}
 
 
@@ -112,8 +112,14 @@ int main_list(mpapi* api)
 {
 	printf("Hämtar lista över publika sessioner...\n");
 
+	/* Bara sessioner som går att gå med i, högst 20 åt gången. Nästa sida
+	   hämtas med offset = 20 osv. */
+	mpapi_list_filter filter = { 0 };
+	filter.limit = 20;
+	filter.notFull = true;
+
 	json_t *sessionList = NULL;
-	int rc = mpapi_list(api, &sessionList);
+	int rc = mpapi_list(api, &filter, &sessionList);
 	if (rc != MPAPI_OK) {
 		printf("Kunde inte hämta session-lista: %d\n", rc);
 		return -1;
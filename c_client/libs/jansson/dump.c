@@ -18,6 +18,13 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define DUMP_HAVE_AVX2 1
+#endif
 
 #include "jansson.h"
 #include "strbuffer.h"
@@ -102,6 +109,77 @@ static int dump_indent(size_t flags, int depth, int space, json_dump_callback_t
     return 0;
 }
 
+/* Finding the next byte that may need escaping: '"', '\\', a control
+   character, a non-ASCII byte or, if slash is set, '/'. The vector
+   versions stop at the first such byte or when less than a full vector
+   remains, and the plain loop does the rest. AVX2 is used only if the
+   CPU has it, so the library still runs on older machines. */
+
+#ifdef DUMP_HAVE_AVX2
+__attribute__((target("avx2")))
+static const char *find_special_avx2(const char *p, const char *end, int slash)
+{
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i space = _mm256_set1_epi8(0x20);
+    const __m256i solidus = _mm256_set1_epi8(slash ? '/' : '"');
+
+    while(end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        /* signed compare: bytes 0x80-0xFF are negative */
+        __m256i m = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash)),
+            _mm256_or_si256(_mm256_cmpgt_epi8(space, v), _mm256_cmpeq_epi8(v, solidus)));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(m);
+        if(mask)
+            return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    return p;
+}
+#endif
+
+#ifdef __SSE2__
+static const char *find_special_sse2(const char *p, const char *end, int slash)
+{
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i solidus = _mm_set1_epi8(slash ? '/' : '"');
+
+    while(end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+            _mm_or_si128(_mm_cmplt_epi8(v, space), _mm_cmpeq_epi8(v, solidus)));
+        int mask = _mm_movemask_epi8(m);
+        if(mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return p;
+}
+#endif
+
+static const char *find_special(const char *p, const char *end, int slash)
+{
+#ifdef DUMP_HAVE_AVX2
+    if(end - p >= 32 && __builtin_cpu_supports("avx2"))
+        p = find_special_avx2(p, end, slash);
+#endif
+#ifdef __SSE2__
+    p = find_special_sse2(p, end, slash);
+#endif
+
+    while(p < end) {
+        unsigned char c = (unsigned char)*p;
+        if(c == '"' || c == '\\' || c < 0x20 || c >= 0x80 || (slash && c == '/'))
+            break;
+        p++;
+    }
+    return p;
+}
+
 static int dump_string(const char *str, size_t len, json_dump_callback_t dump, void *data, size_t flags)
 {
     const char *pos, *end, *lim;
@@ -118,25 +196,26 @@ static int dump_string(const char *str, size_t len, json_dump_callback_t dump, v
         char seq[13];
         int length;
 
-        while(end < lim)
+        for(end = pos; pos < lim; pos = end)
         {
-            end = utf8_iterate(pos, lim - pos, &codepoint);
-            if(!end)
-                return -1;
-
-            /* mandatory escape or control char */
-            if(codepoint == '\\' || codepoint == '"' || codepoint < 0x20)
+            end = pos = find_special(pos, lim, flags & JSON_ESCAPE_SLASH);
+            if(pos == lim)
                 break;
 
-            /* slash */
-            if((flags & JSON_ESCAPE_SLASH) && codepoint == '/')
+            /* mandatory escape, control char or slash */
+            if((unsigned char)*pos < 0x80) {
+                codepoint = (unsigned char)*pos;
+                end = pos + 1;
                 break;
+            }
 
-            /* non-ASCII */
-            if((flags & JSON_ENSURE_ASCII) && codepoint > 0x7F)
-                break;
+            /* non-ASCII, which must still be valid UTF-8 */
+            end = utf8_iterate(pos, lim - pos, &codepoint);
+            if(!end)
+                return -1;
 
-            pos = end;
+            if(flags & JSON_ENSURE_ASCII)
+                break;
         }
 
         if(pos != str) {
@@ -234,14 +313,8 @@ static int do_dump(const json_t *json, size_t flags, int depth,
             char buffer[MAX_INTEGER_STR_LENGTH];
             int size;
 
-            /*size = snprintf(buffer, MAX_INTEGER_STR_LENGTH,
-                            "%" JSON_INTEGER_FORMAT,
-                            json_integer_value(json));
-							*/
-
-			size = snprintf(buffer, MAX_INTEGER_STR_LENGTH, "%" JSON_INTEGER_FORMAT, json_integer_value(json));
-
-            if(size < 0 || size >= MAX_INTEGER_STR_LENGTH)
+            size = jsonp_itostr(buffer, MAX_INTEGER_STR_LENGTH, json_integer_value(json));
+            if(size < 0)
                 return -1;
 
             return dump(buffer, size, data);
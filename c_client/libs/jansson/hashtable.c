@@ -32,6 +32,7 @@ extern volatile uint32_t hashtable_seed;
 #define list_to_pair(list_)  container_of(list_, pair_t, list)
 #define ordered_list_to_pair(list_)  container_of(list_, pair_t, ordered_list)
 #define hash_str(key)        ((size_t)hashlittle((key), strlen(key), hashtable_seed))
+#define pair_size(len)       (offsetof(pair_t, key) + (len) + 1)
 
 JSON_INLINE void list_init(list_t *list)
 {
@@ -126,7 +127,7 @@ static int hashtable_do_del(hashtable_t *hashtable,
     list_remove(&pair->ordered_list);
     json_decref(pair->value);
 
-    jsonp_free(pair);
+    jsonp_pool_free(pair, pair_size(strlen(pair->key)));
     hashtable->size--;
 
     return 0;
@@ -142,7 +143,7 @@ static void hashtable_do_clear(hashtable_t *hashtable)
         next = list->next;
         pair = list_to_pair(list);
         json_decref(pair->value);
-        jsonp_free(pair);
+        jsonp_pool_free(pair, pair_size(strlen(pair->key)));
     }
 }
 
@@ -245,7 +246,7 @@ int hashtable_set(hashtable_t *hashtable, const char *key, json_t *value)
             return -1;
         }
 
-        pair = (pair_t*)jsonp_malloc(offsetof(pair_t, key) + len + 1);
+        pair = (pair_t*)jsonp_pool_malloc(JSON_ALLOC_PAIR, pair_size(len));
         if(!pair)
             return -1;
 
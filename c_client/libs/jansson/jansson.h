@@ -405,6 +405,51 @@ typedef void (*json_free_t)(void *);
 void json_set_alloc_funcs(json_malloc_t malloc_fn, json_free_t free_fn);
 void json_get_alloc_funcs(json_malloc_t *malloc_fn, json_free_t *free_fn);
 
+/* allocation pools
+
+   json_set_alloc_pools() makes values and object pairs come from per-thread
+   free lists of a few fixed sizes instead of malloc. It must be called
+   before any value is created and after json_set_alloc_funcs(), whose
+   malloc is used for the pool slabs. Pooled memory is kept for reuse and
+   never returned to the system. json_get_alloc_stats() counts allocations
+   made while pools are enabled; with pools off nothing is counted. */
+
+typedef enum {
+    JSON_ALLOC_OBJECT,
+    JSON_ALLOC_ARRAY,
+    JSON_ALLOC_STRING,
+    JSON_ALLOC_INTEGER,
+    JSON_ALLOC_REAL,
+    JSON_ALLOC_PAIR,
+    JSON_ALLOC_OTHER,       /* string contents, tables and buffers */
+    JSON_ALLOC_TYPES
+} json_alloc_type;
+
+typedef struct json_alloc_stats {
+    size_t count[JSON_ALLOC_TYPES];     /* heap allocations so far */
+    size_t pooled[JSON_ALLOC_TYPES];    /* how many of them a pool served */
+} json_alloc_stats_t;
+
+void json_set_alloc_pools(int enable);
+void json_get_alloc_stats(json_alloc_stats_t *stats);
+
+/* arena allocation
+
+   json_loadb_arena() allocates the whole parsed tree from an arena.
+   Values in it are not reference counted: json_incref() and json_decref()
+   do nothing, and everything is released at once by json_arena_reset()
+   or json_arena_destroy(). Such a tree is read-only and must not be used
+   after the reset; use json_deep_copy() to keep a part of it. An arena
+   must only be used by one thread at a time. */
+
+typedef struct json_arena json_arena_t;
+
+json_arena_t *json_arena_create(size_t block_size) JSON_ATTRS(warn_unused_result);
+void json_arena_reset(json_arena_t *arena);
+void json_arena_destroy(json_arena_t *arena);
+
+json_t *json_loadb_arena(const char *buffer, size_t buflen, size_t flags, json_arena_t *arena, json_error_t *error) JSON_ATTRS(warn_unused_result);
+
 #ifdef __cplusplus
 }
 #endif
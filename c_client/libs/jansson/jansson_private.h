@@ -82,6 +82,7 @@ void jsonp_error_vset(json_error_t *error, int line, int column,
 /* Locale independent string<->double conversions */
 int jsonp_strtod(strbuffer_t *strbuffer, double *out);
 int jsonp_dtostr(char *buffer, size_t size, double value, int prec);
+int jsonp_itostr(char *buffer, size_t size, json_int_t value);
 
 /* Wrappers for custom memory functions */
 void* jsonp_malloc(size_t size) JSON_ATTRS(warn_unused_result);
@@ -90,6 +91,17 @@ char *jsonp_strndup(const char *str, size_t length) JSON_ATTRS(warn_unused_resul
 char *jsonp_strdup(const char *str) JSON_ATTRS(warn_unused_result);
 char *jsonp_strndup(const char *str, size_t len) JSON_ATTRS(warn_unused_result);
 
+/* Fixed size allocations that may come from a pool, see
+   json_set_alloc_pools(). The size passed to jsonp_pool_free() must be
+   the one that was allocated. */
+void *jsonp_pool_malloc(json_alloc_type type, size_t size) JSON_ATTRS(warn_unused_result);
+void jsonp_pool_free(void *ptr, size_t size);
+
+/* Arena that jsonp_malloc() uses on this thread, see json_loadb_arena() */
+json_arena_t *jsonp_arena_enter(json_arena_t *arena);
+void jsonp_arena_leave(json_arena_t *previous);
+int jsonp_arena_active(void);
+
 
 /* Windows compatibility */
 #if defined(_WIN32) || defined(WIN32)
@@ -17,6 +17,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -68,6 +71,10 @@ typedef struct {
     size_t flags;
     size_t depth;
     int token;
+    /* set by parse_buffer(): the input is read directly from [pos, end)
+       instead of through the stream */
+    const char *pos;
+    const char *end;
     union {
         struct {
             char *val;
@@ -326,60 +333,13 @@ static int32_t decode_unicode_escape(const char *str)
     return value;
 }
 
-static void lex_scan_string(lex_t *lex, json_error_t *error)
+/* Decodes the string that starts at p and ends at the first unescaped
+   '"' into lex->value.string. The escapes must already be checked to be
+   well formed; size is an upper bound for the decoded length. */
+static int lex_decode_string(lex_t *lex, const char *p, size_t size,
+                             json_error_t *error)
 {
-    int c;
-    const char *p;
     char *t;
-    int i;
-
-    lex->value.string.val = NULL;
-    lex->token = TOKEN_INVALID;
-
-    c = lex_get_save(lex, error);
-
-    while(c != '"') {
-        if(c == STREAM_STATE_ERROR)
-            goto out;
-
-        else if(c == STREAM_STATE_EOF) {
-            error_set(error, lex, json_error_premature_end_of_input, "premature end of input");
-            goto out;
-        }
-
-        else if(0 <= c && c <= 0x1F) {
-            /* control character */
-            lex_unget_unsave(lex, c);
-            if(c == '\n')
-                error_set(error, lex, json_error_invalid_syntax, "unexpected newline");
-            else
-                error_set(error, lex, json_error_invalid_syntax, "control character 0x%x", c);
-            goto out;
-        }
-
-        else if(c == '\\') {
-            c = lex_get_save(lex, error);
-            if(c == 'u') {
-                c = lex_get_save(lex, error);
-                for(i = 0; i < 4; i++) {
-                    if(!l_isxdigit(c)) {
-                        error_set(error, lex, json_error_invalid_syntax, "invalid escape");
-                        goto out;
-                    }
-                    c = lex_get_save(lex, error);
-                }
-            }
-            else if(c == '"' || c == '\\' || c == '/' || c == 'b' ||
-                    c == 'f' || c == 'n' || c == 'r' || c == 't')
-                c = lex_get_save(lex, error);
-            else {
-                error_set(error, lex, json_error_invalid_syntax, "invalid escape");
-                goto out;
-            }
-        }
-        else
-            c = lex_get_save(lex, error);
-    }
 
     /* the actual value is at most of the same length as the source
        string, because:
@@ -388,16 +348,13 @@ static void lex_scan_string(lex_t *lex, json_error_t *error)
          - two \uXXXX escapes (length 12) forming an UTF-16 surrogate pair
            are converted to 4 bytes
     */
-    t = (char*)jsonp_malloc(lex->saved_text.length + 1);
+    t = (char*)jsonp_malloc(size + 1);
     if(!t) {
         /* this is not very nice, since TOKEN_INVALID is returned */
-        goto out;
+        return -1;
     }
     lex->value.string.val = t;
 
-    /* + 1 to skip the " */
-    p = strbuffer_value(&lex->saved_text) + 1;
-
     while(*p != '"') {
         if(*p == '\\') {
             p++;
@@ -475,6 +432,69 @@ static void lex_scan_string(lex_t *lex, json_error_t *error)
     *t = '\0';
     lex->value.string.len = t - lex->value.string.val;
     lex->token = TOKEN_STRING;
+    return 0;
+
+out:
+    lex_free_string(lex);
+    return -1;
+}
+
+static void lex_scan_string(lex_t *lex, json_error_t *error)
+{
+    int c;
+    int i;
+
+    lex->value.string.val = NULL;
+    lex->token = TOKEN_INVALID;
+
+    c = lex_get_save(lex, error);
+
+    while(c != '"') {
+        if(c == STREAM_STATE_ERROR)
+            goto out;
+
+        else if(c == STREAM_STATE_EOF) {
+            error_set(error, lex, json_error_premature_end_of_input, "premature end of input");
+            goto out;
+        }
+
+        else if(0 <= c && c <= 0x1F) {
+            /* control character */
+            lex_unget_unsave(lex, c);
+            if(c == '\n')
+                error_set(error, lex, json_error_invalid_syntax, "unexpected newline");
+            else
+                error_set(error, lex, json_error_invalid_syntax, "control character 0x%x", c);
+            goto out;
+        }
+
+        else if(c == '\\') {
+            c = lex_get_save(lex, error);
+            if(c == 'u') {
+                c = lex_get_save(lex, error);
+                for(i = 0; i < 4; i++) {
+                    if(!l_isxdigit(c)) {
+                        error_set(error, lex, json_error_invalid_syntax, "invalid escape");
+                        goto out;
+                    }
+                    c = lex_get_save(lex, error);
+                }
+            }
+            else if(c == '"' || c == '\\' || c == '/' || c == 'b' ||
+                    c == 'f' || c == 'n' || c == 'r' || c == 't')
+                c = lex_get_save(lex, error);
+            else {
+                error_set(error, lex, json_error_invalid_syntax, "invalid escape");
+                goto out;
+            }
+        }
+        else
+            c = lex_get_save(lex, error);
+    }
+
+    /* + 1 to skip the " */
+    lex_decode_string(lex, strbuffer_value(&lex->saved_text) + 1,
+                      lex->saved_text.length, error);
     return;
 
 out:
@@ -497,10 +517,34 @@ out:
 
 #endif
 
+/* Converts an integer the lexer has checked to be -?[0-9]+. Numbers
+   with few enough digits cannot overflow and are converted directly. */
+static int lex_strtoint(const char *str, size_t len, json_int_t *out)
+{
+    const char *p = str;
+    const char *end = str + len;
+    const size_t safe_digits = sizeof(json_int_t) >= 8 ? 18 : 9;
+
+    if(*p == '-')
+        p++;
+
+    if((size_t)(end - p) <= safe_digits) {
+        json_int_t value = 0;
+
+        for(; p < end; p++)
+            value = value * 10 + (*p - '0');
+        *out = *str == '-' ? -value : value;
+        return 0;
+    }
+
+    errno = 0;
+    *out = json_strtoint(str, NULL, 10);
+    return errno == ERANGE ? -1 : 0;
+}
+
 static int lex_scan_number(lex_t *lex, int c, json_error_t *error)
 {
     const char *saved_text;
-    char *end;
     double doubleval;
 
     lex->token = TOKEN_INVALID;
@@ -534,9 +578,7 @@ static int lex_scan_number(lex_t *lex, int c, json_error_t *error)
 
         saved_text = strbuffer_value(&lex->saved_text);
 
-        errno = 0;
-        intval = json_strtoint(saved_text, &end, 10);
-        if(errno == ERANGE) {
+        if(lex_strtoint(saved_text, lex->saved_text.length, &intval)) {
             if(intval < 0)
                 error_set(error, lex, json_error_numeric_overflow, "too big negative integer");
             else
@@ -544,8 +586,6 @@ static int lex_scan_number(lex_t *lex, int c, json_error_t *error)
             goto out;
         }
 
-        assert(end == saved_text + lex->saved_text.length);
-
         lex->token = TOKEN_INTEGER;
         lex->value.integer = intval;
         return 0;
@@ -594,6 +634,248 @@ out:
     return -1;
 }
 
+/*** buffer lexer ***/
+
+/* Used by parse_buffer() when the whole input is in memory. Tokens are
+   read directly from the buffer, without the per-byte stream and without
+   line and column tracking. On any error the token is simply
+   TOKEN_INVALID: the input is then parsed again through the stream, which
+   produces the error message. So this lexer may reject more than the
+   stream lexer does, but it must never accept anything more. */
+
+/* Returns the first byte in [p, end) that is '"', '\\', a control
+   character or not ASCII, or end if there is none */
+static const char *lex_find_special(const char *p, const char *end)
+{
+#if defined(__SSE2__) && defined(__GNUC__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i space = _mm_set1_epi8(0x20);
+
+    while(end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        /* signed compare: bytes 0x80-0xFF are negative, so this catches
+           both control characters and non-ASCII bytes */
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                              _mm_cmpeq_epi8(v, backslash)),
+                                 _mm_cmplt_epi8(v, space));
+        int mask = _mm_movemask_epi8(m);
+        if(mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+
+    while(p < end) {
+        unsigned char c = (unsigned char)*p;
+        if(c == '"' || c == '\\' || c < 0x20 || c >= 0x80)
+            break;
+        p++;
+    }
+    return p;
+}
+
+/* lex->pos is just after the opening '"' */
+static void lex_scan_string_buffer(lex_t *lex, json_error_t *error)
+{
+    const char *start = lex->pos;
+    const char *end = lex->end;
+    const char *p = start;
+    int escaped = 0;
+    size_t len;
+    char *t;
+
+    lex->value.string.val = NULL;
+    lex->token = TOKEN_INVALID;
+
+    while(1) {
+        p = lex_find_special(p, end);
+        if(p == end)
+            return;
+
+        if(*p == '"')
+            break;
+
+        if(*p == '\\') {
+            escaped = 1;
+            p++;
+            if(p == end)
+                return;
+            if(*p == 'u') {
+                if(end - p < 5 || !l_isxdigit(p[1]) || !l_isxdigit(p[2]) ||
+                   !l_isxdigit(p[3]) || !l_isxdigit(p[4]))
+                    return;
+                p += 5;
+            }
+            else if(*p == '"' || *p == '\\' || *p == '/' || *p == 'b' ||
+                    *p == 'f' || *p == 'n' || *p == 'r' || *p == 't')
+                p++;
+            else
+                return;
+        }
+        else if((unsigned char)*p < 0x20) {
+            return;
+        }
+        else {
+            size_t count = utf8_check_first(*p);
+            if(!count || (size_t)(end - p) < count || !utf8_check_full(p, count, NULL))
+                return;
+            p += count;
+        }
+    }
+
+    len = (size_t)(p - start);
+    lex->pos = p + 1;
+
+    if(escaped) {
+        lex_decode_string(lex, start, len, error);
+        return;
+    }
+
+    t = (char*)jsonp_malloc(len + 1);
+    if(!t)
+        return;
+    memcpy(t, start, len);
+    t[len] = '\0';
+    lex->value.string.val = t;
+    lex->value.string.len = len;
+    lex->token = TOKEN_STRING;
+}
+
+/* lex->pos is at the first character of the number */
+static void lex_scan_number_buffer(lex_t *lex, json_error_t *error)
+{
+    const char *start = lex->pos;
+    const char *end = lex->end;
+    const char *p = start;
+    int is_real = 0;
+    double doubleval;
+
+    (void)error;
+    lex->token = TOKEN_INVALID;
+
+    if(p < end && *p == '-')
+        p++;
+
+    if(p < end && *p == '0') {
+        p++;
+        if(p < end && l_isdigit(*p))
+            return;
+    }
+    else if(p < end && l_isdigit(*p)) {
+        do
+            p++;
+        while(p < end && l_isdigit(*p));
+    }
+    else
+        return;
+
+    if(p < end && *p == '.') {
+        p++;
+        if(p == end || !l_isdigit(*p))
+            return;
+        do
+            p++;
+        while(p < end && l_isdigit(*p));
+        is_real = 1;
+    }
+
+    if(p < end && (*p == 'E' || *p == 'e')) {
+        p++;
+        if(p < end && (*p == '+' || *p == '-'))
+            p++;
+        if(p == end || !l_isdigit(*p))
+            return;
+        do
+            p++;
+        while(p < end && l_isdigit(*p));
+        is_real = 1;
+    }
+
+    /* the stream lexer reads one byte past the number and checks it as
+       UTF-8, which is visible with JSON_DISABLE_EOF_CHECK */
+    if(p < end && (unsigned char)*p >= 0x80)
+        return;
+
+    /* the conversions need a terminated string */
+    if(strbuffer_append_bytes(&lex->saved_text, start, (size_t)(p - start)))
+        return;
+    lex->pos = p;
+
+    if(!is_real && !(lex->flags & JSON_DECODE_INT_AS_REAL)) {
+        json_int_t intval;
+
+        if(lex_strtoint(strbuffer_value(&lex->saved_text), lex->saved_text.length, &intval))
+            return;
+
+        lex->token = TOKEN_INTEGER;
+        lex->value.integer = intval;
+        return;
+    }
+
+    if(jsonp_strtod(&lex->saved_text, &doubleval))
+        return;
+
+    lex->token = TOKEN_REAL;
+    lex->value.real = doubleval;
+}
+
+static int lex_scan_buffer(lex_t *lex, json_error_t *error)
+{
+    const char *p = lex->pos;
+    const char *end = lex->end;
+    char c;
+
+    while(p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+        p++;
+
+    lex->token = TOKEN_INVALID;
+    lex->pos = p;
+
+    if(p == end) {
+        lex->token = TOKEN_EOF;
+        return lex->token;
+    }
+
+    c = *p;
+
+    if(c == '{' || c == '}' || c == '[' || c == ']' || c == ':' || c == ',') {
+        lex->pos = p + 1;
+        lex->token = c;
+    }
+
+    else if(c == '"') {
+        lex->pos = p + 1;
+        lex_scan_string_buffer(lex, error);
+    }
+
+    else if(l_isdigit(c) || c == '-')
+        lex_scan_number_buffer(lex, error);
+
+    else if(l_isalpha(c)) {
+        const char *word = p;
+        size_t len;
+
+        do
+            p++;
+        while(p < end && l_isalpha(*p));
+        if(p < end && (unsigned char)*p >= 0x80)
+            return lex->token;  /* see lex_scan_number_buffer() */
+        len = (size_t)(p - word);
+        lex->pos = p;
+
+        if(len == 4 && memcmp(word, "true", 4) == 0)
+            lex->token = TOKEN_TRUE;
+        else if(len == 5 && memcmp(word, "false", 5) == 0)
+            lex->token = TOKEN_FALSE;
+        else if(len == 4 && memcmp(word, "null", 4) == 0)
+            lex->token = TOKEN_NULL;
+    }
+
+    return lex->token;
+}
+
+
 static int lex_scan(lex_t *lex, json_error_t *error)
 {
     int c;
@@ -603,6 +885,9 @@ static int lex_scan(lex_t *lex, json_error_t *error)
     if(lex->token == TOKEN_STRING)
         lex_free_string(lex);
 
+    if(lex->pos)
+        return lex_scan_buffer(lex, error);
+
     do
         c = lex_get(lex, error);
     while(c == ' ' || c == '\t' || c == '\n' || c == '\r');
@@ -682,6 +967,8 @@ static int lex_init(lex_t *lex, get_func get, size_t flags, void *data)
 
     lex->flags = flags;
     lex->token = TOKEN_INVALID;
+    lex->pos = NULL;
+    lex->end = NULL;
     return 0;
 }
 
@@ -921,6 +1208,30 @@ static json_t *parse_json(lex_t *lex, size_t flags, json_error_t *error)
     return result;
 }
 
+/* Parses a whole in-memory input. Nothing is reported on failure; the
+   caller then parses again through the stream to get the error. */
+static json_t *parse_buffer(const char *buffer, size_t buflen, size_t flags,
+                            json_error_t *error)
+{
+    lex_t lex;
+    json_t *result;
+
+    if(lex_init(&lex, NULL, flags, NULL))
+        return NULL;
+
+    lex.pos = buffer;
+    lex.end = buffer + buflen;
+
+    result = parse_json(&lex, flags, NULL);
+    if(result && error) {
+        /* Save the position even though there was no error */
+        error->position = (int)(lex.pos - buffer);
+    }
+
+    lex_close(&lex);
+    return result;
+}
+
 typedef struct
 {
     const char *data;
@@ -954,6 +1265,10 @@ json_t *json_loads(const char *string, size_t flags, json_error_t *error)
         return NULL;
     }
 
+    result = parse_buffer(string, strlen(string), flags, error);
+    if(result)
+        return result;
+
     stream_data.data = string;
     stream_data.pos = 0;
 
@@ -998,6 +1313,10 @@ json_t *json_loadb(const char *buffer, size_t buflen, size_t flags, json_error_t
         return NULL;
     }
 
+    result = parse_buffer(buffer, buflen, flags, error);
+    if(result)
+        return result;
+
     stream_data.data = buffer;
     stream_data.pos = 0;
     stream_data.len = buflen;
@@ -1011,6 +1330,18 @@ json_t *json_loadb(const char *buffer, size_t buflen, size_t flags, json_error_t
     return result;
 }
 
+json_t *json_loadb_arena(const char *buffer, size_t buflen, size_t flags,
+                         json_arena_t *arena, json_error_t *error)
+{
+    json_arena_t *previous;
+    json_t *result;
+
+    previous = jsonp_arena_enter(arena);
+    result = json_loadb(buffer, buflen, flags, error);
+    jsonp_arena_leave(previous);
+    return result;
+}
+
 json_t *json_loadf(FILE *input, size_t flags, json_error_t *error)
 {
     lex_t lex;
@@ -8,6 +8,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "jansson.h"
 #include "jansson_private.h"
@@ -16,15 +17,277 @@
 #undef malloc
 #undef free
 
+#if defined(_MSC_VER)
+#define JSON_THREAD_LOCAL __declspec(thread)
+#else
+#define JSON_THREAD_LOCAL __thread
+#endif
+
+#define ARENA_ALIGN          16
+#define ARENA_DEFAULT_BLOCK  (16 * 1024)
+
+#define POOL_GRANULE         16
+#define POOL_CLASSES         8           /* 16, 32, ..., 128 bytes */
+#define POOL_MAX_SIZE        (POOL_CLASSES * POOL_GRANULE)
+#define POOL_SLAB_SIZE       (16 * 1024)
+#define POOL_CACHE_MAX       128         /* free objects a thread keeps per class */
+#define POOL_BATCH           (POOL_CACHE_MAX / 2)
+
 /* memory function pointers */
 static json_malloc_t do_malloc = malloc;
 static json_free_t do_free = free;
 
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+} arena_block;
+
+/* the data starts after the header, aligned */
+#define ARENA_HEADER  ((sizeof(arena_block) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define ARENA_DATA(block)  ((char *)(block) + ARENA_HEADER)
+
+struct json_arena {
+    size_t block_size;
+    arena_block *blocks;    /* block_size each, kept over resets */
+    arena_block *current;   /* the block being filled */
+    arena_block *large;     /* allocations too big for a block, freed on reset */
+};
+
+/* set while json_loadb_arena() parses */
+static JSON_THREAD_LOCAL json_arena_t *current_arena = NULL;
+
+typedef struct pool_object {
+    struct pool_object *next;
+} pool_object;
+
+/* A thread's free lists and allocation counters. The counters are only
+   written by the owning thread and read by json_get_alloc_stats(). */
+typedef struct pool_cache {
+    pool_object *free[POOL_CLASSES];
+    size_t length[POOL_CLASSES];
+    size_t count[JSON_ALLOC_TYPES];
+    size_t pooled[JSON_ALLOC_TYPES];
+    struct pool_cache *prev, *next;
+} pool_cache;
+
+static int pools_enabled = 0;
+
+/* shared between threads, under pool_lock */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pool_object *pool_depot[POOL_CLASSES];
+static void *pool_slabs = NULL;         /* linked through their first word */
+static pool_cache *pool_caches = NULL;
+static size_t retired_count[JSON_ALLOC_TYPES];
+static size_t retired_pooled[JSON_ALLOC_TYPES];
+
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t pool_key;
+static JSON_THREAD_LOCAL pool_cache *thread_cache = NULL;
+
+static arena_block *arena_block_new(size_t size)
+{
+    arena_block *block = (arena_block *)(*do_malloc)(ARENA_HEADER + size);
+    if(!block)
+        return NULL;
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+static void *arena_alloc(json_arena_t *arena, size_t size)
+{
+    arena_block *block = arena->current;
+    void *ptr;
+
+    if(size > ((size_t)-1) - ARENA_HEADER - ARENA_ALIGN)
+        return NULL;
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if(size > arena->block_size / 4) {
+        block = arena_block_new(size);
+        if(!block)
+            return NULL;
+        block->used = size;
+        block->next = arena->large;
+        arena->large = block;
+        return ARENA_DATA(block);
+    }
+
+    if(block && block->size - block->used < size) {
+        /* blocks after the current one are empty since the last reset */
+        if(!block->next) {
+            block->next = arena_block_new(arena->block_size);
+            if(!block->next)
+                return NULL;
+        }
+        block = arena->current = block->next;
+    }
+    else if(!block) {
+        block = arena->blocks = arena->current = arena_block_new(arena->block_size);
+        if(!block)
+            return NULL;
+    }
+
+    ptr = ARENA_DATA(block) + block->used;
+    block->used += size;
+    return ptr;
+}
+
+static int arena_owns(const json_arena_t *arena, const void *ptr)
+{
+    const char *p = (const char *)ptr;
+    const arena_block *block;
+
+    for(block = arena->blocks; block; block = block->next) {
+        if(p >= ARENA_DATA(block) && p < ARENA_DATA(block) + block->size)
+            return 1;
+    }
+    for(block = arena->large; block; block = block->next) {
+        if(p >= ARENA_DATA(block) && p < ARENA_DATA(block) + block->size)
+            return 1;
+    }
+    return 0;
+}
+
+/* Gives the free objects of an exiting thread to the depot */
+static void pool_cache_retire(void *arg)
+{
+    pool_cache *cache = (pool_cache *)arg;
+    int i;
+
+    pthread_mutex_lock(&pool_lock);
+    for(i = 0; i < POOL_CLASSES; i++) {
+        while(cache->free[i]) {
+            pool_object *object = cache->free[i];
+            cache->free[i] = object->next;
+            object->next = pool_depot[i];
+            pool_depot[i] = object;
+        }
+    }
+    for(i = 0; i < JSON_ALLOC_TYPES; i++) {
+        retired_count[i] += cache->count[i];
+        retired_pooled[i] += cache->pooled[i];
+    }
+    if(cache->prev)
+        cache->prev->next = cache->next;
+    else
+        pool_caches = cache->next;
+    if(cache->next)
+        cache->next->prev = cache->prev;
+    pthread_mutex_unlock(&pool_lock);
+
+    thread_cache = NULL;
+    (*do_free)(cache);
+}
+
+static void pool_key_create(void)
+{
+    pthread_key_create(&pool_key, pool_cache_retire);
+}
+
+static pool_cache *pool_cache_get(void)
+{
+    pool_cache *cache = thread_cache;
+    if(cache)
+        return cache;
+
+    pthread_once(&pool_key_once, pool_key_create);
+    cache = (pool_cache *)(*do_malloc)(sizeof(pool_cache));
+    if(!cache)
+        return NULL;
+    memset(cache, 0, sizeof(pool_cache));
+
+    pthread_mutex_lock(&pool_lock);
+    cache->next = pool_caches;
+    if(pool_caches)
+        pool_caches->prev = cache;
+    pool_caches = cache;
+    pthread_mutex_unlock(&pool_lock);
+
+    pthread_setspecific(pool_key, cache);
+    thread_cache = cache;
+    return cache;
+}
+
+static void pool_count(size_t *counter)
+{
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+/* Moves a batch from the depot to the thread's empty list, cutting a new
+   slab into objects first if the depot has none */
+static int pool_refill(pool_cache *cache, int index)
+{
+    size_t size = (size_t)(index + 1) * POOL_GRANULE;
+    size_t n;
+
+    pthread_mutex_lock(&pool_lock);
+    if(!pool_depot[index]) {
+        char *slab = (char *)(*do_malloc)(POOL_SLAB_SIZE);
+        if(!slab) {
+            pthread_mutex_unlock(&pool_lock);
+            return -1;
+        }
+        *(void **)slab = pool_slabs;
+        pool_slabs = slab;
+
+        /* the first granule holds the link, push backwards so that the
+           objects are handed out in address order */
+        for(n = (POOL_SLAB_SIZE - POOL_GRANULE) / size; n-- > 0;) {
+            pool_object *object = (pool_object *)(slab + POOL_GRANULE + n * size);
+            object->next = pool_depot[index];
+            pool_depot[index] = object;
+        }
+    }
+    for(n = 0; n < POOL_BATCH && pool_depot[index]; n++) {
+        pool_object *object = pool_depot[index];
+        pool_depot[index] = object->next;
+        object->next = cache->free[index];
+        cache->free[index] = object;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    cache->length[index] = n;
+    return 0;
+}
+
+/* Gives a batch back to the depot when the thread holds too many */
+static void pool_drain(pool_cache *cache, int index)
+{
+    pool_object *first = cache->free[index];
+    pool_object *last = first;
+    int n;
+
+    for(n = 1; n < POOL_BATCH; n++)
+        last = last->next;
+    cache->free[index] = last->next;
+    cache->length[index] -= POOL_BATCH;
+
+    pthread_mutex_lock(&pool_lock);
+    last->next = pool_depot[index];
+    pool_depot[index] = first;
+    pthread_mutex_unlock(&pool_lock);
+}
+
 void *jsonp_malloc(size_t size)
 {
+    pool_cache *cache;
+
     if(!size)
         return NULL;
 
+    if(current_arena)
+        return arena_alloc(current_arena, size);
+
+    if(!pools_enabled)
+        return (*do_malloc)(size);
+
+    cache = pool_cache_get();
+    if(cache)
+        pool_count(&cache->count[JSON_ALLOC_OTHER]);
+
     return (*do_malloc)(size);
 }
 
@@ -33,9 +296,76 @@ void jsonp_free(void *ptr)
     if(!ptr)
         return;
 
+    /* arena memory is only released by json_arena_reset() */
+    if(current_arena && arena_owns(current_arena, ptr))
+        return;
+
     (*do_free)(ptr);
 }
 
+void *jsonp_pool_malloc(json_alloc_type type, size_t size)
+{
+    pool_cache *cache;
+    pool_object *object;
+    int index;
+
+    if(current_arena)
+        return arena_alloc(current_arena, size);
+
+    if(!pools_enabled)
+        return (*do_malloc)(size);
+
+    cache = pool_cache_get();
+    if(size > POOL_MAX_SIZE) {
+        if(cache)
+            pool_count(&cache->count[type]);
+        return (*do_malloc)(size);
+    }
+    if(!cache)
+        return NULL;
+
+    index = (int)((size - 1) / POOL_GRANULE);
+    if(!cache->free[index] && pool_refill(cache, index))
+        return NULL;
+
+    object = cache->free[index];
+    cache->free[index] = object->next;
+    cache->length[index]--;
+
+    pool_count(&cache->count[type]);
+    pool_count(&cache->pooled[type]);
+    return object;
+}
+
+void jsonp_pool_free(void *ptr, size_t size)
+{
+    pool_cache *cache;
+    pool_object *object = (pool_object *)ptr;
+    int index;
+
+    if(!pools_enabled || size > POOL_MAX_SIZE) {
+        jsonp_free(ptr);
+        return;
+    }
+    if(!ptr || (current_arena && arena_owns(current_arena, ptr)))
+        return;
+
+    index = (int)((size - 1) / POOL_GRANULE);
+    cache = pool_cache_get();
+    if(!cache) {
+        pthread_mutex_lock(&pool_lock);
+        object->next = pool_depot[index];
+        pool_depot[index] = object;
+        pthread_mutex_unlock(&pool_lock);
+        return;
+    }
+
+    object->next = cache->free[index];
+    cache->free[index] = object;
+    if(++cache->length[index] > POOL_CACHE_MAX)
+        pool_drain(cache, index);
+}
+
 char *jsonp_strdup(const char *str)
 {
     return jsonp_strndup(str, strlen(str));
@@ -60,6 +390,33 @@ void json_set_alloc_funcs(json_malloc_t malloc_fn, json_free_t free_fn)
     do_free = free_fn;
 }
 
+void json_set_alloc_pools(int enable)
+{
+    pools_enabled = enable ? 1 : 0;
+}
+
+void json_get_alloc_stats(json_alloc_stats_t *stats)
+{
+    pool_cache *cache;
+    int i;
+
+    if(!stats)
+        return;
+
+    pthread_mutex_lock(&pool_lock);
+    for(i = 0; i < JSON_ALLOC_TYPES; i++) {
+        stats->count[i] = retired_count[i];
+        stats->pooled[i] = retired_pooled[i];
+    }
+    for(cache = pool_caches; cache; cache = cache->next) {
+        for(i = 0; i < JSON_ALLOC_TYPES; i++) {
+            stats->count[i] += __atomic_load_n(&cache->count[i], __ATOMIC_RELAXED);
+            stats->pooled[i] += __atomic_load_n(&cache->pooled[i], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
 void json_get_alloc_funcs(json_malloc_t *malloc_fn, json_free_t *free_fn)
 {
     if (malloc_fn)
@@ -67,3 +424,65 @@ void json_get_alloc_funcs(json_malloc_t *malloc_fn, json_free_t *free_fn)
     if (free_fn)
         *free_fn = do_free;
 }
+
+json_arena_t *json_arena_create(size_t block_size)
+{
+    json_arena_t *arena = (json_arena_t *)(*do_malloc)(sizeof(json_arena_t));
+    if(!arena)
+        return NULL;
+
+    arena->block_size = block_size ? block_size : ARENA_DEFAULT_BLOCK;
+    arena->blocks = NULL;
+    arena->current = NULL;
+    arena->large = NULL;
+    return arena;
+}
+
+void json_arena_reset(json_arena_t *arena)
+{
+    arena_block *block;
+
+    if(!arena)
+        return;
+
+    for(block = arena->blocks; block; block = block->next)
+        block->used = 0;
+    arena->current = arena->blocks;
+
+    while(arena->large) {
+        block = arena->large;
+        arena->large = block->next;
+        (*do_free)(block);
+    }
+}
+
+void json_arena_destroy(json_arena_t *arena)
+{
+    if(!arena)
+        return;
+
+    json_arena_reset(arena);
+    while(arena->blocks) {
+        arena_block *block = arena->blocks;
+        arena->blocks = block->next;
+        (*do_free)(block);
+    }
+    (*do_free)(arena);
+}
+
+json_arena_t *jsonp_arena_enter(json_arena_t *arena)
+{
+    json_arena_t *previous = current_arena;
+    current_arena = arena;
+    return previous;
+}
+
+void jsonp_arena_leave(json_arena_t *previous)
+{
+    current_arena = previous;
+}
+
+int jsonp_arena_active(void)
+{
+    return current_arena != NULL;
+}
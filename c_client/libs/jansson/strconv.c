@@ -1,5 +1,7 @@
 #include <assert.h>
 #include <errno.h>
+#include <float.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
@@ -62,11 +64,91 @@ static void from_locale(char *buffer)
 }
 #endif
 
+/* Clinger's fast path: when the significant digits fit exactly in a
+   double and the power of ten is exact too (10^22 is the largest that
+   is), a single multiplication or division is correctly rounded. The
+   input is a number the lexer has already checked. Returns -1 when the
+   number needs strtod(). */
+static int strtod_fast(const char *str, double *out)
+{
+    static const double exact_pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+    const char *p = str;
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0, negative = 0;
+    double value;
+
+    if(*p == '-') {
+        negative = 1;
+        p++;
+    }
+
+    for(; '0' <= *p && *p <= '9'; p++) {
+        if(mantissa || *p != '0')
+            digits++;
+        mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+    }
+    if(*p == '.') {
+        for(p++; '0' <= *p && *p <= '9'; p++) {
+            if(mantissa || *p != '0')
+                digits++;
+            mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+            exponent--;
+        }
+    }
+    /* more than 19 digits may have overflowed */
+    if(digits > 19 || mantissa > (UINT64_C(1) << 53))
+        return -1;
+
+    if(*p == 'e' || *p == 'E') {
+        int e = 0, e_digits = 0, e_negative = 0;
+
+        p++;
+        if(*p == '+' || *p == '-')
+            e_negative = *p++ == '-';
+        for(; '0' <= *p && *p <= '9'; p++) {
+            if(++e_digits > 4)
+                return -1;
+            e = e * 10 + (*p - '0');
+        }
+        exponent += e_negative ? -e : e;
+    }
+    if(*p != '\0')
+        return -1;
+
+    value = (double)mantissa;
+    if(exponent < 0) {
+        if(exponent < -22)
+            return -1;
+        value /= exact_pow10[-exponent];
+    }
+    else if(mantissa != 0) {
+        if(exponent > 22)
+            return -1;
+        value *= exact_pow10[exponent];
+    }
+
+    *out = negative ? -value : value;
+    return 0;
+#else
+    (void)str;
+    (void)out;
+    (void)exact_pow10;
+    return -1;
+#endif
+}
+
 int jsonp_strtod(strbuffer_t *strbuffer, double *out)
 {
     double value;
     char *end;
 
+    if(strtod_fast(strbuffer->value, out) == 0)
+        return 0;
+
 #if JSON_HAVE_LOCALECONV
     to_locale(strbuffer);
 #endif
@@ -84,14 +166,389 @@ int jsonp_strtod(strbuffer_t *strbuffer, double *out)
     return 0;
 }
 
+static const char digit_pairs[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* Writes value in decimal, two digits at a time from the end */
+int jsonp_itostr(char *buffer, size_t size, json_int_t value)
+{
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    unsigned long long u;
+    size_t length;
+
+    u = value < 0 ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+
+    while(u >= 100) {
+        p -= 2;
+        memcpy(p, digit_pairs + (u % 100) * 2, 2);
+        u /= 100;
+    }
+    if(u >= 10) {
+        p -= 2;
+        memcpy(p, digit_pairs + u * 2, 2);
+    }
+    else
+        *--p = (char)('0' + u);
+
+    if(value < 0)
+        *--p = '-';
+
+    length = (size_t)(tmp + sizeof(tmp) - p);
+    if(length >= size)
+        return -1;
+
+    memcpy(buffer, p, length);
+    buffer[length] = '\0';
+    return (int)length;
+}
+
+/*
+  Shortest digits that read back as the same double: Grisu2 from
+  Florian Loitsch, "Printing Floating-Point Numbers Quickly and
+  Accurately with Integers" (PLDI 2010). The output always reads back
+  as the same double, and is the shortest such for almost all values; a
+  few get more digits than needed.
+*/
+
+typedef struct {
+    uint64_t f;
+    int e;
+} diy_fp;
+
+#define DIY_SIGNIFICAND_SIZE  64
+#define DP_SIGNIFICAND_SIZE   52
+#define DP_EXPONENT_BIAS      (0x3FF + DP_SIGNIFICAND_SIZE)
+#define DP_EXPONENT_MASK      UINT64_C(0x7FF0000000000000)
+#define DP_SIGNIFICAND_MASK   UINT64_C(0x000FFFFFFFFFFFFF)
+#define DP_HIDDEN_BIT         UINT64_C(0x0010000000000000)
+
+/* 10^k normalized to 64 bits, for k = -348, -340, ..., 340 */
+static const uint64_t cached_powers_f[] = {
+    UINT64_C(0xfa8fd5a0081c0288), UINT64_C(0xbaaee17fa23ebf76), UINT64_C(0x8b16fb203055ac76),
+    UINT64_C(0xcf42894a5dce35ea), UINT64_C(0x9a6bb0aa55653b2d), UINT64_C(0xe61acf033d1a45df),
+    UINT64_C(0xab70fe17c79ac6ca), UINT64_C(0xff77b1fcbebcdc4f), UINT64_C(0xbe5691ef416bd60c),
+    UINT64_C(0x8dd01fad907ffc3c), UINT64_C(0xd3515c2831559a83), UINT64_C(0x9d71ac8fada6c9b5),
+    UINT64_C(0xea9c227723ee8bcb), UINT64_C(0xaecc49914078536d), UINT64_C(0x823c12795db6ce57),
+    UINT64_C(0xc21094364dfb5637), UINT64_C(0x9096ea6f3848984f), UINT64_C(0xd77485cb25823ac7),
+    UINT64_C(0xa086cfcd97bf97f4), UINT64_C(0xef340a98172aace5), UINT64_C(0xb23867fb2a35b28e),
+    UINT64_C(0x84c8d4dfd2c63f3b), UINT64_C(0xc5dd44271ad3cdba), UINT64_C(0x936b9fcebb25c996),
+    UINT64_C(0xdbac6c247d62a584), UINT64_C(0xa3ab66580d5fdaf6), UINT64_C(0xf3e2f893dec3f126),
+    UINT64_C(0xb5b5ada8aaff80b8), UINT64_C(0x87625f056c7c4a8b), UINT64_C(0xc9bcff6034c13053),
+    UINT64_C(0x964e858c91ba2655), UINT64_C(0xdff9772470297ebd), UINT64_C(0xa6dfbd9fb8e5b88f),
+    UINT64_C(0xf8a95fcf88747d94), UINT64_C(0xb94470938fa89bcf), UINT64_C(0x8a08f0f8bf0f156b),
+    UINT64_C(0xcdb02555653131b6), UINT64_C(0x993fe2c6d07b7fac), UINT64_C(0xe45c10c42a2b3b06),
+    UINT64_C(0xaa242499697392d3), UINT64_C(0xfd87b5f28300ca0e), UINT64_C(0xbce5086492111aeb),
+    UINT64_C(0x8cbccc096f5088cc), UINT64_C(0xd1b71758e219652c), UINT64_C(0x9c40000000000000),
+    UINT64_C(0xe8d4a51000000000), UINT64_C(0xad78ebc5ac620000), UINT64_C(0x813f3978f8940984),
+    UINT64_C(0xc097ce7bc90715b3), UINT64_C(0x8f7e32ce7bea5c70), UINT64_C(0xd5d238a4abe98068),
+    UINT64_C(0x9f4f2726179a2245), UINT64_C(0xed63a231d4c4fb27), UINT64_C(0xb0de65388cc8ada8),
+    UINT64_C(0x83c7088e1aab65db), UINT64_C(0xc45d1df942711d9a), UINT64_C(0x924d692ca61be758),
+    UINT64_C(0xda01ee641a708dea), UINT64_C(0xa26da3999aef774a), UINT64_C(0xf209787bb47d6b85),
+    UINT64_C(0xb454e4a179dd1877), UINT64_C(0x865b86925b9bc5c2), UINT64_C(0xc83553c5c8965d3d),
+    UINT64_C(0x952ab45cfa97a0b3), UINT64_C(0xde469fbd99a05fe3), UINT64_C(0xa59bc234db398c25),
+    UINT64_C(0xf6c69a72a3989f5c), UINT64_C(0xb7dcbf5354e9bece), UINT64_C(0x88fcf317f22241e2),
+    UINT64_C(0xcc20ce9bd35c78a5), UINT64_C(0x98165af37b2153df), UINT64_C(0xe2a0b5dc971f303a),
+    UINT64_C(0xa8d9d1535ce3b396), UINT64_C(0xfb9b7cd9a4a7443c), UINT64_C(0xbb764c4ca7a44410),
+    UINT64_C(0x8bab8eefb6409c1a), UINT64_C(0xd01fef10a657842c), UINT64_C(0x9b10a4e5e9913129),
+    UINT64_C(0xe7109bfba19c0c9d), UINT64_C(0xac2820d9623bf429), UINT64_C(0x80444b5e7aa7cf85),
+    UINT64_C(0xbf21e44003acdd2d), UINT64_C(0x8e679c2f5e44ff8f), UINT64_C(0xd433179d9c8cb841),
+    UINT64_C(0x9e19db92b4e31ba9), UINT64_C(0xeb96bf6ebadf77d9), UINT64_C(0xaf87023b9bf0ee6b)
+};
+
+static const int16_t cached_powers_e[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+    -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+    -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+    -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+    -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+    109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+    641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066
+};
+
+static diy_fp diy_fp_from_double(double d)
+{
+    diy_fp v;
+    uint64_t bits;
+    int biased_e;
+
+    memcpy(&bits, &d, sizeof(bits));
+    biased_e = (int)((bits & DP_EXPONENT_MASK) >> DP_SIGNIFICAND_SIZE);
+    v.f = bits & DP_SIGNIFICAND_MASK;
+    if(biased_e != 0) {
+        v.f += DP_HIDDEN_BIT;
+        v.e = biased_e - DP_EXPONENT_BIAS;
+    }
+    else
+        v.e = 1 - DP_EXPONENT_BIAS;
+    return v;
+}
+
+static diy_fp diy_fp_normalize(diy_fp v)
+{
+    while(!(v.f & (UINT64_C(1) << 63))) {
+        v.f <<= 1;
+        v.e--;
+    }
+    return v;
+}
+
+/* Upper 64 bits of the 128-bit product, rounded */
+static diy_fp diy_fp_multiply(diy_fp x, diy_fp y)
+{
+    const uint64_t M32 = 0xFFFFFFFF;
+    uint64_t a = x.f >> 32, b = x.f & M32;
+    uint64_t c = y.f >> 32, d = y.f & M32;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t tmp = (bd >> 32) + (ad & M32) + (bc & M32);
+    diy_fp r;
+
+    tmp += UINT64_C(1) << 31;
+    r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+    r.e = x.e + y.e + 64;
+    return r;
+}
+
+/* The boundaries halfway to the neighbouring doubles, with the same
+   exponent */
+static void diy_fp_boundaries(diy_fp v, diy_fp *minus, diy_fp *plus)
+{
+    diy_fp pl, mi;
+
+    pl.f = (v.f << 1) + 1;
+    pl.e = v.e - 1;
+    while(!(pl.f & (DP_HIDDEN_BIT << 1))) {
+        pl.f <<= 1;
+        pl.e--;
+    }
+    pl.f <<= DIY_SIGNIFICAND_SIZE - DP_SIGNIFICAND_SIZE - 2;
+    pl.e -= DIY_SIGNIFICAND_SIZE - DP_SIGNIFICAND_SIZE - 2;
+
+    if(v.f == DP_HIDDEN_BIT) {
+        mi.f = (v.f << 2) - 1;
+        mi.e = v.e - 2;
+    }
+    else {
+        mi.f = (v.f << 1) - 1;
+        mi.e = v.e - 1;
+    }
+    mi.f <<= mi.e - pl.e;
+    mi.e = pl.e;
+
+    *plus = pl;
+    *minus = mi;
+}
+
+/* A cached power c = 10^-k such that the product with a number of
+   binary exponent e has its exponent in [-60, -32] */
+static diy_fp cached_power(int e, int *k)
+{
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int ik = (int)dk;
+    unsigned int index;
+    diy_fp c;
+
+    if(dk - ik > 0.0)
+        ik++;
+    index = (unsigned int)((ik >> 3) + 1);
+    *k = -(-348 + (int)index * 8);
+
+    c.f = cached_powers_f[index];
+    c.e = cached_powers_e[index];
+    return c;
+}
+
+static void grisu_round(char *buffer, int length, uint64_t delta, uint64_t rest,
+                        uint64_t ten_kappa, uint64_t wp_w)
+{
+    while(rest < wp_w && delta - rest >= ten_kappa &&
+          (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+        buffer[length - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+static void digit_gen(diy_fp w, diy_fp mp, uint64_t delta, char *buffer, int *length, int *k)
+{
+    static const uint64_t pow10_u64[] = {
+        UINT64_C(1), UINT64_C(10), UINT64_C(100), UINT64_C(1000), UINT64_C(10000),
+        UINT64_C(100000), UINT64_C(1000000), UINT64_C(10000000), UINT64_C(100000000),
+        UINT64_C(1000000000), UINT64_C(10000000000), UINT64_C(100000000000),
+        UINT64_C(1000000000000), UINT64_C(10000000000000), UINT64_C(100000000000000),
+        UINT64_C(1000000000000000), UINT64_C(10000000000000000),
+        UINT64_C(100000000000000000), UINT64_C(1000000000000000000),
+        UINT64_C(10000000000000000000)
+    };
+    const int shift = -mp.e;
+    const uint64_t one = UINT64_C(1) << shift;
+    const uint64_t wp_w = mp.f - w.f;
+    uint32_t p1 = (uint32_t)(mp.f >> shift);
+    uint64_t p2 = mp.f & (one - 1);
+    int kappa;
+    int len = 0;
+
+    /* number of decimal digits in p1 */
+    kappa = 1;
+    while(kappa < 10 && p1 >= pow10_u64[kappa])
+        kappa++;
+
+    while(kappa > 0) {
+        uint32_t d = (uint32_t)(p1 / pow10_u64[kappa - 1]);
+        uint64_t rest;
+
+        p1 %= (uint32_t)pow10_u64[kappa - 1];
+        if(d || len)
+            buffer[len++] = (char)('0' + d);
+        kappa--;
+
+        rest = ((uint64_t)p1 << shift) + p2;
+        if(rest <= delta) {
+            *k += kappa;
+            *length = len;
+            grisu_round(buffer, len, delta, rest, pow10_u64[kappa] << shift, wp_w);
+            return;
+        }
+    }
+
+    while(1) {
+        char d;
+
+        p2 *= 10;
+        delta *= 10;
+        d = (char)(p2 >> shift);
+        if(d || len)
+            buffer[len++] = (char)('0' + d);
+        p2 &= one - 1;
+        kappa--;
+
+        if(p2 < delta) {
+            *k += kappa;
+            *length = len;
+            grisu_round(buffer, len, delta, p2, one, wp_w * (-kappa < 20 ? pow10_u64[-kappa] : 0));
+            return;
+        }
+    }
+}
+
+/* Digits of a finite, positive value and the power of ten of the last
+   digit: value = buffer * 10^k */
+static void grisu2(double value, char *buffer, int *length, int *k)
+{
+    diy_fp v = diy_fp_from_double(value);
+    diy_fp w_m, w_p, c_mk, w;
+
+    diy_fp_boundaries(v, &w_m, &w_p);
+    c_mk = cached_power(w_p.e, k);
+
+    w = diy_fp_multiply(diy_fp_normalize(v), c_mk);
+    w_p = diy_fp_multiply(w_p, c_mk);
+    w_m = diy_fp_multiply(w_m, c_mk);
+    w_m.f++;
+    w_p.f--;
+
+    digit_gen(w, w_p, w_p.f - w_m.f, buffer, length, k);
+}
+
+/* Lays out the shortest digits the way "%.17g" and the fixups in
+   jsonp_dtostr() would: plain notation for exponents -4 to 16, always
+   with a '.' or an 'e', and no '+' or leading zeros in the exponent */
+static int dtostr_shortest(char *buffer, size_t size, double value)
+{
+    char digits[20];
+    char tmp[40];
+    char *p = tmp;
+    int length, k, exponent;
+    size_t total;
+
+    if(signbit(value)) {
+        *p++ = '-';
+        value = -value;
+    }
+
+    if(value == 0.0) {
+        digits[0] = '0';
+        length = 1;
+        k = 0;
+    }
+    else
+        grisu2(value, digits, &length, &k);
+
+    exponent = length + k - 1;
+
+    if(exponent < -4 || exponent >= 17) {
+        int e;
+        char e_digits[4];
+        int e_length = 0;
+
+        *p++ = digits[0];
+        if(length > 1) {
+            *p++ = '.';
+            memcpy(p, digits + 1, length - 1);
+            p += length - 1;
+        }
+        *p++ = 'e';
+        if(exponent < 0)
+            *p++ = '-';
+        e = exponent < 0 ? -exponent : exponent;
+        do {
+            e_digits[e_length++] = (char)('0' + e % 10);
+            e /= 10;
+        } while(e);
+        while(e_length)
+            *p++ = e_digits[--e_length];
+    }
+    else if(exponent >= 0) {
+        if(length <= exponent + 1) {
+            memcpy(p, digits, length);
+            p += length;
+            memset(p, '0', exponent + 1 - length);
+            p += exponent + 1 - length;
+            *p++ = '.';
+            *p++ = '0';
+        }
+        else {
+            memcpy(p, digits, exponent + 1);
+            p += exponent + 1;
+            *p++ = '.';
+            memcpy(p, digits + exponent + 1, length - exponent - 1);
+            p += length - exponent - 1;
+        }
+    }
+    else {
+        *p++ = '0';
+        *p++ = '.';
+        memset(p, '0', -exponent - 1);
+        p += -exponent - 1;
+        memcpy(p, digits, length);
+        p += length;
+    }
+
+    total = (size_t)(p - tmp);
+    if(total >= size)
+        return -1;
+
+    memcpy(buffer, tmp, total);
+    buffer[total] = '\0';
+    return (int)total;
+}
+
 int jsonp_dtostr(char *buffer, size_t size, double value, int precision)
 {
     int ret;
     char *start, *end;
     size_t length;
 
-    if (precision == 0)
+    if (precision == 0) {
+        if(isfinite(value))
+            return dtostr_shortest(buffer, size, value);
         precision = 17;
+    }
 
     ret = snprintf(buffer, size, "%.*g", precision, value);
     if(ret < 0)
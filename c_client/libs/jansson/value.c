@@ -42,7 +42,8 @@ JSON_INLINE int isinf(double x) { return !isnan(x) && isnan(x - x); }
 JSON_INLINE void json_init(json_t *json, json_type type)
 {
     json->type = type;
-    json->refcount = 1;
+    /* arena values live until the arena is reset, see json_loadb_arena() */
+    json->refcount = jsonp_arena_active() ? (size_t)-1 : 1;
 }
 
 
@@ -52,7 +53,7 @@ extern volatile uint32_t hashtable_seed;
 
 json_t *json_object(void)
 {
-    json_object_t* object = (json_object_t*)jsonp_malloc(sizeof(json_object_t));
+    json_object_t* object = (json_object_t*)jsonp_pool_malloc(JSON_ALLOC_OBJECT, sizeof(json_object_t));
     if(!object)
         return NULL;
 
@@ -65,7 +66,7 @@ json_t *json_object(void)
 
     if(hashtable_init(&object->hashtable))
     {
-        jsonp_free(object);
+        jsonp_pool_free(object, sizeof(json_object_t));
         return NULL;
     }
 
@@ -75,7 +76,7 @@ json_t *json_object(void)
 static void json_delete_object(json_object_t *object)
 {
     hashtable_close(&object->hashtable);
-    jsonp_free(object);
+    jsonp_pool_free(object, sizeof(json_object_t));
 }
 
 size_t json_object_size(const json_t *json)
@@ -340,7 +341,7 @@ static json_t *json_object_deep_copy(const json_t *object)
 
 json_t* json_array(void)
 {
-	json_array_t* array = (json_array_t*)jsonp_malloc(sizeof(json_array_t));
+	json_array_t* array = (json_array_t*)jsonp_pool_malloc(JSON_ALLOC_ARRAY, sizeof(json_array_t));
     if(!array)
         return NULL;
     json_init(&array->json, JSON_ARRAY);
@@ -350,7 +351,7 @@ json_t* json_array(void)
 
     array->table = (json_t**)jsonp_malloc(array->size * sizeof(json_t *));
     if(!array->table) {
-        jsonp_free(array);
+        jsonp_pool_free(array, sizeof(json_array_t));
         return NULL;
     }
 
@@ -365,7 +366,7 @@ static void json_delete_array(json_array_t *array)
         json_decref(array->table[i]);
 
     jsonp_free(array->table);
-    jsonp_free(array);
+    jsonp_pool_free(array, sizeof(json_array_t));
 }
 
 size_t json_array_size(const json_t *json)
@@ -652,7 +653,7 @@ static json_t *string_create(const char *value, size_t len, int own)
             return NULL;
     }
 
-    string = (json_string_t*)jsonp_malloc(sizeof(json_string_t));
+    string = (json_string_t*)jsonp_pool_malloc(JSON_ALLOC_STRING, sizeof(json_string_t));
     if(!string) {
         jsonp_free(v);
         return NULL;
@@ -762,7 +763,7 @@ int json_string_setn(json_t *json, const char *value, size_t len)
 static void json_delete_string(json_string_t *string)
 {
     jsonp_free(string->value);
-    jsonp_free(string);
+    jsonp_pool_free(string, sizeof(json_string_t));
 }
 
 static int json_string_equal(const json_t *string1, const json_t *string2)
@@ -828,7 +829,7 @@ json_t *json_sprintf(const char *fmt, ...) {
 
 json_t *json_integer(json_int_t value)
 {
-	json_integer_t* integer = (json_integer_t*)jsonp_malloc(sizeof(json_integer_t));
+	json_integer_t* integer = (json_integer_t*)jsonp_pool_malloc(JSON_ALLOC_INTEGER, sizeof(json_integer_t));
     if(!integer)
         return NULL;
     json_init(&integer->json, JSON_INTEGER);
@@ -857,7 +858,7 @@ int json_integer_set(json_t *json, json_int_t value)
 
 static void json_delete_integer(json_integer_t *integer)
 {
-    jsonp_free(integer);
+    jsonp_pool_free(integer, sizeof(json_integer_t));
 }
 
 static int json_integer_equal(const json_t *integer1, const json_t *integer2)
@@ -880,7 +881,7 @@ json_t *json_real(double value)
     if(isnan(value) || isinf(value))
         return NULL;
 
-    real = (json_real_t*)jsonp_malloc(sizeof(json_real_t));
+    real = (json_real_t*)jsonp_pool_malloc(JSON_ALLOC_REAL, sizeof(json_real_t));
     if(!real)
         return NULL;
     json_init(&real->json, JSON_REAL);
@@ -909,7 +910,7 @@ int json_real_set(json_t *json, double value)
 
 static void json_delete_real(json_real_t *real)
 {
-    jsonp_free(real);
+    jsonp_pool_free(real, sizeof(json_real_t));
 }
 
 static int json_real_equal(const json_t *real1, const json_t *real2)
@@ -4,55 +4,369 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <stdatomic.h>
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 
 typedef struct ListenerNode {
     int id;
+    int type;               /* mpapi_event_type, eller -1 för alla händelser */
     mpapiListener cb;
+    mpapiEventListener event_cb;
     void *context;
     struct ListenerNode *next;
 } ListenerNode;
 
 typedef struct ListenerSnapshot {
     mpapiListener cb;
+    mpapiEventListener event_cb;
     void *context;
 } ListenerSnapshot;
 
+/* Oföränderlig lyssnartabell per händelsetyp. Registrering bygger en ny
+   tabell och publicerar den med ett atomiskt pekarbyte. Tabellen är
+   referensräknad (under api->lock) så att den tråd som skickar händelser
+   kan behålla sin egen referens och bara behöver röra låset när tabellen
+   har bytts ut. */
+typedef struct ListenerTable {
+    int refcount;
+    int offset[MPAPI_EVT_COUNT];
+    int count[MPAPI_EVT_COUNT];
+    ListenerSnapshot entries[];
+} ListenerTable;
+
+/* Fält som förgranskningen plockar ut ur ett inkommande meddelande.
+   Pekarna går in i raden och är inte nollterminerade. */
+typedef struct MessageFields {
+    const char *cmd;
+    size_t cmd_len;
+    int64_t messageId;
+    int64_t requestId;      /* 0 om det saknas */
+    int64_t handle;         /* -1 om det saknas */
+    const char *clientId;
+    size_t clientId_len;
+    const char *data;
+    size_t data_len;
+} MessageFields;
+
+/* Mottagningsbuffert per anslutning. Ringbuffert som fylls med stora recv()
+   och läses bara av mottagarsidan. Rader som hamnar över
+   buffertens slut kopieras till spill så att anroparen alltid får ett
+   sammanhängande fönster. */
+typedef struct RecvBuffer {
+    char *data;
+    size_t cap;
+    size_t head;      /* index för första olästa byte */
+    size_t len;       /* antal olästa byte */
+    size_t scanned;   /* olästa byte som redan sökts igenom efter '\n' */
+    size_t want;      /* storlek på påbörjad ram, så att bufferten växer en gång */
+
+    char *spill;
+    size_t spill_cap;
+
+    atomic_uint_least64_t frames;
+    atomic_uint_least64_t spilled;  /* rader som fick kopieras till spill */
+} RecvBuffer;
+
+#define MPAPI_RX_INITIAL_CAP  (16 * 1024)
+#define MPAPI_RX_MAX_CAP      (16 * 1024 * 1024)
+
+/* Binära ramar: typbyte, längden på resten som varint och därefter
+   innehållet. Textrader börjar alltid med '{', så det första byte avgör hur
+   ramen ska läsas och båda formaten kan blandas på samma anslutning.
+
+   Game‑ram från klienten:  flaggor, [destinationens handtag], data
+   Game‑ram från servern:   flaggor, messageId, avsändarens handtag, data
+   JSON‑ram:                ett helt meddelande, samma innehåll som en rad
+
+   Handtagen är små heltal som servern delar ut per session i stället för
+   clientId. data är JSON‑text om inte MPAPI_GAME_COMPACT är satt. */
+#define MPAPI_FRAME_GAME      'G'
+#define MPAPI_FRAME_JSON      'J'
+#define MPAPI_GAME_DIRECTED   0x01
+#define MPAPI_GAME_COMPACT    0x02  /* reserverad för kompakt kodning av data */
+#define MPAPI_BIN_HEAD_MAX    20
+#define MPAPI_PEER_MAX        65536 /* högsta handtag som sparas, + 1 */
+
+typedef enum FrameKind {
+    FRAME_LINE,
+    FRAME_GAME
+} FrameKind;
+
+/* Återanvändbar buffert som utgående meddelanden serialiseras till. */
+typedef struct SendBuffer {
+    char *data;
+    size_t len;
+    size_t cap;
+} SendBuffer;
+
+/* Större buffertar än så släpps efter sändning i stället för att behållas. */
+#define MPAPI_TX_KEEP_CAP     (256 * 1024)
+
+#define MPAPI_TX_BATCH        64
+
+/* Plats i sändkön. seq styr vem som får röra platsen (begränsad kö enligt
+   Vyukov); bufferten följer med platsen och återanvänds varv efter varv. */
+typedef struct SendSlot {
+    atomic_size_t seq;
+    SendBuffer buf;
+} SendSlot;
+
+/* Begränsad låsfri kö för mpapi_game. Producenter serialiserar direkt in i
+   sin plats; konsumenten byter ut platsens buffert mot en egen tom buffert
+   så att inget kopieras, och skickar sedan allt med ett writev. */
+typedef struct SendQueue {
+    SendSlot *slots;
+    size_t mask;
+    mpapi_send_policy policy;
+
+    _Alignas(64) atomic_size_t enqueue_pos;
+    _Alignas(64) atomic_size_t dequeue_pos;
+
+    sem_t items;                /* postas en gång per köat meddelande */
+
+    pthread_mutex_t wait_lock;  /* för MPAPI_SEND_BLOCK */
+    pthread_cond_t space;
+    atomic_int waiters;
+
+    /* Ägs av den som tömmer kön (under send_lock) */
+    SendBuffer batch[MPAPI_TX_BATCH];
+    struct iovec iov[MPAPI_TX_BATCH];
+
+    pthread_t thread;
+    int thread_started;
+    atomic_int stop;
+    atomic_int error;
+
+    atomic_uint_least64_t dropped;
+    atomic_uint_least64_t batches;
+    atomic_uint_least64_t frames;
+} SendQueue;
+
+typedef enum RequestKind {
+    REQ_HOST = 0,
+    REQ_JOIN = 1,
+    REQ_LIST = 2
+} RequestKind;
+
+/* Förfrågan som väntar på svar. Nyckeln är requestId, som skickas med i
+   förfrågan och som servern skickar tillbaka i svaret. */
+typedef struct PendingRequest {
+    int64_t id;
+    RequestKind kind;
+    mpapiSessionCallback session_cb;
+    mpapiListCallback list_cb;
+    void *context;
+    struct PendingRequest *next;
+} PendingRequest;
+
+#define MPAPI_REQ_BUCKETS     64
+
+/* Används av de synkrona anropen för att vänta på sin asynkrona variant. */
+typedef struct SyncWait {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+    int status;
+    json_t *list;
+} SyncWait;
+
+/* Uppslagen serveradress, sparas per instans så att en ny anslutning inte
+   behöver göra om DNS‑uppslagningen. */
+typedef struct ConnectAddr {
+    int family;
+    socklen_t len;
+    struct sockaddr_storage addr;
+} ConnectAddr;
+
+#define MPAPI_CONNECT_TIMEOUT_MS   10000
+#define MPAPI_CONNECT_STAGGER_MS   250    /* väntan innan nästa adress prövas parallellt */
+#define MPAPI_CONNECT_MAX_PARALLEL 8
+
+#define MPAPI_RECONNECT_MIN_MS     100
+#define MPAPI_RECONNECT_MAX_MS     5000
+
+/* Plats i reaktorns instanstabell. Handtaget som läggs i epoll är
+   (gen << 32) | index, så att händelser för en instans som hunnit tas bort
+   (och vars plats återanvänts) känns igen och ignoreras. */
+typedef struct ReactorEntry {
+    mpapi *api;         /* NULL om platsen är ledig eller på väg bort */
+    uint32_t gen;
+    int busy;           /* reaktortrådar som just nu använder instansen */
+    int next_free;
+} ReactorEntry;
+
+#define MPAPI_REACTOR_WAKE    UINT64_MAX
+#define MPAPI_REACTOR_EVENTS  64
+#define MPAPI_REACTOR_READS   4     /* recv per instans och varv innan nästa får köra */
+
+struct mpapi_reactor {
+    int epfd;
+    int wakefd;                 /* eventfd för avstängning och köade sändningar */
+
+    pthread_t *threads;
+    int thread_count;
+    atomic_int stop;
+
+    pthread_mutex_t lock;
+    pthread_cond_t idle;        /* signaleras när en plats blir ledig från busy */
+    ReactorEntry *entries;
+    int entry_count;
+    int entry_cap;
+    int free_head;
+
+    /* Handtag för instanser med köade meddelanden som ska skickas */
+    uint64_t *pending;
+    size_t pending_len;
+    size_t pending_cap;
+};
+
+/* Ett utgående game‑meddelande innan det serialiserats. */
+typedef struct GameFrame {
+    json_t *data;
+    const char *raw;        /* färdigserialiserad data, används om data är NULL */
+    size_t raw_len;
+    const char *destination;
+} GameFrame;
+
 struct mpapi {
     char *server_host;
     uint16_t server_port;
 
+    ConnectAddr *addrs;      /* cache från getaddrinfo, NULL tills första anslutningen */
+    size_t addr_count;
+    int connect_timeout_ms;
+
 	char identifier[37];
 
 	mpapi_session session;
 
     int sockfd;
+    RecvBuffer rx;
+
+    pthread_mutex_t send_lock;
+    SendBuffer tx;
+    SendQueue *txq;
+
+    /* {"identifier":"…","session":"…","cmd":"game", – byggs vid host/join */
+    char *game_prefix;
+    size_t game_prefix_len;
+
+    /* Binärt protokoll, se mpapi_set_binary. peer_ids är clientId per
+       handtag; skrivs bara av mottagarsidan, under lock */
+    bool binary;
+    atomic_int binary_active;  /* servern gick med på binära ramar */
+    mpapi_framing framing;
+    atomic_int length_active;  /* servern gick med på MPAPI_FRAMING_LENGTH */
+    char (*peer_ids)[37];
+    uint32_t peer_cap;
+    /* clientId → handtag för riktade game‑meddelanden. Öppen adressering
+       med handtag + 1, 0 är en tom plats. Poster vars handtag fått ett
+       annat ID ligger kvar tills indexet byggs om. */
+    uint32_t *peer_index;
+    uint32_t peer_index_cap;   /* tvåpotens */
+    uint32_t peer_index_used;
+
+    /* Arena för händelsedata, se mpapi_set_arena. Rörs bara av
+       mottagarsidan och återställs efter varje händelse */
+    json_arena_t *arena;
 
     pthread_t recv_thread;
     int recv_thread_started;
     int running;
+    bool threadless;     /* inga egna trådar, se mpapi_poll */
+
+    mpapi_reactor *reactor;  /* satt av mpapi_create_on */
+    uint64_t reactor_handle;
+    bool reactor_registered;
+    atomic_int tx_wake;      /* instansen ligger redan i reaktorns sändlista */
 
     pthread_mutex_t lock;
     ListenerNode *listeners;
     int next_listener_id;
 
+    /* Väntande förfrågningar, skyddas av lock */
+    PendingRequest *requests[MPAPI_REQ_BUCKETS];
+    int64_t next_request_id;
+    bool session_pending;    /* host eller join väntar på svar */
+
+    /* Återanslutning, se mpapi_set_reconnect. closing skyddas av lock */
+    bool resumable;
+    int reconnect_max_attempts;
+    int64_t last_message_id;  /* senaste game‑meddelandet, rörs bara av mottagarsidan */
+    atomic_int link_down;     /* anslutningen är bruten, inget skickas */
+    bool closing;
+    pthread_cond_t state_cond;
+    pthread_t reconnect_thread;
+    bool reconnect_thread_started;
+
+    /* Senast publicerade tabellen, samt den som mottagarsidan håller en
+       referens till. dispatch_table rörs bara av den tråd som för tillfället
+       skickar händelser för instansen. */
+    _Atomic(ListenerTable *) listener_table;
+    ListenerTable *dispatch_table;
+
 	bool debug;
 };
 
-static int connect_to_server(const char *host, uint16_t port);
+static int connect_to_server(mpapi *api);
 static int ensure_connected(mpapi *api);
 static int send_all(int fd, const char *buf, size_t len);
+static int sendbuf_append(const char *buf, size_t size, void *data);
 static int send_json_line(mpapi *api, json_t *obj); /* tar över ägarskap */
-static int read_line(mpapi *api, char **out_line);
+static int send_tx_locked(mpapi *api);
+static int build_game_prefix(mpapi *api);
+static int game_frame_head(mpapi *api, SendBuffer *out, const GameFrame *frame);
+static int game_frame_write(mpapi *api, SendBuffer *out, const GameFrame *frame);
+static size_t varint_put(unsigned char *p, uint64_t v);
+static int sendbuf_insert_head(SendBuffer *out, size_t start, const unsigned char *head, size_t head_len);
+static bool game_binary_target(mpapi *api, const GameFrame *frame, uint32_t *out_dest);
+static size_t game_binary_head(unsigned char *head, const GameFrame *frame, uint32_t dest, size_t payload_len);
+static int writev_all(int fd, struct iovec *iov, int iovcnt);
+static int txq_push(mpapi *api, const GameFrame *frame);
+static int txq_drain_locked(mpapi *api);
+static void txq_free(SendQueue *q);
+static void *send_thread_main(void *arg);
+static int start_send_thread(mpapi *api);
+static ssize_t rx_fill(mpapi *api, int flags);
+static int rx_next_frame(mpapi *api, FrameKind *out_kind, const char **out_frame, size_t *out_len);
 static void *recv_thread_main(void *arg);
-static void process_line(mpapi *api, const char *line);
+static void process_frame(mpapi *api, FrameKind kind, const char *frame, size_t len);
+static void peers_load(mpapi *api, json_t *resp);
+static void protocol_load(mpapi *api, json_t *resp);
 static int start_recv_thread(mpapi *api);
+static int service_socket(mpapi *api, int max_events, int max_reads);
+static int reactor_add(mpapi *api);
+static void reactor_remove(mpapi *api);
+static void reactor_request_flush(mpapi *api);
+static int send_request(mpapi *api, json_t *root, RequestKind kind,
+                        mpapiSessionCallback session_cb, mpapiListCallback list_cb,
+                        void *context);
+static void requests_fail_all(mpapi *api, int status);
+static void session_pending_reset(mpapi *api);
+static void sync_wait_init(SyncWait *w);
+static void sync_wait_destroy(SyncWait *w);
+static int sync_wait(mpapi *api, SyncWait *w);
+static void sync_session_done(mpapi *api, int status, const mpapi_session *session, void *context);
+static void sync_list_done(mpapi *api, int status, json_t *list, void *context);
+static bool connection_lost(mpapi *api);
+static int reconnect_loop(mpapi *api);
+static int resume_session(mpapi *api);
+static void start_reconnect_thread(mpapi *api);
 
 mpapi *mpapi_create(const char *server_host, uint16_t server_port, const char *identifier)
 {
@@ -79,6 +393,7 @@ mpapi *mpapi_create(const char *server_host, uint16_t server_port, const char *i
     }
 
     api->server_port = server_port;
+    api->connect_timeout_ms = MPAPI_CONNECT_TIMEOUT_MS;
 	
 	strncpy(api->identifier, identifier, 37);
 
@@ -87,6 +402,15 @@ mpapi *mpapi_create(const char *server_host, uint16_t server_port, const char *i
     api->running = 0;
     api->listeners = NULL;
     api->next_listener_id = 1;
+    api->next_request_id = 1;
+    api->last_message_id = -1;
+    api->binary = true;
+    atomic_init(&api->binary_active, 0);
+    api->framing = MPAPI_FRAMING_NEWLINE;
+    atomic_init(&api->length_active, 0);
+    atomic_init(&api->link_down, 0);
+    atomic_init(&api->listener_table, NULL);
+    api->dispatch_table = NULL;
 
 	memset(&api->session, 0, sizeof(mpapi_session));
 
@@ -98,6 +422,21 @@ mpapi *mpapi_create(const char *server_host, uint16_t server_port, const char *i
         return NULL;
     }
 
+    if (pthread_mutex_init(&api->send_lock, NULL) != 0) {
+        pthread_mutex_destroy(&api->lock);
+        free(api->server_host);
+        free(api);
+        return NULL;
+    }
+
+    if (pthread_cond_init(&api->state_cond, NULL) != 0) {
+        pthread_mutex_destroy(&api->send_lock);
+        pthread_mutex_destroy(&api->lock);
+        free(api->server_host);
+        free(api);
+        return NULL;
+    }
+
     return api;
 }
 
@@ -117,11 +456,233 @@ void mpapi_getSessionInfo(mpapi* api, mpapi_session* out_session)
 	out_session->payload = json_copy(api->session.payload);
 }
 
+int mpapi_set_connect_timeout(mpapi *api, int timeout_ms)
+{
+	if (!api || timeout_ms < 0) return MPAPI_ERR_ARGUMENT;
+
+	api->connect_timeout_ms = timeout_ms;
+	return MPAPI_OK;
+}
+
+int mpapi_set_reconnect(mpapi *api, bool enable, int max_attempts)
+{
+	if (!api || max_attempts < 0) return MPAPI_ERR_ARGUMENT;
+	if (api->session.id || api->session_pending) return MPAPI_ERR_STATE;
+
+	api->resumable = enable;
+	api->reconnect_max_attempts = max_attempts;
+	return MPAPI_OK;
+}
+
+int mpapi_set_binary(mpapi *api, bool enable)
+{
+	if (!api) return MPAPI_ERR_ARGUMENT;
+	if (api->session.id || api->session_pending) return MPAPI_ERR_STATE;
+
+	api->binary = enable;
+	return MPAPI_OK;
+}
+
+int mpapi_set_arena(mpapi *api, bool enable)
+{
+	if (!api) return MPAPI_ERR_ARGUMENT;
+	if (api->session.id || api->session_pending) return MPAPI_ERR_STATE;
+
+	if (enable && !api->arena) {
+		api->arena = json_arena_create(0);
+		if (!api->arena) return MPAPI_ERR_IO;
+	} else if (!enable && api->arena) {
+		json_arena_destroy(api->arena);
+		api->arena = NULL;
+	}
+	return MPAPI_OK;
+}
+
+int mpapi_set_framing(mpapi *api, mpapi_framing framing)
+{
+	if (!api) return MPAPI_ERR_ARGUMENT;
+	if (framing != MPAPI_FRAMING_NEWLINE && framing != MPAPI_FRAMING_LENGTH) return MPAPI_ERR_ARGUMENT;
+	if (api->session.id || api->session_pending) return MPAPI_ERR_STATE;
+
+	api->framing = framing;
+	return MPAPI_OK;
+}
+
+int mpapi_reconnect(mpapi *api)
+{
+	if (!api) return MPAPI_ERR_ARGUMENT;
+	if (!api->threadless || api->reactor) return MPAPI_ERR_STATE;
+	if (!api->session.id || !api->session.resumeToken[0]) return MPAPI_ERR_STATE;
+
+	return resume_session(api);
+}
+
+int mpapi_set_threadless(mpapi *api, bool enable)
+{
+	if (!api) return MPAPI_ERR_ARGUMENT;
+	if (api->session.id || api->sockfd >= 0 || api->reactor) return MPAPI_ERR_STATE;
+
+	api->threadless = enable;
+	return MPAPI_OK;
+}
+
+int mpapi_fd(mpapi *api)
+{
+	if (!api) return -1;
+	return api->sockfd;
+}
+
+int mpapi_poll(mpapi *api, int max_events)
+{
+	if (!api || !api->threadless || api->reactor || api->sockfd < 0) return -1;
+
+	/* Läs först så att en stängd anslutning upptäcks innan kön töms */
+	int rc = service_socket(api, max_events, 0);
+	if (rc >= 0 && api->txq && mpapi_flush(api) != MPAPI_OK) {
+		rc = -1;
+	}
+	if (rc < 0) {
+		connection_lost(api);
+	}
+	return rc;
+}
+
+static void *reactor_thread_main(void *arg);
+
+mpapi_reactor *mpapi_reactor_create(int threads)
+{
+	if (threads <= 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = n > 0 ? (int)n : 1;
+	}
+
+	mpapi_reactor *r = (mpapi_reactor *)calloc(1, sizeof(mpapi_reactor));
+	if (!r) return NULL;
+
+	r->free_head = -1;
+	atomic_init(&r->stop, 0);
+
+	r->epfd = epoll_create1(EPOLL_CLOEXEC);
+	r->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	r->threads = (pthread_t *)calloc((size_t)threads, sizeof(pthread_t));
+	if (r->epfd < 0 || r->wakefd < 0 || !r->threads) {
+		if (r->epfd >= 0) close(r->epfd);
+		if (r->wakefd >= 0) close(r->wakefd);
+		free(r->threads);
+		free(r);
+		return NULL;
+	}
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = MPAPI_REACTOR_WAKE;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wakefd, &ev) != 0) {
+		close(r->epfd);
+		close(r->wakefd);
+		free(r->threads);
+		free(r);
+		return NULL;
+	}
+
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->idle, NULL);
+
+	for (int i = 0; i < threads; ++i) {
+		if (pthread_create(&r->threads[i], NULL, reactor_thread_main, r) != 0) {
+			break;
+		}
+		r->thread_count++;
+	}
+
+	if (r->thread_count == 0) {
+		mpapi_reactor_destroy(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+void mpapi_reactor_destroy(mpapi_reactor *reactor)
+{
+	if (!reactor) return;
+
+	/* eventfd läses inte av efter stop, så alla trådar vaknar */
+	atomic_store(&reactor->stop, 1);
+	uint64_t one = 1;
+	ssize_t w = write(reactor->wakefd, &one, sizeof(one));
+	(void)w;
+
+	for (int i = 0; i < reactor->thread_count; ++i) {
+		pthread_join(reactor->threads[i], NULL);
+	}
+
+	close(reactor->epfd);
+	close(reactor->wakefd);
+	free(reactor->threads);
+	free(reactor->entries);
+	free(reactor->pending);
+	pthread_cond_destroy(&reactor->idle);
+	pthread_mutex_destroy(&reactor->lock);
+	free(reactor);
+}
+
+mpapi *mpapi_create_on(mpapi_reactor *reactor, const char *server_host, uint16_t server_port, const char *identifier)
+{
+	if (!reactor) return NULL;
+
+	mpapi *api = mpapi_create(server_host, server_port, identifier);
+	if (!api) return NULL;
+
+	/* Instansen är trådlös; reaktorn gör det mpapi_poll annars gör */
+	api->reactor = reactor;
+	api->threadless = true;
+	return api;
+}
+
+void mpapi_getStats(mpapi *api, mpapi_stats *out_stats)
+{
+	if (!api || !out_stats) return;
+
+	memset(out_stats, 0, sizeof(mpapi_stats));
+	out_stats->rx_frames = atomic_load_explicit(&api->rx.frames, memory_order_relaxed);
+	out_stats->rx_frames_spilled = atomic_load_explicit(&api->rx.spilled, memory_order_relaxed);
+
+	if (api->txq) {
+		out_stats->tx_queue_depth = mpapi_send_queue_depth(api);
+		out_stats->tx_dropped = atomic_load_explicit(&api->txq->dropped, memory_order_relaxed);
+		out_stats->tx_batches = atomic_load_explicit(&api->txq->batches, memory_order_relaxed);
+		out_stats->tx_frames = atomic_load_explicit(&api->txq->frames, memory_order_relaxed);
+	}
+}
+
 void mpapi_destroy(mpapi *api) {
     if (!api) return;
 
-    if (api->recv_thread_started && api->sockfd >= 0) {
-        shutdown(api->sockfd, SHUT_RDWR);
+    /* Avbryter en pågående återanslutning och väcker trådar som blockerar
+       på socketen. Skrivartråden kan hänga i writev med send_lock tagen om
+       servern slutat läsa, så socketen läses under lock i stället. */
+    pthread_mutex_lock(&api->lock);
+    api->closing = true;
+    if (api->sockfd >= 0) shutdown(api->sockfd, SHUT_RDWR);
+    pthread_cond_broadcast(&api->state_cond);
+    pthread_mutex_unlock(&api->lock);
+
+    if (api->reactor_registered) {
+        reactor_remove(api);
+    }
+
+    if (api->reconnect_thread_started) {
+        pthread_join(api->reconnect_thread, NULL);
+    }
+
+    if (api->txq && api->txq->thread_started) {
+        atomic_store(&api->txq->stop, 1);
+        sem_post(&api->txq->items);
+        pthread_join(api->txq->thread, NULL);
+    }
+
+    if (api->recv_thread_started) {
         pthread_join(api->recv_thread, NULL);
     }
 
@@ -129,6 +690,8 @@ void mpapi_destroy(mpapi *api) {
         close(api->sockfd);
     }
 
+    requests_fail_all(api, MPAPI_ERR_IO);
+
     pthread_mutex_lock(&api->lock);
     ListenerNode *node = api->listeners;
     api->listeners = NULL;
@@ -140,6 +703,11 @@ void mpapi_destroy(mpapi *api) {
         node = next;
     }
 
+    free(atomic_load(&api->listener_table));
+    if (api->dispatch_table != atomic_load(&api->listener_table)) {
+        free(api->dispatch_table);
+    }
+
 	if(api->session.payload)
 	{
 		json_decref(api->session.payload);
@@ -160,7 +728,19 @@ void mpapi_destroy(mpapi *api) {
     if (api->server_host) {
         free(api->server_host);
     }
-
+    free(api->addrs);
+
+    free(api->rx.data);
+    free(api->rx.spill);
+    free(api->tx.data);
+    txq_free(api->txq);
+    free(api->game_prefix);
+    free(api->peer_ids);
+    free(api->peer_index);
+    json_arena_destroy(api->arena);
+
+    pthread_cond_destroy(&api->state_cond);
+    pthread_mutex_destroy(&api->send_lock);
     pthread_mutex_destroy(&api->lock);
     free(api);
 }
@@ -178,6 +758,9 @@ int mpapi_parse_session_info(mpapi* api, json_t* data)
     api->session.id = strdup(sessionId);
     if (!api->session.id)
         return MPAPI_ERR_IO;
+
+    if (build_game_prefix(api) != MPAPI_OK)
+        return MPAPI_ERR_IO;
     
     json_t* clientId_val = json_object_get(data, "clientId");
     const char *clientId = json_is_string(clientId_val) ? json_string_value(clientId_val) : NULL;
@@ -191,6 +774,14 @@ int mpapi_parse_session_info(mpapi* api, json_t* data)
 	strcpy(api->session.clientId, clientId);
 	strcpy(api->session.hostId, clientId);
 
+	json_t* token_val = json_object_get(data, "resumeToken");
+	const char* token = json_is_string(token_val) ? json_string_value(token_val) : NULL;
+	if (token && strlen(token) == 36) {
+		strcpy(api->session.resumeToken, token);
+	} else {
+		api->session.resumeToken[0] = '\0';
+	}
+
 	json_t* name_val = json_object_get(data, "name");
     const char* name = json_is_string(name_val) ? json_string_value(name_val) : NULL;
 	if(name) {
@@ -240,22 +831,49 @@ int mpapi_parse_session_info(mpapi* api, json_t* data)
 	return MPAPI_OK;
 }
 
-int mpapi_host(mpapi *api,
-				json_t *data,
-                char **out_session,
-                char **out_clientId,
-                json_t **out_data) {
-    if (!api) return MPAPI_ERR_ARGUMENT;
-    if (api->session.id) return MPAPI_ERR_STATE;
+/* Kopierar sessionsinformationen till de out‑parametrar som angetts. */
+static void session_out(mpapi *api, char **out_session, char **out_clientId, json_t **out_data) {
+    if (out_session)
+        *out_session = strdup(api->session.id);
+
+    if (out_clientId)
+        *(out_clientId) = strdup(api->session.clientId);
+
+    if (out_data)
+        *(out_data) = json_copy(api->session.payload);
+}
+
+int mpapi_host_async(mpapi *api, json_t *data, mpapiSessionCallback cb, void *context) {
+    if (!api || !cb) return MPAPI_ERR_ARGUMENT;
 
     int rc = ensure_connected(api);
     if (rc != MPAPI_OK) return rc;
 
+    pthread_mutex_lock(&api->lock);
+    if (api->session.id || api->session_pending) {
+        pthread_mutex_unlock(&api->lock);
+        return MPAPI_ERR_STATE;
+    }
+    api->session_pending = true;
+    pthread_mutex_unlock(&api->lock);
+
     json_t *root = json_object();
-    if (!root) return MPAPI_ERR_IO;
+    if (!root) {
+        session_pending_reset(api);
+        return MPAPI_ERR_IO;
+    }
 
     json_object_set_new(root, "identifier", json_string(api->identifier));
     json_object_set_new(root, "cmd", json_string("host"));
+    if (api->resumable) {
+        json_object_set_new(root, "resumable", json_true());
+    }
+    if (api->binary) {
+        json_object_set_new(root, "binary", json_integer(1));
+    }
+    if (api->framing == MPAPI_FRAMING_LENGTH) {
+        json_object_set_new(root, "framing", json_string("length"));
+    }
     
 	json_t *data_copy;
     if (data && json_is_object(data)) {
@@ -265,59 +883,35 @@ int mpapi_host(mpapi *api,
     }
     json_object_set_new(root, "data", data_copy);
 
-    rc = send_json_line(api, root);
-    if (rc != MPAPI_OK) {
-        return rc;
-    }
+    return send_request(api, root, REQ_HOST, cb, NULL, context);
+}
 
-    char *line = NULL;
-    rc = read_line(api, &line);
-    if (rc != MPAPI_OK) {
-        return rc;
-    }
+int mpapi_host(mpapi *api,
+				json_t *data,
+                char **out_session,
+                char **out_clientId,
+                json_t **out_data) {
+    if (!api) return MPAPI_ERR_ARGUMENT;
 
-    json_error_t jerr;
-    json_t *resp = json_loads(line, 0, &jerr);
-    free(line);
-    if (!resp || !json_is_object(resp)) {
-        if (resp) json_decref(resp);
-        return MPAPI_ERR_PROTOCOL;
-    }
+    SyncWait w;
+    sync_wait_init(&w);
 
-    json_t *cmd_val = json_object_get(resp, "cmd");
-    if (!json_is_string(cmd_val) || strcmp(json_string_value(cmd_val), "host") != 0) {
-        json_decref(resp);
-        return MPAPI_ERR_PROTOCOL;
+    int rc = mpapi_host_async(api, data, sync_session_done, &w);
+    if (rc == MPAPI_OK) {
+        rc = sync_wait(api, &w);
     }
-
-    rc = mpapi_parse_session_info(api, resp);
-	if (rc != MPAPI_OK) {
-		json_decref(resp);
-		return rc;
-	}
-
-    if (out_session)
-        *out_session = strdup(api->session.id);
-    
-    if (out_clientId)
-        *(out_clientId) = strdup(api->session.clientId);
-    
-    if (out_data)
-        *(out_data) = json_copy(api->session.payload);	
-
-    json_decref(resp);
-
-    rc = start_recv_thread(api);
+    sync_wait_destroy(&w);
     if (rc != MPAPI_OK) {
         return rc;
     }
 
+    session_out(api, out_session, out_clientId, out_data);
     return MPAPI_OK;
 }
 
-int mpapi_list(mpapi *api, json_t **out_list)
+int mpapi_list_async(mpapi *api, const mpapi_list_filter *filter, mpapiListCallback cb, void *context)
 {
-	if (!api || !out_list) return MPAPI_ERR_ARGUMENT;
+	if (!api || !cb) return MPAPI_ERR_ARGUMENT;
 
 	int rc = ensure_connected(api);
 	if (rc != MPAPI_OK) return rc;
@@ -328,68 +922,76 @@ int mpapi_list(mpapi *api, json_t **out_list)
     json_object_set_new(root, "identifier", json_string(api->identifier));
 	json_object_set_new(root, "cmd", json_string("list"));
 
-	rc = send_json_line(api, root);
-	if (rc != MPAPI_OK) {
-		return rc;
+	/* Bara det som avgränsar skickas, servern har samma standardvärden */
+	if (filter) {
+		json_t *data = json_object();
+		if (filter->offset > 0)
+			json_object_set_new(data, "offset", json_integer((json_int_t)filter->offset));
+		if (filter->limit > 0)
+			json_object_set_new(data, "limit", json_integer((json_int_t)filter->limit));
+		if (filter->notFull)
+			json_object_set_new(data, "notFull", json_true());
+		if (filter->namePrefix && filter->namePrefix[0])
+			json_object_set_new(data, "namePrefix", json_string(filter->namePrefix));
+		json_object_set_new(root, "data", data);
 	}
 
-	char *line = NULL;
-	rc = read_line(api, &line);
-	if (rc != MPAPI_OK) {
-		return rc;
-	}
+	return send_request(api, root, REQ_LIST, NULL, cb, context);
+}
 
-	json_error_t jerr;
-	json_t *resp = json_loads(line, 0, &jerr);
-	free(line);
-	if (!resp || !json_is_object(resp)) {
-		if (resp) json_decref(resp);
-		return MPAPI_ERR_PROTOCOL;
-	}
+int mpapi_list(mpapi *api, const mpapi_list_filter *filter, json_t **out_list)
+{
+	if (!api || !out_list) return MPAPI_ERR_ARGUMENT;
 
-	json_t *cmd_val = json_object_get(resp, "cmd");
-	if (!json_is_string(cmd_val) || strcmp(json_string_value(cmd_val), "list") != 0) {
-		json_decref(resp);
-		return MPAPI_ERR_PROTOCOL;
-	}
+	SyncWait w;
+	sync_wait_init(&w);
 
-	json_t *list_val = json_object_get(resp, "data");
-	if (!json_is_object(list_val)) {
-		json_decref(resp);
-		return MPAPI_ERR_PROTOCOL;
+	int rc = mpapi_list_async(api, filter, sync_list_done, &w);
+	if (rc == MPAPI_OK) {
+		rc = sync_wait(api, &w);
 	}
-
-	json_t *list_obj = json_object_get(list_val, "list");
-	if (!json_is_array(list_obj)) {
-		json_decref(resp);
-		return MPAPI_ERR_PROTOCOL;
+	if (rc == MPAPI_OK) {
+		*out_list = w.list;
+		w.list = NULL;
 	}
+	if (w.list) json_decref(w.list);
+	sync_wait_destroy(&w);
 
-	*out_list = list_obj;
-	json_incref(*out_list);
-
-	json_decref(resp);
-	return MPAPI_OK;
+	return rc;
 }
 
-int mpapi_join(mpapi *api,
-                const char *sessionId,
-                json_t *data,
-                char **out_session,
-                char **out_clientId,
-                json_t **out_data) {
-    if (!api || !sessionId) return MPAPI_ERR_ARGUMENT;
-    if (api->session.id) return MPAPI_ERR_STATE;
+int mpapi_join_async(mpapi *api, const char *sessionId, json_t *data, mpapiSessionCallback cb, void *context) {
+    if (!api || !sessionId || !cb) return MPAPI_ERR_ARGUMENT;
 
     int rc = ensure_connected(api);
     if (rc != MPAPI_OK) return rc;
 
+    pthread_mutex_lock(&api->lock);
+    if (api->session.id || api->session_pending) {
+        pthread_mutex_unlock(&api->lock);
+        return MPAPI_ERR_STATE;
+    }
+    api->session_pending = true;
+    pthread_mutex_unlock(&api->lock);
+
     json_t *root = json_object();
-    if (!root) return MPAPI_ERR_IO;
+    if (!root) {
+        session_pending_reset(api);
+        return MPAPI_ERR_IO;
+    }
 	
     json_object_set_new(root, "identifier", json_string(api->identifier));
     json_object_set_new(root, "session", json_string(sessionId));
     json_object_set_new(root, "cmd", json_string("join"));
+    if (api->resumable) {
+        json_object_set_new(root, "resumable", json_true());
+    }
+    if (api->binary) {
+        json_object_set_new(root, "binary", json_integer(1));
+    }
+    if (api->framing == MPAPI_FRAMING_LENGTH) {
+        json_object_set_new(root, "framing", json_string("length"));
+    }
 
     json_t *data_copy;
     if (data && json_is_object(data)) {
@@ -399,110 +1001,303 @@ int mpapi_join(mpapi *api,
     }
     json_object_set_new(root, "data", data_copy);
 
-    rc = send_json_line(api, root);
-    if (rc != MPAPI_OK) {
-        return rc;
-    }
+    return send_request(api, root, REQ_JOIN, cb, NULL, context);
+}
+
+int mpapi_join(mpapi *api,
+                const char *sessionId,
+                json_t *data,
+                char **out_session,
+                char **out_clientId,
+                json_t **out_data) {
+    if (!api || !sessionId) return MPAPI_ERR_ARGUMENT;
+
+    SyncWait w;
+    sync_wait_init(&w);
 
-    char *line = NULL;
-    rc = read_line(api, &line);
+    int rc = mpapi_join_async(api, sessionId, data, sync_session_done, &w);
+    if (rc == MPAPI_OK) {
+        rc = sync_wait(api, &w);
+    }
+    sync_wait_destroy(&w);
     if (rc != MPAPI_OK) {
         return rc;
     }
 
-    json_error_t jerr;
-    json_t *resp = json_loads(line, 0, &jerr);
-    free(line);
-    if (!resp || !json_is_object(resp)) {
-        if (resp) json_decref(resp);
-        return MPAPI_ERR_PROTOCOL;
+    session_out(api, out_session, out_clientId, out_data);
+    return MPAPI_OK;
+}
+
+int mpapi_game(mpapi *api, json_t *data, const char* destination) {
+    if (!api || !data) return MPAPI_ERR_ARGUMENT;
+    if (api->sockfd < 0 || !api->session.id) return MPAPI_ERR_STATE;
+
+    GameFrame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.data = data;
+    frame.destination = destination;
+
+    if (api->txq) {
+        return txq_push(api, &frame);
     }
 
-    json_t *cmd_val = json_object_get(resp, "cmd");
-    if (!json_is_string(cmd_val) || strcmp(json_string_value(cmd_val), "join") != 0) {
-        json_decref(resp);
-        return MPAPI_ERR_PROTOCOL;
+    pthread_mutex_lock(&api->send_lock);
+    api->tx.len = 0;
+    int rc = game_frame_write(api, &api->tx, &frame);
+    if (rc == MPAPI_OK) {
+        rc = send_tx_locked(api);
     }
+    api->tx.len = 0;
+    pthread_mutex_unlock(&api->send_lock);
 
-    rc = mpapi_parse_session_info(api, resp);
-	if (rc != MPAPI_OK) {
-		json_decref(resp);
-		return rc;
-	}
+    return rc;
+}
 
-    json_t* error_val = json_object_get(resp, "error");
-	if (error_val) {
-		printf("Join rejected: %s\n", json_string_value(error_val));
-		json_decref(resp);
-		return MPAPI_ERR_REJECTED;
-	}
+int mpapi_game_raw(mpapi *api, const char *json, size_t len, const char *destination) {
+    if (!api || !json || len == 0) return MPAPI_ERR_ARGUMENT;
+    if (api->sockfd < 0 || !api->session.id) return MPAPI_ERR_STATE;
 
-    if (out_session) 
-        *(out_session) = strdup(api->session.id);
-    
-    if (out_clientId) 
-        *(out_clientId) = strdup(api->session.clientId);   
-    
-    if (out_data)
-        *(out_data) = json_copy(api->session.payload);
+    if (api->debug) {
+        json_error_t jerr;
+        json_t *check = json_loadb(json, len, 0, &jerr);
+        int ok = json_is_object(check);
+        json_decref(check);
+        if (!ok) {
+            printf("mpapi_game_raw: invalid JSON: %s\n", jerr.text);
+            return MPAPI_ERR_ARGUMENT;
+        }
+    }
 
-    json_decref(resp);
+    GameFrame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.raw = json;
+    frame.raw_len = len;
+    frame.destination = destination;
 
-    rc = start_recv_thread(api);
-	if (rc != MPAPI_OK) {
-		return rc;
-	}
+    if (api->txq) {
+        return txq_push(api, &frame);
+    }
 
-	api->session.isHost = false;
+    /* Kuvertet byggs i tx, anroparens text skickas direkt från sin buffert */
+    uint32_t dest;
+    bool binary = game_binary_target(api, &frame, &dest);
+
+    pthread_mutex_lock(&api->send_lock);
+    api->tx.len = 0;
+    struct iovec iov[3];
+    int iovcnt;
+    int rc = MPAPI_OK;
+    if (binary) {
+        unsigned char head[MPAPI_BIN_HEAD_MAX];
+        size_t head_len = game_binary_head(head, &frame, dest, len);
+        if (sendbuf_append((const char *)head, head_len, &api->tx) != 0) rc = MPAPI_ERR_IO;
+        iovcnt = 2;
+
+		if(api->debug)
+			printf("TX: [G] %.*s\n", (int)len, json);
+    } else if (atomic_load_explicit(&api->length_active, memory_order_relaxed)) {
+        rc = game_frame_head(api, &api->tx, &frame);
+
+        /* Längden omfattar kuvertet, texten och avslutande '}' */
+        unsigned char head[1 + 10];
+        head[0] = MPAPI_FRAME_JSON;
+        size_t head_len = 1 + varint_put(head + 1, api->tx.len + len + 1);
+        if (rc == MPAPI_OK && sendbuf_insert_head(&api->tx, 0, head, head_len) != 0) rc = MPAPI_ERR_IO;
+        iov[2].iov_base = (void *)"}";
+        iov[2].iov_len = 1;
+        iovcnt = 3;
+
+		if(api->debug && rc == MPAPI_OK)
+			printf("TX: [J] %.*s%.*s}\n", (int)(api->tx.len - head_len), api->tx.data + head_len, (int)len, json);
+    } else if (memchr(json, '\n', len)) {
+        /* En radbrytning skulle dela meddelandet i två på tråden */
+        rc = MPAPI_ERR_ARGUMENT;
+        iovcnt = 0;
+    } else {
+        rc = game_frame_head(api, &api->tx, &frame);
+        iov[2].iov_base = (void *)"}\n";
+        iov[2].iov_len = 2;
+        iovcnt = 3;
 
-    return MPAPI_OK;
+		if(api->debug && rc == MPAPI_OK)
+			printf("TX: %.*s%.*s}\n", (int)api->tx.len, api->tx.data, (int)len, json);
+    }
+    if (rc == MPAPI_OK) {
+        iov[0].iov_base = api->tx.data;
+        iov[0].iov_len = api->tx.len;
+        iov[1].iov_base = (void *)json;
+        iov[1].iov_len = len;
+
+        if (atomic_load(&api->link_down) || writev_all(api->sockfd, iov, iovcnt) != 0) {
+            rc = MPAPI_ERR_IO;
+        }
+    }
+    api->tx.len = 0;
+    pthread_mutex_unlock(&api->send_lock);
+
+    return rc;
 }
 
-int mpapi_game(mpapi *api, json_t *data, const char* destination) {
-    if (!api || !data) return MPAPI_ERR_ARGUMENT;
-    if (api->sockfd < 0 || !api->session.id) return MPAPI_ERR_STATE;
+int mpapi_send_queue(mpapi *api, size_t capacity, mpapi_send_policy policy) {
+    if (!api || capacity == 0) return MPAPI_ERR_ARGUMENT;
+    if (policy != MPAPI_SEND_BLOCK &&
+        policy != MPAPI_SEND_DROP_OLDEST &&
+        policy != MPAPI_SEND_FAIL) {
+        return MPAPI_ERR_ARGUMENT;
+    }
+    if (api->txq || api->session.id) return MPAPI_ERR_STATE;
 
-    json_t *root = json_object();
-    if (!root) return MPAPI_ERR_IO;
+    size_t cap = 2;
+    while (cap < capacity) cap <<= 1;
 
-	json_object_set_new(root, "identifier", json_string(api->identifier));
-    json_object_set_new(root, "session", json_string(api->session.id));
-    json_object_set_new(root, "cmd", json_string("game"));
+    SendQueue *q = (SendQueue *)aligned_alloc(_Alignof(SendQueue), sizeof(SendQueue));
+    if (!q) return MPAPI_ERR_IO;
+    memset(q, 0, sizeof(SendQueue));
+
+    q->slots = (SendSlot *)calloc(cap, sizeof(SendSlot));
+    if (!q->slots) {
+        free(q);
+        return MPAPI_ERR_IO;
+    }
 
-	if(destination)
-		json_object_set_new(root, "destination", json_string(destination));
+    q->mask = cap - 1;
+    q->policy = policy;
+    for (size_t i = 0; i < cap; ++i) {
+        atomic_init(&q->slots[i].seq, i);
+    }
+    atomic_init(&q->enqueue_pos, 0);
+    atomic_init(&q->dequeue_pos, 0);
 
-    json_t *data_copy;
-    if (json_is_object(data)) {
-        data_copy = json_deep_copy(data);
-    } else {
-        data_copy = json_object();
+    if (sem_init(&q->items, 0, 0) != 0) {
+        free(q->slots);
+        free(q);
+        return MPAPI_ERR_IO;
     }
-    json_object_set_new(root, "data", data_copy);
+    pthread_mutex_init(&q->wait_lock, NULL);
+    pthread_cond_init(&q->space, NULL);
 
-    return send_json_line(api, root);
+    api->txq = q;
+    return MPAPI_OK;
 }
 
-int mpapi_listen(mpapi *api,
+int mpapi_flush(mpapi *api) {
+    if (!api) return MPAPI_ERR_ARGUMENT;
+    if (!api->txq) return MPAPI_OK;
+
+    pthread_mutex_lock(&api->send_lock);
+    int rc = txq_drain_locked(api);
+    pthread_mutex_unlock(&api->send_lock);
+
+    return rc;
+}
+
+size_t mpapi_send_queue_depth(mpapi *api) {
+    if (!api || !api->txq) return 0;
+
+    size_t deq = atomic_load_explicit(&api->txq->dequeue_pos, memory_order_relaxed);
+    size_t enq = atomic_load_explicit(&api->txq->enqueue_pos, memory_order_relaxed);
+    return enq > deq ? enq - deq : 0;
+}
+
+/* Släpper en referens till en lyssnartabell. Anroparen håller api->lock. */
+static void listener_table_release_locked(ListenerTable *table) {
+    if (table && --table->refcount == 0) {
+        free(table);
+    }
+}
+
+/* Bygger en ny lyssnartabell från listan och publicerar den. Anroparen
+   håller api->lock. */
+static int rebuild_dispatch_locked(mpapi *api) {
+    int total = 0;
+    int counts[MPAPI_EVT_COUNT];
+
+    for (int t = 0; t < MPAPI_EVT_COUNT; ++t) {
+        counts[t] = 0;
+        for (ListenerNode *node = api->listeners; node; node = node->next) {
+            if (node->type < 0 || node->type == t) counts[t]++;
+        }
+        total += counts[t];
+    }
+
+    ListenerTable *table = NULL;
+    if (total > 0) {
+        table = (ListenerTable *)malloc(sizeof(ListenerTable) + sizeof(ListenerSnapshot) * total);
+        if (!table) return -1;
+
+        table->refcount = 1;
+
+        int idx = 0;
+        for (int t = 0; t < MPAPI_EVT_COUNT; ++t) {
+            table->offset[t] = idx;
+            table->count[t] = counts[t];
+            for (ListenerNode *node = api->listeners; node; node = node->next) {
+                if (node->type < 0 || node->type == t) {
+                    table->entries[idx].cb = node->cb;
+                    table->entries[idx].event_cb = node->event_cb;
+                    table->entries[idx].context = node->context;
+                    idx++;
+                }
+            }
+        }
+    }
+
+    ListenerTable *old = atomic_exchange_explicit(&api->listener_table, table, memory_order_acq_rel);
+    listener_table_release_locked(old);
+    return 0;
+}
+
+static int add_listener(mpapi *api,
+                  int type,
                   mpapiListener cb,
+                  mpapiEventListener event_cb,
                   void *context) {
-    if (!api || !cb) return -1;
-
     ListenerNode *node = (ListenerNode *)malloc(sizeof(ListenerNode));
     if (!node) return -1;
 
+    node->type = type;
     node->cb = cb;
+    node->event_cb = event_cb;
     node->context = context;
 
     pthread_mutex_lock(&api->lock);
     node->id = api->next_listener_id++;
     node->next = api->listeners;
     api->listeners = node;
+    if (rebuild_dispatch_locked(api) != 0) {
+        api->listeners = node->next;
+        pthread_mutex_unlock(&api->lock);
+        free(node);
+        return -1;
+    }
     pthread_mutex_unlock(&api->lock);
 
     return node->id;
 }
 
+int mpapi_listen(mpapi *api,
+                  mpapiListener cb,
+                  void *context) {
+    if (!api || !cb) return -1;
+    return add_listener(api, -1, cb, NULL, context);
+}
+
+int mpapi_listen_lazy(mpapi *api,
+                  mpapiEventListener cb,
+                  void *context) {
+    if (!api || !cb) return -1;
+    return add_listener(api, -1, NULL, cb, context);
+}
+
+int mpapi_listen_event(mpapi *api,
+                  mpapi_event_type type,
+                  mpapiEventListener cb,
+                  void *context) {
+    if (!api || !cb) return -1;
+    if ((int)type < 0 || type >= MPAPI_EVT_COUNT) return -1;
+    return add_listener(api, (int)type, NULL, cb, context);
+}
+
 void mpapi_unlisten(mpapi *api, int listener_id) {
     if (!api || listener_id <= 0) return;
 
@@ -517,6 +1312,9 @@ void mpapi_unlisten(mpapi *api, int listener_id) {
                 api->listeners = cur->next;
             }
             free(cur);
+            /* Misslyckas ombyggnaden ligger den gamla tabellen kvar; den
+               borttagna lyssnaren rensas vid nästa lyckade ombyggnad */
+            rebuild_dispatch_locked(api);
             break;
         }
         prev = cur;
@@ -527,11 +1325,19 @@ void mpapi_unlisten(mpapi *api, int listener_id) {
 
 /* --- Interna hjälpfunktioner --- */
 
-static int connect_to_server(const char *host, uint16_t port) {
-    if (!host) host = "127.0.0.1";
+static int64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Slår upp servern och sparar adresserna i api->addrs, varvade så att
+   IPv6 och IPv4 turas om (med den familj getaddrinfo föredrar först). */
+static int resolve_server(mpapi *api) {
+    const char *host = api->server_host ? api->server_host : "127.0.0.1";
 
     char port_str[16];
-    snprintf(port_str, sizeof(port_str), "%u", (unsigned int)port);
+    snprintf(port_str, sizeof(port_str), "%u", (unsigned int)api->server_port);
 
     struct addrinfo hints;
     memset(&hints, 0, sizeof(hints));
@@ -544,37 +1350,188 @@ static int connect_to_server(const char *host, uint16_t port) {
         return -1;
     }
 
-    int fd = -1;
+    int first_family = res->ai_family;
+    size_t same = 0;
+    size_t other = 0;
     for (struct addrinfo *rp = res; rp != NULL; rp = rp->ai_next) {
-        fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-        if (fd == -1) continue;
-        if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) {
-            break;
+        if (rp->ai_addrlen > sizeof(struct sockaddr_storage)) continue;
+        if (rp->ai_family == first_family) same++;
+        else other++;
+    }
+
+    size_t count = same + other;
+    ConnectAddr *addrs = count ? (ConnectAddr *)calloc(count, sizeof(ConnectAddr)) : NULL;
+    if (!addrs) {
+        freeaddrinfo(res);
+        return -1;
+    }
+
+    /* Varva familjerna: först, annan, först, annan … och resten sist */
+    size_t k_same = 0;
+    size_t k_other = 0;
+    for (struct addrinfo *rp = res; rp != NULL; rp = rp->ai_next) {
+        if (rp->ai_addrlen > sizeof(struct sockaddr_storage)) continue;
+
+        size_t pos;
+        if (rp->ai_family == first_family) {
+            pos = k_same < other ? 2 * k_same : other + k_same;
+            k_same++;
+        } else {
+            pos = k_other < same ? 2 * k_other + 1 : same + k_other;
+            k_other++;
         }
-        close(fd);
-        fd = -1;
+
+        addrs[pos].family = rp->ai_family;
+        addrs[pos].len = (socklen_t)rp->ai_addrlen;
+        memcpy(&addrs[pos].addr, rp->ai_addr, rp->ai_addrlen);
     }
 
     freeaddrinfo(res);
-    return fd;
+
+    free(api->addrs);
+    api->addrs = addrs;
+    api->addr_count = count;
+    return 0;
+}
+
+/* Ansluter till adresserna i api->addrs med icke‑blockerande connect.
+   Nästa adress startas när den förra misslyckats eller efter
+   MPAPI_CONNECT_STAGGER_MS, och den första som lyckas vinner (Happy
+   Eyeballs, RFC 8305). Returnerar en blockerande socket eller -1. */
+static int race_connect(mpapi *api, int64_t deadline) {
+    struct pollfd pfd[MPAPI_CONNECT_MAX_PARALLEL];
+    int nfds = 0;
+    size_t next = 0;
+    int winner = -1;
+    int64_t next_start = monotonic_ms();
+
+    while (winner < 0) {
+        int64_t now = monotonic_ms();
+        if (deadline >= 0 && now >= deadline) break;
+
+        if (next < api->addr_count && nfds < MPAPI_CONNECT_MAX_PARALLEL &&
+            (nfds == 0 || now >= next_start)) {
+            const ConnectAddr *a = &api->addrs[next++];
+            next_start = now + MPAPI_CONNECT_STAGGER_MS;
+
+            int fd = socket(a->family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0) continue;
+
+            if (connect(fd, (const struct sockaddr *)&a->addr, a->len) == 0) {
+                winner = fd;
+            } else if (errno == EINPROGRESS) {
+                pfd[nfds].fd = fd;
+                pfd[nfds].events = POLLOUT;
+                pfd[nfds].revents = 0;
+                nfds++;
+            } else {
+                close(fd);
+            }
+            continue;
+        }
+
+        if (nfds == 0) break;
+
+        int64_t wait = -1;
+        if (deadline >= 0) wait = deadline - now;
+        if (next < api->addr_count && nfds < MPAPI_CONNECT_MAX_PARALLEL &&
+            (wait < 0 || next_start - now < wait)) {
+            wait = next_start - now;
+        }
+
+        int n = poll(pfd, (nfds_t)nfds, (int)wait);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        for (int i = 0; i < nfds && n > 0; ) {
+            if (pfd[i].revents == 0) {
+                i++;
+                continue;
+            }
+            n--;
+
+            int err = 0;
+            socklen_t err_len = sizeof(err);
+            if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == 0 && err == 0 &&
+                (pfd[i].revents & POLLOUT)) {
+                winner = pfd[i].fd;
+                pfd[i] = pfd[--nfds];
+                break;
+            }
+
+            /* Misslyckad adress, pröva nästa direkt */
+            close(pfd[i].fd);
+            pfd[i] = pfd[--nfds];
+            next_start = monotonic_ms();
+        }
+    }
+
+    for (int i = 0; i < nfds; ++i) {
+        close(pfd[i].fd);
+    }
+
+    if (winner >= 0) {
+        int flags = fcntl(winner, F_GETFL);
+        if (flags < 0 || fcntl(winner, F_SETFL, flags & ~O_NONBLOCK) != 0) {
+            close(winner);
+            return -1;
+        }
+    }
+
+    return winner;
+}
+
+static int connect_to_server(mpapi *api) {
+    int64_t deadline = api->connect_timeout_ms > 0 ? monotonic_ms() + api->connect_timeout_ms : -1;
+
+    /* Med sparade adresser prövas de först; misslyckas alla görs en ny
+       uppslagning ifall serverns adress har ändrats */
+    bool cached = api->addrs != NULL;
+    for (;;) {
+        if (!api->addrs && resolve_server(api) != 0) {
+            return -1;
+        }
+
+        int fd = race_connect(api, deadline);
+        if (fd >= 0) return fd;
+
+        free(api->addrs);
+        api->addrs = NULL;
+        api->addr_count = 0;
+
+        if (!cached || (deadline >= 0 && monotonic_ms() >= deadline)) {
+            return -1;
+        }
+        cached = false;
+    }
 }
 
 static int ensure_connected(mpapi *api) {
     if (!api) return MPAPI_ERR_ARGUMENT;
     if (api->sockfd >= 0) return MPAPI_OK;
 
-    int fd = connect_to_server(api->server_host, api->server_port);
+    int fd = connect_to_server(api);
     if (fd < 0) {
         return MPAPI_ERR_CONNECT;
     }
     api->sockfd = fd;
+
+    /* Mottagarsidan startas direkt så att alla svar går samma väg */
+    int rc = start_recv_thread(api);
+    if (rc != MPAPI_OK) {
+        close(fd);
+        api->sockfd = -1;
+        return rc;
+    }
     return MPAPI_OK;
 }
 
 static int send_all(int fd, const char *buf, size_t len) {
     size_t sent = 0;
     while (sent < len) {
-        ssize_t n = send(fd, buf + sent, len - sent, 0);
+        ssize_t n = send(fd, buf + sent, len - sent, MSG_NOSIGNAL);
         if (n < 0) {
             if (errno == EINTR) continue;
             return -1;
@@ -587,233 +1544,1569 @@ static int send_all(int fd, const char *buf, size_t len) {
     return 0;
 }
 
-static int send_json_line(mpapi *api, json_t *obj) {
-    if (!api || api->sockfd < 0 || !obj) return MPAPI_ERR_ARGUMENT;
+/* json_dump_callback_t som lägger till i en SendBuffer. */
+static int sendbuf_append(const char *buf, size_t size, void *data) {
+    SendBuffer *tx = (SendBuffer *)data;
 
-    char *text = json_dumps(obj, JSON_COMPACT);
-    if (!text) {
-        json_decref(obj);
-        return MPAPI_ERR_IO;
+    if (tx->len + size > tx->cap) {
+        size_t new_cap = tx->cap == 0 ? 1024 : tx->cap;
+        while (new_cap < tx->len + size) new_cap *= 2;
+
+        char *tmp = (char *)realloc(tx->data, new_cap);
+        if (!tmp) return -1;
+        tx->data = tmp;
+        tx->cap = new_cap;
     }
 
-	if(api->debug)
-		printf("TX: %s\n", text);
+    memcpy(tx->data + tx->len, buf, size);
+    tx->len += size;
+    return 0;
+}
 
-    size_t len = strlen(text);
-    int fd = api->sockfd;
+/* --- Binära ramar --- */
 
-    int rc = 0;
-    if (send_all(fd, text, len) != 0 || send_all(fd, "\n", 1) != 0) {
+static size_t varint_put(unsigned char *p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (unsigned char)v;
+    return n;
+}
+
+/* Läser en varint. Returnerar pekaren efter den, eller NULL om den är
+   avhuggen eller längre än tio byte. */
+static const unsigned char *varint_get(const unsigned char *p, const unsigned char *end, uint64_t *out) {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 70 && p < end; shift += 7) {
+        unsigned char b = *p++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *out = v;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/* Flyttar in head framför de byte som skrivits till out från start. */
+static int sendbuf_insert_head(SendBuffer *out, size_t start, const unsigned char *head, size_t head_len) {
+    size_t body_len = out->len - start;
+
+    if (sendbuf_append((const char *)head, head_len, out) != 0)
+        return -1;
+    memmove(out->data + start + head_len, out->data + start, body_len);
+    memcpy(out->data + start, head, head_len);
+    return 0;
+}
+
+/* Avslutar ett JSON‑meddelande som skrivits till out från start: radslut,
+   eller ett längdprefix om MPAPI_FRAMING_LENGTH är förhandlat. */
+static int frame_end(mpapi *api, SendBuffer *out, size_t start) {
+    if (!atomic_load_explicit(&api->length_active, memory_order_relaxed)) {
+        return sendbuf_append("\n", 1, out);
+    }
+
+    unsigned char head[1 + 10];
+    head[0] = MPAPI_FRAME_JSON;
+    size_t head_len = 1 + varint_put(head + 1, out->len - start);
+    return sendbuf_insert_head(out, start, head, head_len);
+}
+
+static int send_json_line(mpapi *api, json_t *obj) {
+    if (!api || api->sockfd < 0 || !obj) return MPAPI_ERR_ARGUMENT;
+
+    pthread_mutex_lock(&api->send_lock);
+
+    SendBuffer *tx = &api->tx;
+    tx->len = 0;
+
+    int rc = MPAPI_OK;
+    if (json_dump_callback(obj, sendbuf_append, tx, JSON_COMPACT) != 0 ||
+        frame_end(api, tx, 0) != 0) {
         rc = MPAPI_ERR_IO;
     }
 
-    free(text);
+    if (rc == MPAPI_OK) {
+        rc = send_tx_locked(api);
+    }
+    tx->len = 0;
+
+    pthread_mutex_unlock(&api->send_lock);
+
     json_decref(obj);
 
     return rc;
 }
 
-static int read_line(mpapi *api, char **out_line) {
-    if (!out_line) return MPAPI_ERR_ARGUMENT;
-
-    size_t cap = 256;
-    size_t len = 0;
-    char *buf = (char *)malloc(cap);
-    if (!buf) return MPAPI_ERR_IO;
+/* Skriver ut ett utgående meddelande, textrad eller binär ram. */
+static void debug_tx(const char *data, size_t len) {
+    if (len > 0 && data[0] == MPAPI_FRAME_GAME) {
+        printf("TX: [G %zu byte]\n", len);
+    } else if (len > 0 && data[0] == MPAPI_FRAME_JSON) {
+        uint64_t body_len = 0;
+        const unsigned char *body = varint_get((const unsigned char *)data + 1,
+                                               (const unsigned char *)data + len, &body_len);
+        if (body) printf("TX: [J] %.*s\n", (int)body_len, (const char *)body);
+    } else {
+        printf("TX: %.*s\n", (int)(len - 1), data);
+    }
+}
 
-    for (;;) {
-        char c;
-        ssize_t n = recv(api->sockfd, &c, 1, 0);
-        if (n < 0) {
-            if (errno == EINTR) continue;
-            free(buf);
-            return MPAPI_ERR_IO;
-        }
-        if (n == 0) {
-            free(buf);
-            return MPAPI_ERR_IO;
-        }
+/* Skickar api->tx. Anroparen håller send_lock. */
+static int send_tx_locked(mpapi *api) {
+    SendBuffer *tx = &api->tx;
+    int rc = MPAPI_OK;
 
-        if (c == '\n') {
-            break;
-        }
+	if(api->debug)
+		debug_tx(tx->data, tx->len);
 
-        if (len + 1 >= cap) {
-            cap *= 2;
-            char *tmp = (char *)realloc(buf, cap);
-            if (!tmp) {
-                free(buf);
-                return MPAPI_ERR_IO;
-            }
-            buf = tmp;
-        }
+    /* Payload och radslut i ett och samma send() */
+    if (atomic_load(&api->link_down) || send_all(api->sockfd, tx->data, tx->len) != 0) {
+        rc = MPAPI_ERR_IO;
+    }
 
-        buf[len++] = c;
+    if (tx->cap > MPAPI_TX_KEEP_CAP) {
+        free(tx->data);
+        tx->data = NULL;
+        tx->cap = 0;
     }
 
-    buf[len] = '\0';
+    return rc;
+}
 
-	if(api->debug)
-		printf("RX: %s\n", buf);
+/* Serialiserar det fasta början av game‑meddelanden för sessionen en gång,
+   så att varje mpapi_game bara behöver lägga till destination och data. */
+static int build_game_prefix(mpapi *api) {
+    json_t *root = json_object();
+    if (!root) return MPAPI_ERR_IO;
+
+	json_object_set_new(root, "identifier", json_string(api->identifier));
+    json_object_set_new(root, "session", json_string(api->session.id));
+    json_object_set_new(root, "cmd", json_string("game"));
+
+    char *text = json_dumps(root, JSON_COMPACT);
+    json_decref(root);
+    if (!text) return MPAPI_ERR_IO;
 
-    *out_line = buf;
+    /* Byt avslutande '}' mot ',' så att fler nycklar kan följa */
+    size_t len = strlen(text);
+    text[len - 1] = ',';
+
+    free(api->game_prefix);
+    api->game_prefix = text;
+    api->game_prefix_len = len;
     return MPAPI_OK;
 }
 
-static void process_line(mpapi *api, const char *line) {
-    if (!api || !line || !*line) return;
+/* Lägger till str som JSON‑sträng. Strängar utan tecken som behöver
+   escapas kopieras direkt, övriga går via jansson. */
+static int sendbuf_append_string(SendBuffer *out, const char *str) {
+    const unsigned char *p = (const unsigned char *)str;
+    while (*p && *p != '"' && *p != '\\' && *p >= 0x20) p++;
 
-    json_error_t jerr;
-    json_t *root = json_loads(line, 0, &jerr);
-    if (!root || !json_is_object(root)) {
-        if (root) json_decref(root);
-        return;
+    if (!*p) {
+        if (sendbuf_append("\"", 1, out) != 0 ||
+            sendbuf_append(str, (size_t)(p - (const unsigned char *)str), out) != 0 ||
+            sendbuf_append("\"", 1, out) != 0) {
+            return -1;
+        }
+        return 0;
     }
 
-    json_t *cmd_val = json_object_get(root, "cmd");
-    if (!json_is_string(cmd_val)) {
-        json_decref(root);
-        return;
-    }
+    json_t *value = json_string(str);
+    if (!value) return -1;
+    int rc = json_dump_callback(value, sendbuf_append, out, JSON_ENCODE_ANY);
+    json_decref(value);
+    return rc;
+}
 
-    const char *cmd = json_string_value(cmd_val);
-    if (!cmd) {
-        json_decref(root);
-        return;
+static uint32_t peer_hash(const char *clientId) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < 36; ++i) {
+        h ^= (unsigned char)clientId[i];
+        h *= 16777619u;
     }
+    return h;
+}
 
-    if (strcmp(cmd, "joined") != 0 &&
-        strcmp(cmd, "leaved") != 0 &&
-        strcmp(cmd, "game") != 0) {
-        json_decref(root);
-        return;
+/* Handtaget för clientId, eller -1. Anroparen håller api->lock. */
+static int64_t peer_handle_locked(mpapi *api, const char *clientId) {
+    if (api->peer_index_cap == 0 || strlen(clientId) != 36) return -1;
+
+    uint32_t mask = api->peer_index_cap - 1;
+    for (uint32_t i = peer_hash(clientId) & mask; api->peer_index[i]; i = (i + 1) & mask) {
+        uint32_t h = api->peer_index[i] - 1;
+        if (memcmp(api->peer_ids[h], clientId, 37) == 0) return h;
     }
+    return -1;
+}
 
-    json_int_t msgId = 0;
-    json_t *mid_val = json_object_get(root, "messageId");
-    if (json_is_integer(mid_val)) {
-        msgId = json_integer_value(mid_val);
+static void peer_index_insert(mpapi *api, uint32_t handle) {
+    uint32_t mask = api->peer_index_cap - 1;
+    uint32_t i = peer_hash(api->peer_ids[handle]) & mask;
+    while (api->peer_index[i]) i = (i + 1) & mask;
+    api->peer_index[i] = handle + 1;
+    api->peer_index_used++;
+}
+
+/* Bygger om indexet ur peer_ids så att det är högst en fjärdedel fullt.
+   Misslyckas det blir indexet tomt och riktade meddelanden går som text. */
+static void peer_index_rebuild(mpapi *api) {
+    uint32_t live = 0;
+    for (uint32_t h = 0; h < api->peer_cap; ++h) {
+        if (api->peer_ids[h][0]) live++;
     }
 
-    const char *clientId = NULL;
-    json_t *cid_val = json_object_get(root, "clientId");
-    if (json_is_string(cid_val)) {
-        clientId = json_string_value(cid_val);
+    uint32_t cap = 16;
+    while (cap < live * 4) cap *= 2;
+    if (cap != api->peer_index_cap) {
+        uint32_t *tmp = realloc(api->peer_index, sizeof(*tmp) * cap);
+        if (!tmp) {
+            free(api->peer_index);
+            api->peer_index = NULL;
+            api->peer_index_cap = 0;
+            api->peer_index_used = 0;
+            return;
+        }
+        api->peer_index = tmp;
+        api->peer_index_cap = cap;
     }
 
-    json_t *data_val = json_object_get(root, "data");
-    json_t *data_obj;
-    if (json_is_object(data_val)) {
-        data_obj = data_val;
-        json_incref(data_obj);
-    } else {
-        data_obj = json_object();
+    memset(api->peer_index, 0, sizeof(*api->peer_index) * cap);
+    api->peer_index_used = 0;
+    for (uint32_t h = 0; h < api->peer_cap; ++h) {
+        if (api->peer_ids[h][0]) peer_index_insert(api, h);
     }
+}
 
-    pthread_mutex_lock(&api->lock);
-    int count = 0;
-    ListenerNode *node = api->listeners;
-    while (node) {
-        if (node->cb) count++;
-        node = node->next;
+/* Sparar clientId för ett handtag. Anroparen är mottagarsidan och håller
+   api->lock. */
+static void peer_set_locked(mpapi *api, int64_t handle, const char *clientId, size_t len) {
+    if (handle < 0 || handle >= MPAPI_PEER_MAX || len != 36) return;
+
+    if ((uint32_t)handle >= api->peer_cap) {
+        uint32_t cap = api->peer_cap ? api->peer_cap : 16;
+        while (cap <= (uint32_t)handle) cap *= 2;
+
+        char (*tmp)[37] = realloc(api->peer_ids, sizeof(*tmp) * cap);
+        if (!tmp) return;
+        memset(tmp + api->peer_cap, 0, sizeof(*tmp) * (cap - api->peer_cap));
+        api->peer_ids = tmp;
+        api->peer_cap = cap;
     }
 
-    if (count == 0) {
-        pthread_mutex_unlock(&api->lock);
-        json_decref(data_obj);
-        json_decref(root);
+    if (memcmp(api->peer_ids[handle], clientId, 36) == 0 && peer_handle_locked(api, api->peer_ids[handle]) == handle) {
         return;
     }
+    memcpy(api->peer_ids[handle], clientId, 36);
+    api->peer_ids[handle][36] = '\0';
 
-    ListenerSnapshot *snapshot = (ListenerSnapshot *)malloc(sizeof(ListenerSnapshot) * count);
-    if (!snapshot) {
-        pthread_mutex_unlock(&api->lock);
-        json_decref(data_obj);
-        json_decref(root);
-        return;
+    if (api->peer_index_used + 1 > api->peer_index_cap / 2) {
+        peer_index_rebuild(api);
+    } else {
+        peer_index_insert(api, (uint32_t)handle);
     }
+}
 
-    int idx = 0;
-    node = api->listeners;
-    while (node) {
-        if (node->cb) {
-            snapshot[idx].cb = node->cb;
-            snapshot[idx].context = node->context;
-            idx++;
+/* Handtag till clientId, NULL om det är okänt. Bara för mottagarsidan,
+   som är den enda som skriver i tabellen. */
+static const char *peer_id(mpapi *api, uint64_t handle) {
+    if (handle >= api->peer_cap || !api->peer_ids[handle][0]) return NULL;
+    return api->peer_ids[handle];
+}
+
+/* Läser in sessionens handtag ur svaret på host/join. */
+static void peers_load(mpapi *api, json_t *resp) {
+    json_t *clients = json_object_get(resp, "clients");
+    json_t *handles = json_object_get(resp, "handles");
+    json_t *own = json_object_get(resp, "handle");
+
+    pthread_mutex_lock(&api->lock);
+    if (api->peer_ids) {
+        memset(api->peer_ids, 0, sizeof(*api->peer_ids) * api->peer_cap);
+    }
+    if (api->peer_index) {
+        memset(api->peer_index, 0, sizeof(*api->peer_index) * api->peer_index_cap);
+        api->peer_index_used = 0;
+    }
+
+    size_t i;
+    json_t *handle;
+    json_array_foreach(handles, i, handle) {
+        json_t *id = json_array_get(clients, i);
+        if (json_is_integer(handle) && json_is_string(id)) {
+            peer_set_locked(api, json_integer_value(handle), json_string_value(id), json_string_length(id));
         }
-        node = node->next;
+    }
+    if (json_is_integer(own)) {
+        peer_set_locked(api, json_integer_value(own), api->session.clientId, strlen(api->session.clientId));
     }
     pthread_mutex_unlock(&api->lock);
+}
 
-    for (int i = 0; i < count; ++i) {
-        snapshot[i].cb(cmd, (int64_t)msgId, clientId, data_obj, snapshot[i].context);
-    }
+/* Avgör vad servern gick med på i svaret på host, join eller resume. En
+   server som inte känner till binära ramar eller längdprefix svarar utan
+   fälten. */
+static void protocol_load(mpapi *api, json_t *resp) {
+    json_t *binary = json_object_get(resp, "binary");
+    atomic_store(&api->binary_active, api->binary && json_is_integer(binary) && json_integer_value(binary) == 1);
 
-    free(snapshot);
-    json_decref(data_obj);
-    json_decref(root);
+    const char *framing = json_string_value(json_object_get(resp, "framing"));
+    atomic_store(&api->length_active, api->framing == MPAPI_FRAMING_LENGTH &&
+                                      framing && strcmp(framing, "length") == 0);
 }
 
-static void *recv_thread_main(void *arg) {
-    mpapi *api = (mpapi *)arg;
-    char buffer[1024];
-    char *acc = NULL;
-    size_t acc_len = 0;
-    size_t acc_cap = 0;
+/* Avgör om frame kan skickas som binär ram och slår i så fall upp
+   destinationens handtag. Okända och tomma destinationer går som text så
+   att servern avgör vad de betyder. */
+static bool game_binary_target(mpapi *api, const GameFrame *frame, uint32_t *out_dest) {
+    if (!atomic_load_explicit(&api->binary_active, memory_order_relaxed)) return false;
 
-    while (1) {
-        ssize_t n = recv(api->sockfd, buffer, sizeof(buffer), 0);
-        if (n <= 0) {
-            break;
-        }
+    *out_dest = 0;
+    if (!frame->destination) return true;
+    if (!frame->destination[0]) return false;
 
-        for (ssize_t i = 0; i < n; ++i) {
-            char ch = buffer[i];
-            if (ch == '\n') {
-                if (acc_len > 0) {
-                    char *line = (char *)malloc(acc_len + 1);
-                    if (!line) {
-                        acc_len = 0;
-                        continue;
-                    }
-                    memcpy(line, acc, acc_len);
-                    line[acc_len] = '\0';
-
-                    acc_len = 0;
-                    process_line(api, line);
-                    free(line);
-                } else {
-                    acc_len = 0;
-                }
-            } else {
-                if (acc_len + 1 >= acc_cap) {
-                    size_t new_cap = acc_cap == 0 ? 256 : acc_cap * 2;
-                    char *tmp = (char *)realloc(acc, new_cap);
-                    if (!tmp) {
-                        free(acc);
-                        acc = NULL;
-                        acc_len = 0;
-                        acc_cap = 0;
-                        break;
-                    }
-                    acc = tmp;
-                    acc_cap = new_cap;
+    pthread_mutex_lock(&api->lock);
+    int64_t handle = peer_handle_locked(api, frame->destination);
+    pthread_mutex_unlock(&api->lock);
+
+    if (handle < 0) return false;
+    *out_dest = (uint32_t)handle;
+    return true;
+}
+
+/* Skriver huvudet för en binär game‑ram till head (högst
+   MPAPI_BIN_HEAD_MAX byte) och returnerar dess längd. */
+static size_t game_binary_head(unsigned char *head, const GameFrame *frame, uint32_t dest, size_t payload_len) {
+    unsigned char fields[6];
+    size_t fields_len = 0;
+
+    fields[fields_len++] = frame->destination ? MPAPI_GAME_DIRECTED : 0;
+    if (frame->destination) {
+        fields_len += varint_put(fields + fields_len, dest);
+    }
+
+    size_t n = 0;
+    head[n++] = MPAPI_FRAME_GAME;
+    n += varint_put(head + n, fields_len + payload_len);
+    memcpy(head + n, fields, fields_len);
+    return n + fields_len;
+}
+
+/* Serialiserar en binär game‑ram till out. Data skrivs först och huvudet
+   flyttas in framför när längden är känd. */
+static int game_binary_write(SendBuffer *out, const GameFrame *frame, uint32_t dest) {
+    size_t start = out->len;
+
+    if (frame->raw) {
+        if (sendbuf_append(frame->raw, frame->raw_len, out) != 0)
+            return MPAPI_ERR_IO;
+    } else if (json_is_object(frame->data)) {
+        if (json_dump_callback(frame->data, sendbuf_append, out, JSON_COMPACT) != 0)
+            return MPAPI_ERR_IO;
+    } else {
+        if (sendbuf_append("{}", 2, out) != 0)
+            return MPAPI_ERR_IO;
+    }
+
+    unsigned char head[MPAPI_BIN_HEAD_MAX];
+    size_t head_len = game_binary_head(head, frame, dest, out->len - start);
+
+    if (sendbuf_insert_head(out, start, head, head_len) != 0)
+        return MPAPI_ERR_IO;
+    return MPAPI_OK;
+}
+
+/* Skriver kuvertet fram till och med "data": till out. */
+static int game_frame_head(mpapi *api, SendBuffer *out, const GameFrame *frame) {
+    if (!api->game_prefix) return MPAPI_ERR_STATE;
+
+    if (sendbuf_append(api->game_prefix, api->game_prefix_len, out) != 0)
+        return MPAPI_ERR_IO;
+
+    if (frame->destination) {
+        if (sendbuf_append("\"destination\":", 14, out) != 0 ||
+            sendbuf_append_string(out, frame->destination) != 0 ||
+            sendbuf_append(",", 1, out) != 0) {
+            return MPAPI_ERR_IO;
+        }
+    }
+
+    if (sendbuf_append("\"data\":", 7, out) != 0)
+        return MPAPI_ERR_IO;
+
+    return MPAPI_OK;
+}
+
+/* Serialiserar ett komplett game‑meddelande inklusive radslut till out.
+   Data skrivs direkt efter det förberedda kuvertet utan kopiering. */
+static int game_frame_write(mpapi *api, SendBuffer *out, const GameFrame *frame) {
+    if (!api->game_prefix) return MPAPI_ERR_STATE;
+
+    uint32_t dest;
+    if (game_binary_target(api, frame, &dest)) {
+        return game_binary_write(out, frame, dest);
+    }
+
+    /* En radbrytning skulle dela meddelandet i två på tråden */
+    if (frame->raw && !atomic_load_explicit(&api->length_active, memory_order_relaxed) &&
+        memchr(frame->raw, '\n', frame->raw_len)) {
+        return MPAPI_ERR_ARGUMENT;
+    }
+
+    size_t start = out->len;
+    int rc = game_frame_head(api, out, frame);
+    if (rc != MPAPI_OK) return rc;
+
+    if (frame->raw) {
+        if (sendbuf_append(frame->raw, frame->raw_len, out) != 0)
+            return MPAPI_ERR_IO;
+    } else if (json_is_object(frame->data)) {
+        if (json_dump_callback(frame->data, sendbuf_append, out, JSON_COMPACT) != 0)
+            return MPAPI_ERR_IO;
+    } else {
+        if (sendbuf_append("{}", 2, out) != 0)
+            return MPAPI_ERR_IO;
+    }
+
+    if (sendbuf_append("}", 1, out) != 0 || frame_end(api, out, start) != 0)
+        return MPAPI_ERR_IO;
+
+    return MPAPI_OK;
+}
+
+static int writev_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        /* sendmsg i stället för writev för att slippa SIGPIPE */
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (size_t)iovcnt;
+
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+
+        size_t left = (size_t)n;
+        while (iovcnt > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    return 0;
+}
+
+/* Tar ut det äldsta meddelandet ur kön. Med swap byts platsens buffert mot
+   *swap (konsumenten tar över innehållet), annars slängs innehållet.
+   Returnerar 0 om kön är tom. */
+static int txq_pop(SendQueue *q, SendBuffer *swap) {
+    SendSlot *slot;
+    size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+
+    for (;;) {
+        slot = &q->slots[pos & q->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+        }
+    }
+
+    if (swap) {
+        SendBuffer tmp = slot->buf;
+        slot->buf = *swap;
+        *swap = tmp;
+    }
+    slot->buf.len = 0;
+    atomic_store_explicit(&slot->seq, pos + q->mask + 1, memory_order_release);
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&q->waiters, memory_order_relaxed) > 0) {
+        pthread_mutex_lock(&q->wait_lock);
+        pthread_cond_broadcast(&q->space);
+        pthread_mutex_unlock(&q->wait_lock);
+    }
+
+    return 1;
+}
+
+/* Anropas när kön är full vid position pos. Hanterar kön enligt policy;
+   MPAPI_OK betyder att producenten ska försöka igen. */
+static int txq_make_room(mpapi *api, size_t pos) {
+    SendQueue *q = api->txq;
+
+    switch (q->policy) {
+    case MPAPI_SEND_FAIL:
+        atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+        return MPAPI_ERR_FULL;
+
+    case MPAPI_SEND_DROP_OLDEST:
+        if (txq_pop(q, NULL)) {
+            atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+        } else {
+            /* Äldsta platsen skrivs fortfarande av en annan producent */
+            sched_yield();
+        }
+        return MPAPI_OK;
+
+    case MPAPI_SEND_BLOCK:
+    default:
+        if (!q->thread_started) {
+            /* Ingen skrivtråd ännu, töm kön själv */
+            return mpapi_flush(api);
+        }
+
+        pthread_mutex_lock(&q->wait_lock);
+        atomic_fetch_add(&q->waiters, 1);
+        SendSlot *slot = &q->slots[pos & q->mask];
+        if ((intptr_t)atomic_load(&slot->seq) - (intptr_t)pos < 0) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 10 * 1000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&q->space, &q->wait_lock, &ts);
+        }
+        atomic_fetch_sub(&q->waiters, 1);
+        pthread_mutex_unlock(&q->wait_lock);
+        return MPAPI_OK;
+    }
+}
+
+/* Serialiserar frame direkt in i en ledig plats i sändkön. */
+static int txq_push(mpapi *api, const GameFrame *frame) {
+    SendQueue *q = api->txq;
+    if (atomic_load_explicit(&q->error, memory_order_relaxed)) return MPAPI_ERR_IO;
+
+    SendSlot *slot;
+    size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+
+    for (;;) {
+        slot = &q->slots[pos & q->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            int rc = txq_make_room(api, pos);
+            if (rc != MPAPI_OK) return rc;
+            pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+        } else {
+            pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    slot->buf.len = 0;
+    int rc = game_frame_write(api, &slot->buf, frame);
+    if (rc != MPAPI_OK) {
+        /* Platsen måste ändå släppas; tomma platser hoppas över */
+        slot->buf.len = 0;
+    }
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    sem_post(&q->items);
+
+    if (api->reactor_registered) {
+        reactor_request_flush(api);
+    }
+
+    return rc;
+}
+
+/* Tömmer sändkön och skickar innehållet med ett writev per omgång om
+   högst MPAPI_TX_BATCH meddelanden. Anroparen håller send_lock. */
+static int txq_drain_locked(mpapi *api) {
+    SendQueue *q = api->txq;
+
+    /* Under återanslutning ligger meddelandena kvar i kön */
+    if (atomic_load(&api->link_down)) return MPAPI_ERR_IO;
+
+    for (;;) {
+        int n = 0;
+        int iovcnt = 0;
+
+        while (n < MPAPI_TX_BATCH && txq_pop(q, &q->batch[n])) {
+            SendBuffer *b = &q->batch[n];
+            if (b->len > 0) {
+				if(api->debug)
+					debug_tx(b->data, b->len);
+
+                q->iov[iovcnt].iov_base = b->data;
+                q->iov[iovcnt].iov_len = b->len;
+                iovcnt++;
+            }
+            n++;
+        }
+
+        if (n == 0) break;
+
+        /* Efter ett skrivfel töms kön ändå så att blockerade producenter släpps */
+        if (iovcnt > 0 && !atomic_load_explicit(&q->error, memory_order_relaxed)) {
+            if (writev_all(api->sockfd, q->iov, iovcnt) != 0) {
+                atomic_store(&q->error, 1);
+            } else {
+                atomic_fetch_add_explicit(&q->batches, 1, memory_order_relaxed);
+                atomic_fetch_add_explicit(&q->frames, (uint_least64_t)iovcnt, memory_order_relaxed);
+            }
+        }
+
+        for (int i = 0; i < n; ++i) {
+            SendBuffer *b = &q->batch[i];
+            b->len = 0;
+            if (b->cap > MPAPI_TX_KEEP_CAP) {
+                free(b->data);
+                b->data = NULL;
+                b->cap = 0;
+            }
+        }
+
+        if (n < MPAPI_TX_BATCH) break;
+    }
+
+    return atomic_load(&q->error) ? MPAPI_ERR_IO : MPAPI_OK;
+}
+
+static void txq_free(SendQueue *q) {
+    if (!q) return;
+
+    for (size_t i = 0; i <= q->mask; ++i) {
+        free(q->slots[i].buf.data);
+    }
+    for (int i = 0; i < MPAPI_TX_BATCH; ++i) {
+        free(q->batch[i].data);
+    }
+    free(q->slots);
+
+    sem_destroy(&q->items);
+    pthread_cond_destroy(&q->space);
+    pthread_mutex_destroy(&q->wait_lock);
+    free(q);
+}
+
+static void *send_thread_main(void *arg) {
+    mpapi *api = (mpapi *)arg;
+    SendQueue *q = api->txq;
+
+    for (;;) {
+        while (sem_wait(&q->items) != 0 && errno == EINTR) {
+        }
+        /* Allt som redan postats hämtas i samma omgång */
+        while (sem_trywait(&q->items) == 0) {
+        }
+
+        pthread_mutex_lock(&api->send_lock);
+        txq_drain_locked(api);
+        pthread_mutex_unlock(&api->send_lock);
+
+        if (atomic_load(&q->stop)) break;
+    }
+
+    return NULL;
+}
+
+static int start_send_thread(mpapi *api) {
+    if (!api) return MPAPI_ERR_ARGUMENT;
+    if (!api->txq || api->txq->thread_started || api->threadless) {
+        return MPAPI_OK;
+    }
+
+    int rc = pthread_create(&api->txq->thread, NULL, send_thread_main, api);
+    if (rc != 0) {
+        return MPAPI_ERR_IO;
+    }
+
+    api->txq->thread_started = 1;
+    return MPAPI_OK;
+}
+
+/* Läser så mycket som ryms i nästa sammanhängande lediga del av
+   mottagningsbufferten. Returnerar antal lästa byte, 0 vid EOF och -1 vid fel
+   (EAGAIN med MSG_DONTWAIT när inget finns att läsa). */
+static ssize_t rx_fill(mpapi *api, int flags) {
+    RecvBuffer *rx = &api->rx;
+
+    if (rx->len == rx->cap || rx->want > rx->cap) {
+        size_t new_cap = rx->cap == 0 ? MPAPI_RX_INITIAL_CAP : rx->cap * 2;
+        while (new_cap < rx->want) new_cap *= 2;
+        if (new_cap > MPAPI_RX_MAX_CAP) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+
+        char *tmp = (char *)malloc(new_cap);
+        if (!tmp) return -1;
+
+        /* Linjärisera olästa byte i den nya bufferten */
+        size_t first = rx->len;
+        if (rx->head + first > rx->cap) first = rx->cap - rx->head;
+        if (first > 0) memcpy(tmp, rx->data + rx->head, first);
+        if (rx->len > first) memcpy(tmp + first, rx->data, rx->len - first);
+
+        free(rx->data);
+        rx->data = tmp;
+        rx->cap = new_cap;
+        rx->head = 0;
+    }
+
+    char *dst;
+    size_t room;
+    size_t tail = rx->head + rx->len;
+    if (tail < rx->cap) {
+        dst = rx->data + tail;
+        room = rx->cap - tail;
+    } else {
+        tail -= rx->cap;
+        dst = rx->data + tail;
+        room = rx->head - tail;
+    }
+
+    ssize_t n = recv(api->sockfd, dst, room, flags);
+    if (n > 0) {
+        rx->len += (size_t)n;
+    }
+    return n;
+}
+
+/* Byte nummer off räknat från första olästa byte. */
+static unsigned char rx_byte(const RecvBuffer *rx, size_t off) {
+    size_t pos = rx->head + off;
+    if (pos >= rx->cap) pos -= rx->cap;
+    return (unsigned char)rx->data[pos];
+}
+
+/* Ger len byte med början off byte efter head som ett sammanhängande
+   fönster. Går fönstret runt buffertens slut kopieras det till spill.
+   Returnerar NULL vid minnesbrist. */
+static const char *rx_window(RecvBuffer *rx, size_t off, size_t len) {
+    size_t pos = rx->head + off;
+    if (pos >= rx->cap) pos -= rx->cap;
+
+    if (pos + len <= rx->cap) {
+        return rx->data + pos;
+    }
+
+    if (len > rx->spill_cap) {
+        char *tmp = (char *)realloc(rx->spill, len);
+        if (!tmp) return NULL;
+        rx->spill = tmp;
+        rx->spill_cap = len;
+    }
+    size_t first = rx->cap - pos;
+    memcpy(rx->spill, rx->data + pos, first);
+    memcpy(rx->spill + first, rx->data, len - first);
+    atomic_fetch_add_explicit(&rx->spilled, 1, memory_order_relaxed);
+    return rx->spill;
+}
+
+static void rx_consume(RecvBuffer *rx, size_t n) {
+    rx->head += n;
+    if (rx->head >= rx->cap) rx->head -= rx->cap;
+    rx->len -= n;
+    rx->scanned = 0;
+    rx->want = 0;
+    if (rx->len == 0) rx->head = 0;
+}
+
+/* Plockar ut nästa binära ram om en sådan står först i bufferten. Är
+   ramen inte komplett noteras dess storlek så att bufferten kan växa till
+   rätt storlek direkt. */
+static int rx_next_binary(RecvBuffer *rx, const char **out_frame, size_t *out_len) {
+    uint64_t body_len = 0;
+    size_t head_len = 1;
+    for (int shift = 0;; shift += 7) {
+        if (shift > 28) return -1;
+        if (head_len >= rx->len) return 0;
+
+        unsigned char b = rx_byte(rx, head_len++);
+        body_len |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) break;
+    }
+    if (body_len + head_len > MPAPI_RX_MAX_CAP) return -1;
+    if (rx->len - head_len < body_len) {
+        rx->want = head_len + (size_t)body_len;
+        return 0;
+    }
+
+    const char *body = rx_window(rx, head_len, (size_t)body_len);
+    if (!body) return -1;
+
+    *out_frame = body;
+    *out_len = (size_t)body_len;
+    rx_consume(rx, head_len + (size_t)body_len);
+    return 1;
+}
+
+/* Plockar ut nästa kompletta meddelande ur mottagningsbufferten: en rad
+   (utan '\n') eller innehållet i en binär ram. Returnerar 1 om ett finns,
+   0 om mer data behövs och -1 vid minnesbrist eller trasig ram.
+   *out_frame pekar in i bufferten och gäller fram till nästa rx-anrop. */
+static int rx_next_frame(mpapi *api, FrameKind *out_kind, const char **out_frame, size_t *out_len) {
+    RecvBuffer *rx = &api->rx;
+
+    /* Typen avgörs av första byte; en påbörjad rad har alltid scanned > 0 */
+    unsigned char type = rx->scanned == 0 && rx->len > 0 ? rx_byte(rx, 0) : 0;
+    if (type == MPAPI_FRAME_GAME || type == MPAPI_FRAME_JSON) {
+        int r = rx_next_binary(rx, out_frame, out_len);
+        if (r > 0) {
+            *out_kind = type == MPAPI_FRAME_GAME ? FRAME_GAME : FRAME_LINE;
+            atomic_fetch_add_explicit(&rx->frames, 1, memory_order_relaxed);
+        }
+        return r;
+    }
+
+    while (rx->scanned < rx->len) {
+        size_t pos = rx->head + rx->scanned;
+        if (pos >= rx->cap) pos -= rx->cap;
+
+        /* Sök till slutet av det olästa området eller till buffertens slut */
+        size_t span = rx->len - rx->scanned;
+        if (pos + span > rx->cap) span = rx->cap - pos;
+
+        const char *nl = (const char *)memchr(rx->data + pos, '\n', span);
+        if (!nl) {
+            rx->scanned += span;
+            continue;
+        }
+
+        size_t frame_len = rx->scanned + (size_t)(nl - (rx->data + pos));
+
+        const char *frame = rx_window(rx, 0, frame_len);
+        if (!frame) return -1;
+
+        *out_kind = FRAME_LINE;
+        *out_frame = frame;
+        *out_len = frame_len;
+        atomic_fetch_add_explicit(&rx->frames, 1, memory_order_relaxed);
+
+        rx_consume(rx, frame_len + 1);
+        return 1;
+    }
+
+    return 0;
+}
+
+static const char *scan_ws(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+    return p;
+}
+
+/* p pekar på '"'. Returnerar pekaren efter avslutande '"' eller NULL.
+   *escaped sätts om strängen innehåller escape‑sekvenser. */
+static const char *scan_string(const char *p, const char *end, int *escaped) {
+    const char *start = ++p;
+    while (p < end) {
+        const char *q = (const char *)memchr(p, '"', (size_t)(end - p));
+        if (!q) return NULL;
+
+        /* Citattecknet är escapat om det föregås av ett udda antal '\' */
+        const char *b = q;
+        while (b > start && b[-1] == '\\') b--;
+        if (((q - b) & 1) == 0) {
+            if (escaped && memchr(start, '\\', (size_t)(q - start))) *escaped = 1;
+            return q + 1;
+        }
+
+        p = q + 1;
+    }
+    return NULL;
+}
+
+/* Hoppar över ett godtyckligt JSON‑värde utan att tolka det. */
+static const char *scan_value(const char *p, const char *end) {
+    if (p >= end) return NULL;
+
+    if (*p == '"') return scan_string(p, end, NULL);
+
+    if (*p == '{' || *p == '[') {
+        int depth = 0;
+        while (p < end) {
+            char c = *p;
+            if (c == '"') {
+                p = scan_string(p, end, NULL);
+                if (!p) return NULL;
+                continue;
+            }
+            if (c == '{' || c == '[') {
+                depth++;
+            } else if (c == '}' || c == ']') {
+                if (--depth == 0) return p + 1;
+            }
+            p++;
+        }
+        return NULL;
+    }
+
+    const char *start = p;
+    while (p < end && *p != ',' && *p != '}' && *p != ']' &&
+           *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+        p++;
+    }
+    return p == start ? NULL : p;
+}
+
+/* Tolkar ett heltal mellan value och end. Bara heltal räknas, precis som
+   json_is_integer; annat ger *out = 0. Returnerar -1 om talet kan vara för
+   stort, så att jansson får avgöra. */
+static int scan_integer(const char *value, const char *end, int64_t *out) {
+    const char *d = value;
+    int neg = 0;
+    uint64_t v = 0;
+    if (*d == '-') {
+        neg = 1;
+        d++;
+    }
+    *out = 0;
+    if (d < end) {
+        const char *digits = d;
+        while (d < end && *d >= '0' && *d <= '9' && v < (UINT64_MAX / 10)) {
+            v = v * 10 + (uint64_t)(*d - '0');
+            d++;
+        }
+        if (d == end && d - digits <= 18) {
+            *out = neg ? -(int64_t)v : (int64_t)v;
+        } else if (d - digits > 18) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int scan_key_is(const char *key, size_t len, const char *name) {
+    return strlen(name) == len && memcmp(key, name, len) == 0;
+}
+
+/* Snabb förgranskning av ett meddelande på översta nivån: plockar ut cmd,
+   messageId, clientId och var data ligger utan att bygga något träd.
+   Returnerar 0 vid framgång och -1 om raden måste tolkas fullt ut. */
+static int scan_message(const char *buf, size_t len, MessageFields *out) {
+    const char *p = buf;
+    const char *end = buf + len;
+
+    memset(out, 0, sizeof(MessageFields));
+    out->handle = -1;
+
+    p = scan_ws(p, end);
+    if (p >= end || *p != '{') return -1;
+    p = scan_ws(p + 1, end);
+    if (p < end && *p == '}') {
+        p++;
+    } else {
+        for (;;) {
+            if (p >= end || *p != '"') return -1;
+
+            int key_escaped = 0;
+            const char *key = p + 1;
+            p = scan_string(p, end, &key_escaped);
+            if (!p || key_escaped) return -1;
+            size_t key_len = (size_t)(p - 1 - key);
+
+            p = scan_ws(p, end);
+            if (p >= end || *p != ':') return -1;
+            p = scan_ws(p + 1, end);
+
+            const char *value = p;
+            int value_escaped = 0;
+            if (p < end && *p == '"') {
+                p = scan_string(p, end, &value_escaped);
+            } else {
+                p = scan_value(p, end);
+            }
+            if (!p) return -1;
+            size_t value_len = (size_t)(p - value);
+
+            if (scan_key_is(key, key_len, "cmd")) {
+                if (*value != '"') {
+                    out->cmd = NULL;
+                } else {
+                    if (value_escaped) return -1;
+                    out->cmd = value + 1;
+                    out->cmd_len = value_len - 2;
+                }
+            } else if (scan_key_is(key, key_len, "clientId")) {
+                if (*value != '"') {
+                    out->clientId = NULL;
+                } else {
+                    if (value_escaped) return -1;
+                    out->clientId = value + 1;
+                    out->clientId_len = value_len - 2;
+                }
+            } else if (scan_key_is(key, key_len, "messageId")) {
+                if (scan_integer(value, p, &out->messageId) != 0) return -1;
+            } else if (scan_key_is(key, key_len, "requestId")) {
+                if (scan_integer(value, p, &out->requestId) != 0) return -1;
+            } else if (scan_key_is(key, key_len, "handle")) {
+                if (scan_integer(value, p, &out->handle) != 0) return -1;
+            } else if (scan_key_is(key, key_len, "data")) {
+                out->data = value;
+                out->data_len = value_len;
+            }
+
+            p = scan_ws(p, end);
+            if (p >= end) return -1;
+            if (*p == ',') {
+                p = scan_ws(p + 1, end);
+                continue;
+            }
+            if (*p != '}') return -1;
+            p++;
+            break;
+        }
+    }
+
+    p = scan_ws(p, end);
+    return p == end ? 0 : -1;
+}
+
+/* Fullständig tolkning, används när förgranskningen inte räcker till. */
+static json_t *parse_message(const char *line, size_t len, MessageFields *out) {
+    json_error_t jerr;
+    json_t *root = json_loadb(line, len, 0, &jerr);
+    if (!root || !json_is_object(root)) {
+        if (root) json_decref(root);
+        return NULL;
+    }
+
+    memset(out, 0, sizeof(MessageFields));
+    out->handle = -1;
+
+    json_t *cmd_val = json_object_get(root, "cmd");
+    if (json_is_string(cmd_val)) {
+        out->cmd = json_string_value(cmd_val);
+        out->cmd_len = json_string_length(cmd_val);
+    }
+
+    json_t *mid_val = json_object_get(root, "messageId");
+    if (json_is_integer(mid_val)) {
+        out->messageId = json_integer_value(mid_val);
+    }
+
+    json_t *rid_val = json_object_get(root, "requestId");
+    if (json_is_integer(rid_val)) {
+        out->requestId = json_integer_value(rid_val);
+    }
+
+    json_t *cid_val = json_object_get(root, "clientId");
+    if (json_is_string(cid_val)) {
+        out->clientId = json_string_value(cid_val);
+        out->clientId_len = json_string_length(cid_val);
+    }
+
+    json_t *handle_val = json_object_get(root, "handle");
+    if (json_is_integer(handle_val)) {
+        out->handle = json_integer_value(handle_val);
+    }
+
+    return root;
+}
+
+json_t *mpapi_event_data(mpapi_event *ev) {
+    if (!ev) return NULL;
+    if (ev->data) return ev->data;
+
+    if (ev->raw_data && ev->raw_data_len > 0 && ev->raw_data[0] == '{') {
+        json_error_t jerr;
+        ev->data = json_loadb_arena(ev->raw_data, ev->raw_data_len, 0, ev->arena, &jerr);
+        if (ev->data && !json_is_object(ev->data)) {
+            json_decref(ev->data);
+            ev->data = NULL;
+        }
+    }
+
+    if (!ev->data) {
+        ev->data = json_object();
+    }
+    return ev->data;
+}
+
+const char *mpapi_event_raw(const mpapi_event *ev, size_t *out_len) {
+    if (!ev) return NULL;
+    if (out_len) *out_len = ev->raw_data_len;
+    return ev->raw_data;
+}
+
+static const char *const event_names[MPAPI_EVT_COUNT] = {
+    "joined",
+    "leaved",
+    "game"
+};
+
+/* Översätter cmd till händelsetyp, -1 för kommandon som inte skickas
+   vidare till lyssnare. */
+static int classify_event(const char *cmd, size_t len) {
+    if (!cmd) return -1;
+
+    switch (len) {
+    case 4:
+        if (memcmp(cmd, "game", 4) == 0) return MPAPI_EVT_GAME;
+        break;
+    case 6:
+        if (memcmp(cmd, "joined", 6) == 0) return MPAPI_EVT_JOINED;
+        if (memcmp(cmd, "leaved", 6) == 0) return MPAPI_EVT_LEAVED;
+        break;
+    }
+    return -1;
+}
+
+/* --- Förfrågningar och svar --- */
+
+static int classify_response(const char *cmd, size_t len) {
+    if (!cmd) return -1;
+
+    switch (len) {
+    case 4:
+        if (memcmp(cmd, "host", 4) == 0) return REQ_HOST;
+        if (memcmp(cmd, "join", 4) == 0) return REQ_JOIN;
+        if (memcmp(cmd, "list", 4) == 0) return REQ_LIST;
+        break;
+    }
+    return -1;
+}
+
+/* Släpper spärren för host/join när förfrågan aldrig kom iväg. Tas under
+   lock eftersom mottagarsidan också ändrar den. */
+static void session_pending_reset(mpapi *api) {
+    pthread_mutex_lock(&api->lock);
+    api->session_pending = false;
+    pthread_mutex_unlock(&api->lock);
+}
+
+/* Registrerar förfrågan, sätter requestId och skickar. Förfrågan läggs in
+   innan den skickas eftersom svaret kan komma innan send_json_line är klar.
+   Tar över ägarskap av root. */
+static int send_request(mpapi *api, json_t *root, RequestKind kind,
+                        mpapiSessionCallback session_cb, mpapiListCallback list_cb,
+                        void *context) {
+    PendingRequest *req = (PendingRequest *)calloc(1, sizeof(PendingRequest));
+    if (!req) {
+        json_decref(root);
+        if (kind != REQ_LIST) session_pending_reset(api);
+        return MPAPI_ERR_IO;
+    }
+
+    req->kind = kind;
+    req->session_cb = session_cb;
+    req->list_cb = list_cb;
+    req->context = context;
+
+    /* req kan vara frigjord så fort låset släppts */
+    pthread_mutex_lock(&api->lock);
+    int64_t id = api->next_request_id++;
+    req->id = id;
+    PendingRequest **bucket = &api->requests[id & (MPAPI_REQ_BUCKETS - 1)];
+    req->next = *bucket;
+    *bucket = req;
+    pthread_mutex_unlock(&api->lock);
+
+    json_object_set_new(root, "requestId", json_integer(id));
+
+    int rc = send_json_line(api, root);
+    if (rc != MPAPI_OK) {
+        /* Finns den inte kvar har mottagarsidan redan avslutat den med fel */
+        pthread_mutex_lock(&api->lock);
+        PendingRequest **pp = &api->requests[id & (MPAPI_REQ_BUCKETS - 1)];
+        while (*pp && (*pp)->id != id) pp = &(*pp)->next;
+        req = *pp;
+        if (req) {
+            *pp = req->next;
+            if (kind != REQ_LIST) api->session_pending = false;
+        }
+        pthread_mutex_unlock(&api->lock);
+
+        if (!req) return MPAPI_OK;
+        free(req);
+    }
+
+    return rc;
+}
+
+/* Plockar ut förfrågan som svaret hör till. Saknar svaret requestId tas den
+   äldsta väntande förfrågan av samma slag. Anroparen håller api->lock. */
+static PendingRequest *request_take_locked(mpapi *api, int64_t id, RequestKind kind) {
+    PendingRequest **found = NULL;
+
+    if (id > 0) {
+        PendingRequest **pp = &api->requests[id & (MPAPI_REQ_BUCKETS - 1)];
+        while (*pp && (*pp)->id != id) pp = &(*pp)->next;
+        if (*pp) found = pp;
+    } else {
+        for (int i = 0; i < MPAPI_REQ_BUCKETS; ++i) {
+            for (PendingRequest **pp = &api->requests[i]; *pp; pp = &(*pp)->next) {
+                if ((*pp)->kind == kind && (!found || (*pp)->id < (*found)->id)) {
+                    found = pp;
                 }
-                acc[acc_len++] = ch;
             }
         }
     }
 
-    if (acc) {
-        free(acc);
+    if (!found) return NULL;
+
+    PendingRequest *req = *found;
+    *found = req->next;
+    req->next = NULL;
+    return req;
+}
+
+/* Avslutar förfrågan med svaret resp (NULL vid fel) och anropar dess callback. */
+static void request_complete(mpapi *api, PendingRequest *req, int status, json_t *resp) {
+    if (status == MPAPI_OK && !resp) status = MPAPI_ERR_PROTOCOL;
+
+    if (req->kind == REQ_LIST) {
+        json_t *list = NULL;
+        if (status == MPAPI_OK) {
+            list = json_object_get(json_object_get(resp, "data"), "list");
+            if (!json_is_array(list)) {
+                list = NULL;
+                status = MPAPI_ERR_PROTOCOL;
+            }
+        }
+        req->list_cb(api, status, list, req->context);
+        return;
+    }
+
+    if (status == MPAPI_OK && req->kind == REQ_JOIN) {
+        json_t* error_val = json_object_get(resp, "error");
+        if (error_val) {
+            printf("Join rejected: %s\n", json_string_value(error_val));
+            status = MPAPI_ERR_REJECTED;
+        }
+    }
+
+    if (status == MPAPI_OK) {
+        status = mpapi_parse_session_info(api, resp);
+    }
+
+    if (status == MPAPI_OK) {
+        api->session.isHost = req->kind == REQ_HOST;
+        api->last_message_id = -1;
+        peers_load(api, resp);
+        protocol_load(api, resp);
+        status = start_send_thread(api);
+    }
+
+    session_pending_reset(api);
+
+    req->session_cb(api, status, status == MPAPI_OK ? &api->session : NULL, req->context);
+}
+
+static void handle_response(mpapi *api, RequestKind kind, const MessageFields *fields,
+                            const char *line, size_t len, json_t *root) {
+    pthread_mutex_lock(&api->lock);
+    PendingRequest *req = request_take_locked(api, fields->requestId, kind);
+    pthread_mutex_unlock(&api->lock);
+
+    if (!req) {
+        if (root) json_decref(root);
+        return;
+    }
+
+    if (!root) {
+        MessageFields full;
+        root = parse_message(line, len, &full);
+    }
+
+	if(api->debug)
+		printf("RX: %.*s\n", (int)len, line);
+
+    request_complete(api, req, req->kind == kind ? MPAPI_OK : MPAPI_ERR_PROTOCOL, root);
+
+    free(req);
+    if (root) json_decref(root);
+}
+
+/* Avslutar alla väntande förfrågningar med status, t.ex. när anslutningen
+   har stängts. */
+static void requests_fail_all(mpapi *api, int status) {
+    PendingRequest *list = NULL;
+
+    pthread_mutex_lock(&api->lock);
+    for (int i = 0; i < MPAPI_REQ_BUCKETS; ++i) {
+        while (api->requests[i]) {
+            PendingRequest *req = api->requests[i];
+            api->requests[i] = req->next;
+
+            /* Sorteras på id så att callbacks kommer i den ordning anropen gjordes */
+            PendingRequest **pp = &list;
+            while (*pp && (*pp)->id < req->id) pp = &(*pp)->next;
+            req->next = *pp;
+            *pp = req;
+        }
+    }
+    pthread_mutex_unlock(&api->lock);
+
+    while (list) {
+        PendingRequest *next = list->next;
+        request_complete(api, list, status, NULL);
+        free(list);
+        list = next;
+    }
+}
+
+static void sync_wait_init(SyncWait *w) {
+    memset(w, 0, sizeof(SyncWait));
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+}
+
+static void sync_wait_destroy(SyncWait *w) {
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+}
+
+static void sync_wait_signal(SyncWait *w, int status) {
+    pthread_mutex_lock(&w->lock);
+    w->status = status;
+    w->done = 1;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void sync_session_done(mpapi *api, int status, const mpapi_session *session, void *context) {
+    (void)api;
+    (void)session;
+    sync_wait_signal((SyncWait *)context, status);
+}
+
+static void sync_list_done(mpapi *api, int status, json_t *list, void *context) {
+    (void)api;
+    SyncWait *w = (SyncWait *)context;
+    /* Svaret frigörs av mottagarsidan; referensräkningen är inte trådsäker */
+    if (list) w->list = json_deep_copy(list);
+    sync_wait_signal(w, status);
+}
+
+/* Väntar tills förfrågan är klar. Utan mottagartråd läser anroparen
+   själv från socketen tills svaret har kommit. */
+static int sync_wait(mpapi *api, SyncWait *w) {
+    if (api->threadless && !api->reactor) {
+        while (!w->done) {
+            struct pollfd pfd;
+            pfd.fd = api->sockfd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+
+            int n = poll(&pfd, 1, -1);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 || service_socket(api, 0, 0) < 0) {
+                connection_lost(api);
+            }
+        }
+        return w->status;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    while (!w->done) {
+        pthread_cond_wait(&w->cond, &w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return w->status;
+}
+
+/* Tabellen som gäller för den här omgången. Normalfallet är en enda
+   atomisk läsning; bara när tabellen har bytts ut tas låset för att flytta
+   över referensen till den nya. */
+static ListenerTable *dispatch_table_current(mpapi *api) {
+    ListenerTable *table = atomic_load_explicit(&api->listener_table, memory_order_acquire);
+    if (table != api->dispatch_table) {
+        pthread_mutex_lock(&api->lock);
+        table = atomic_load_explicit(&api->listener_table, memory_order_acquire);
+        if (table) table->refcount++;
+        listener_table_release_locked(api->dispatch_table);
+        api->dispatch_table = table;
+        pthread_mutex_unlock(&api->lock);
+    }
+    return table;
+}
+
+/* Skickar en händelse till typens lyssnare. data kommer antingen från root
+   (redan tolkat meddelande) eller som text i raw. Med arena tolkas raw i
+   den och allt släpps med en återställning efter lyssnarna. */
+static void dispatch_event(ListenerTable *table, json_arena_t *arena, int type, int64_t messageId,
+                           const char *clientId, json_t *root, const char *raw, size_t raw_len) {
+    if (!table) return;
+
+    const ListenerSnapshot *listeners = table->entries + table->offset[type];
+    int count = table->count[type];
+    if (count == 0) return;
+
+    mpapi_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = (mpapi_event_type)type;
+    ev.event = event_names[type];
+    ev.messageId = messageId;
+    ev.clientId = clientId;
+    ev.arena = arena;
+
+    if (root) {
+        json_t *data_val = json_object_get(root, "data");
+        ev.data = json_is_object(data_val) ? json_incref(data_val) : json_object();
+    } else {
+        ev.raw_data = raw;
+        ev.raw_data_len = raw_len;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        if (listeners[i].event_cb) {
+            listeners[i].event_cb(&ev, listeners[i].context);
+        } else {
+            listeners[i].cb(ev.event, ev.messageId, ev.clientId, mpapi_event_data(&ev), listeners[i].context);
+        }
+    }
+
+    if (ev.data) json_decref(ev.data);
+    if (arena) json_arena_reset(arena);
+}
+
+/* Tolkar en rad direkt ur mottagningsbufferten; raden är inte nollterminerad.
+   Raden förgranskas först och data tolkas bara om någon lyssnare ber om det. */
+static void process_line(mpapi *api, const char *line, size_t len) {
+    if (!api || !line || len == 0) return;
+
+    ListenerTable *table = dispatch_table_current(api);
+
+    MessageFields fields;
+    json_t *root = NULL;
+    if (scan_message(line, len, &fields) != 0) {
+        root = parse_message(line, len, &fields);
+        if (!root) return;
+    }
+
+    int kind = classify_response(fields.cmd, fields.cmd_len);
+    if (kind >= 0) {
+        handle_response(api, (RequestKind)kind, &fields, line, len, root);
+        return;
+    }
+
+    int type = classify_event(fields.cmd, fields.cmd_len);
+    if (type == MPAPI_EVT_GAME) {
+        /* Skickas med vid återanslutning så att servern vet vad som missats */
+        api->last_message_id = fields.messageId;
+    } else if (type == MPAPI_EVT_JOINED && fields.handle >= 0 && fields.clientId) {
+        pthread_mutex_lock(&api->lock);
+        peer_set_locked(api, fields.handle, fields.clientId, fields.clientId_len);
+        pthread_mutex_unlock(&api->lock);
+    }
+
+    if (type < 0) {
+        if (root) json_decref(root);
+        return;
+    }
+
+    char clientId[128];
+    const char *cid = NULL;
+    if (fields.clientId && fields.clientId_len < sizeof(clientId)) {
+        memcpy(clientId, fields.clientId, fields.clientId_len);
+        clientId[fields.clientId_len] = '\0';
+        cid = clientId;
+    } else if (fields.clientId) {
+        /* Får inte plats, tolka hela meddelandet så att ID:t kan läsas
+           ur den nollterminerade strängen i stället */
+        if (!root) {
+            root = parse_message(line, len, &fields);
+            if (!root) return;
+        }
+        cid = fields.clientId;
+    }
+
+    dispatch_event(table, api->arena, type, fields.messageId, cid,
+                   root, fields.data, fields.data_len);
+
+    if (root) json_decref(root);
+}
+
+/* Binär game‑ram: flaggor, messageId, avsändarens handtag och data. */
+static void process_game_frame(mpapi *api, const char *frame, size_t len) {
+    const unsigned char *p = (const unsigned char *)frame;
+    const unsigned char *end = p + len;
+    uint64_t messageId;
+    uint64_t source;
+
+    if (len == 0) return;
+    unsigned char flags = *p++;
+    p = varint_get(p, end, &messageId);
+    if (!p || messageId > INT64_MAX) return;
+    p = varint_get(p, end, &source);
+    if (!p) return;
+
+    api->last_message_id = (int64_t)messageId;
+
+    /* Kompakt kodning av data stöds inte ännu, servern skickar den inte
+       till klienter som inte bett om den */
+    if (flags & MPAPI_GAME_COMPACT) return;
+
+    if(api->debug)
+        printf("RX: [G %llu] %.*s\n", (unsigned long long)messageId, (int)(end - p), (const char *)p);
+
+    dispatch_event(dispatch_table_current(api), api->arena, MPAPI_EVT_GAME, (int64_t)messageId, peer_id(api, source),
+                   NULL, (const char *)p, (size_t)(end - p));
+}
+
+static void process_frame(mpapi *api, FrameKind kind, const char *frame, size_t len) {
+    if (kind == FRAME_GAME) {
+        process_game_frame(api, frame, len);
+    } else {
+        process_line(api, frame, len);
+    }
+}
+
+static void *recv_thread_main(void *arg) {
+    mpapi *api = (mpapi *)arg;
+
+    while (1) {
+        FrameKind kind;
+        const char *frame;
+        size_t frame_len;
+        int r;
+
+        while ((r = rx_next_frame(api, &kind, &frame, &frame_len)) > 0) {
+            process_frame(api, kind, frame, frame_len);
+        }
+        if (r < 0) break;
+
+        ssize_t n = rx_fill(api, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (connection_lost(api) && reconnect_loop(api) == MPAPI_OK) continue;
+            break;
+        }
     }
 
+    requests_fail_all(api, MPAPI_ERR_IO);
     return NULL;
 }
 
 static int start_recv_thread(mpapi *api) {
     if (!api) return MPAPI_ERR_ARGUMENT;
-    if (api->recv_thread_started) {
+    if (api->reactor && !api->reactor_registered) {
+        return reactor_add(api);
+    }
+    if (api->recv_thread_started || api->threadless) {
         return MPAPI_OK;
     }
 
@@ -827,3 +3120,524 @@ static int start_recv_thread(mpapi *api) {
     api->recv_thread_started = 1;
     return MPAPI_OK;
 }
+
+/* Läser det som finns på socketen utan att blockera och skickar hela rader
+   till lyssnarna. max_events begränsar antalet meddelanden och max_reads
+   antalet recv (<= 0 betyder obegränsat). Returnerar antal hanterade
+   meddelanden, eller -1 om anslutningen stängts eller ett fel uppstått. */
+static int service_socket(mpapi *api, int max_events, int max_reads) {
+    int handled = 0;
+    int reads = 0;
+
+    for (;;) {
+        FrameKind kind;
+        const char *frame;
+        size_t frame_len;
+        int r = 0;
+
+        while ((max_events <= 0 || handled < max_events) &&
+               (r = rx_next_frame(api, &kind, &frame, &frame_len)) > 0) {
+            process_frame(api, kind, frame, frame_len);
+            handled++;
+        }
+        if (max_events > 0 && handled >= max_events) break;
+        if (r < 0) return -1;
+        if (max_reads > 0 && reads >= max_reads) break;
+
+        ssize_t n = rx_fill(api, MSG_DONTWAIT);
+        reads++;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        if (n == 0) return -1;
+    }
+
+    return handled;
+}
+
+/* --- Reaktor --- */
+
+/* Slår upp handtaget och markerar instansen som upptagen så att
+   mpapi_destroy väntar in oss. Returnerar NULL om instansen är borta.
+   Anroparen håller reaktorns lås. */
+static mpapi *reactor_acquire_locked(mpapi_reactor *r, uint64_t handle) {
+    uint32_t idx = (uint32_t)handle;
+    uint32_t gen = (uint32_t)(handle >> 32);
+
+    if (idx >= (uint32_t)r->entry_count) return NULL;
+
+    ReactorEntry *e = &r->entries[idx];
+    if (!e->api || e->gen != gen) return NULL;
+
+    e->busy++;
+    return e->api;
+}
+
+static void reactor_release_locked(mpapi_reactor *r, uint64_t handle) {
+    ReactorEntry *e = &r->entries[(uint32_t)handle];
+    if (--e->busy == 0) {
+        pthread_cond_broadcast(&r->idle);
+    }
+}
+
+/* Registrerar instansens socket. EPOLLONESHOT gör att bara en tråd i taget
+   hanterar instansen, vilket ger ordningen per instans; socketen armeras
+   om först när varvet är klart. */
+static int reactor_add(mpapi *api) {
+    mpapi_reactor *r = api->reactor;
+
+    pthread_mutex_lock(&r->lock);
+
+    int idx;
+    if (r->free_head >= 0) {
+        idx = r->free_head;
+        r->free_head = r->entries[idx].next_free;
+    } else {
+        if (r->entry_count == r->entry_cap) {
+            int new_cap = r->entry_cap == 0 ? 64 : r->entry_cap * 2;
+            ReactorEntry *tmp = (ReactorEntry *)realloc(r->entries, sizeof(ReactorEntry) * (size_t)new_cap);
+            if (!tmp) {
+                pthread_mutex_unlock(&r->lock);
+                return MPAPI_ERR_IO;
+            }
+            memset(tmp + r->entry_cap, 0, sizeof(ReactorEntry) * (size_t)(new_cap - r->entry_cap));
+            r->entries = tmp;
+            r->entry_cap = new_cap;
+        }
+        idx = r->entry_count++;
+    }
+
+    ReactorEntry *e = &r->entries[idx];
+    e->api = api;
+    e->busy = 0;
+    api->reactor_handle = ((uint64_t)e->gen << 32) | (uint32_t)idx;
+
+    /* EPOLLOUT ger ett första varv direkt, så att det som redan hunnit
+       buffras under host/join hanteras utan att vänta på mer data */
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLONESHOT;
+    ev.data.u64 = api->reactor_handle;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, api->sockfd, &ev) != 0) {
+        e->api = NULL;
+        e->next_free = r->free_head;
+        r->free_head = idx;
+        pthread_mutex_unlock(&r->lock);
+        return MPAPI_ERR_IO;
+    }
+
+    api->reactor_registered = true;
+    pthread_mutex_unlock(&r->lock);
+    return MPAPI_OK;
+}
+
+/* Tar bort instansen och väntar tills ingen reaktortråd använder den. */
+static void reactor_remove(mpapi *api) {
+    mpapi_reactor *r = api->reactor;
+    uint32_t idx = (uint32_t)api->reactor_handle;
+
+    pthread_mutex_lock(&r->lock);
+
+    r->entries[idx].api = NULL;
+    while (r->entries[idx].busy > 0) {
+        pthread_cond_wait(&r->idle, &r->lock);
+    }
+
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, api->sockfd, NULL);
+
+    ReactorEntry *e = &r->entries[idx];
+    e->gen++;
+    e->next_free = r->free_head;
+    r->free_head = (int)idx;
+
+    api->reactor_registered = false;
+    pthread_mutex_unlock(&r->lock);
+}
+
+/* Ber reaktorn tömma instansens sändkö. Instansen läggs bara i listan en
+   gång tills den tömts. */
+static void reactor_request_flush(mpapi *api) {
+    if (atomic_exchange(&api->tx_wake, 1)) return;
+
+    mpapi_reactor *r = api->reactor;
+
+    pthread_mutex_lock(&r->lock);
+    if (r->pending_len == r->pending_cap) {
+        size_t new_cap = r->pending_cap == 0 ? 64 : r->pending_cap * 2;
+        uint64_t *tmp = (uint64_t *)realloc(r->pending, sizeof(uint64_t) * new_cap);
+        if (!tmp) {
+            /* Tas med vid nästa läsvarv i stället */
+            atomic_store(&api->tx_wake, 0);
+            pthread_mutex_unlock(&r->lock);
+            return;
+        }
+        r->pending = tmp;
+        r->pending_cap = new_cap;
+    }
+    r->pending[r->pending_len++] = api->reactor_handle;
+    pthread_mutex_unlock(&r->lock);
+
+    uint64_t one = 1;
+    ssize_t w = write(r->wakefd, &one, sizeof(one));
+    (void)w;
+}
+
+static void reactor_flush_pending(mpapi_reactor *r) {
+    uint64_t count;
+    ssize_t n = read(r->wakefd, &count, sizeof(count));
+    (void)n;
+
+    if (atomic_load(&r->stop)) {
+        /* Vi kan ha läst av avstängningen, väck de andra trådarna igen */
+        uint64_t one = 1;
+        ssize_t w = write(r->wakefd, &one, sizeof(one));
+        (void)w;
+        return;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    uint64_t *list = r->pending;
+    size_t len = r->pending_len;
+    r->pending = NULL;
+    r->pending_len = 0;
+    r->pending_cap = 0;
+    pthread_mutex_unlock(&r->lock);
+
+    for (size_t i = 0; i < len; ++i) {
+        pthread_mutex_lock(&r->lock);
+        mpapi *api = reactor_acquire_locked(r, list[i]);
+        pthread_mutex_unlock(&r->lock);
+        if (!api) continue;
+
+        atomic_store(&api->tx_wake, 0);
+        mpapi_flush(api);
+
+        pthread_mutex_lock(&r->lock);
+        reactor_release_locked(r, list[i]);
+        pthread_mutex_unlock(&r->lock);
+    }
+
+    free(list);
+}
+
+/* Ett varv för en instans: töm sändkön, läs och skicka händelser, och
+   armera socketen igen om anslutningen lever. */
+static void reactor_service(mpapi_reactor *r, uint64_t handle) {
+    pthread_mutex_lock(&r->lock);
+    mpapi *api = reactor_acquire_locked(r, handle);
+    pthread_mutex_unlock(&r->lock);
+    if (!api) return;
+
+    int rc = 0;
+    if (api->txq) {
+        atomic_store(&api->tx_wake, 0);
+        if (mpapi_flush(api) != MPAPI_OK) rc = -1;
+    }
+    if (rc == 0) {
+        rc = service_socket(api, 0, MPAPI_REACTOR_READS);
+    }
+    if (rc < 0 && connection_lost(api)) {
+        start_reconnect_thread(api);
+    }
+
+    pthread_mutex_lock(&r->lock);
+    /* En stängd anslutning lämnas oarmerad tills instansen förstörs */
+    if (rc >= 0 && r->entries[(uint32_t)handle].api == api) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.u64 = handle;
+        epoll_ctl(r->epfd, EPOLL_CTL_MOD, api->sockfd, &ev);
+    }
+    reactor_release_locked(r, handle);
+    pthread_mutex_unlock(&r->lock);
+}
+
+/* Registrerar instansens nya socket efter en återanslutning. Den gamla
+   försvann ur epoll när den stängdes. */
+static void reactor_replace_socket(mpapi *api) {
+    mpapi_reactor *r = api->reactor;
+
+    pthread_mutex_lock(&r->lock);
+    if (api->reactor_registered) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLONESHOT;
+        ev.data.u64 = api->reactor_handle;
+        epoll_ctl(r->epfd, EPOLL_CTL_ADD, api->sockfd, &ev);
+    }
+    pthread_mutex_unlock(&r->lock);
+}
+
+static void *reactor_thread_main(void *arg) {
+    mpapi_reactor *r = (mpapi_reactor *)arg;
+    struct epoll_event events[MPAPI_REACTOR_EVENTS];
+
+    while (!atomic_load(&r->stop)) {
+        int n = epoll_wait(r->epfd, events, MPAPI_REACTOR_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        for (int i = 0; i < n && !atomic_load(&r->stop); ++i) {
+            if (events[i].data.u64 == MPAPI_REACTOR_WAKE) {
+                reactor_flush_pending(r);
+            } else {
+                reactor_service(r, events[i].data.u64);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* --- Återanslutning --- */
+
+/* Anropas av mottagarsidan när anslutningen har brutits. Väntande
+   förfrågningar avslutas med fel. Returnerar true om sessionen ska
+   återupptas. */
+static bool connection_lost(mpapi *api) {
+    atomic_store(&api->link_down, 1);
+    requests_fail_all(api, MPAPI_ERR_IO);
+
+    pthread_mutex_lock(&api->lock);
+    bool resume = api->resumable && api->session.id && api->session.resumeToken[0] && !api->closing;
+    pthread_mutex_unlock(&api->lock);
+    return resume;
+}
+
+static bool is_closing(mpapi *api) {
+    pthread_mutex_lock(&api->lock);
+    bool closing = api->closing;
+    pthread_mutex_unlock(&api->lock);
+    return closing;
+}
+
+/* Väntar ms millisekunder, eller kortare om instansen håller på att
+   förstöras. Returnerar true i så fall. */
+static bool wait_closing(mpapi *api, int ms) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (long)(ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&api->lock);
+    while (!api->closing) {
+        if (pthread_cond_timedwait(&api->state_cond, &api->lock, &ts) == ETIMEDOUT) break;
+    }
+    bool closing = api->closing;
+    pthread_mutex_unlock(&api->lock);
+    return closing;
+}
+
+/* Skickar resume på den nya anslutningen och läser svaret direkt, innan
+   något annat hanteras. Servern skickar sedan de game‑meddelanden som
+   missats, följt av det som kommit medan anslutningen var borta. */
+static int resume_handshake(mpapi *api) {
+    json_t *root = json_object();
+    if (!root) return MPAPI_ERR_IO;
+
+    json_object_set_new(root, "identifier", json_string(api->identifier));
+    json_object_set_new(root, "session", json_string(api->session.id));
+    json_object_set_new(root, "cmd", json_string("resume"));
+    if (api->binary) {
+        json_object_set_new(root, "binary", json_integer(1));
+    }
+    if (api->framing == MPAPI_FRAMING_LENGTH) {
+        json_object_set_new(root, "framing", json_string("length"));
+    }
+    json_object_set_new(root, "data", json_pack("{s:s, s:I}",
+                                                "resumeToken", api->session.resumeToken,
+                                                "lastMessageId", (json_int_t)api->last_message_id));
+
+    SendBuffer buf;
+    memset(&buf, 0, sizeof(buf));
+    int rc = MPAPI_OK;
+    if (json_dump_callback(root, sendbuf_append, &buf, JSON_COMPACT) != 0 ||
+        sendbuf_append("\n", 1, &buf) != 0) {
+        rc = MPAPI_ERR_IO;
+    }
+    json_decref(root);
+
+    if (rc == MPAPI_OK) {
+		if(api->debug)
+			printf("TX: %.*s\n", (int)(buf.len - 1), buf.data);
+
+        if (send_all(api->sockfd, buf.data, buf.len) != 0) rc = MPAPI_ERR_IO;
+    }
+    free(buf.data);
+    if (rc != MPAPI_OK) return rc;
+
+    struct timeval tv;
+    memset(&tv, 0, sizeof(tv));
+    if (api->connect_timeout_ms > 0) {
+        tv.tv_sec = api->connect_timeout_ms / 1000;
+        tv.tv_usec = (api->connect_timeout_ms % 1000) * 1000;
+        setsockopt(api->sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+
+    FrameKind kind = FRAME_LINE;
+    const char *frame = NULL;
+    size_t frame_len = 0;
+    for (;;) {
+        int r = rx_next_frame(api, &kind, &frame, &frame_len);
+        if (r < 0) return MPAPI_ERR_IO;
+        if (r > 0) break;
+
+        ssize_t n = rx_fill(api, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return MPAPI_ERR_IO;
+    }
+
+    memset(&tv, 0, sizeof(tv));
+    setsockopt(api->sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    if (kind != FRAME_LINE) return MPAPI_ERR_PROTOCOL;
+
+	if(api->debug)
+		printf("RX: %.*s\n", (int)frame_len, frame);
+
+    json_error_t jerr;
+    json_t *resp = json_loadb(frame, frame_len, 0, &jerr);
+    json_t *cmd_val = json_object_get(resp, "cmd");
+    if (!json_is_string(cmd_val) || strcmp(json_string_value(cmd_val), "resume") != 0) {
+        json_decref(resp);
+        return MPAPI_ERR_PROTOCOL;
+    }
+
+    if (json_object_get(resp, "error")) {
+        json_decref(resp);
+        return MPAPI_ERR_REJECTED;
+    }
+
+    const char *token = json_string_value(json_object_get(resp, "resumeToken"));
+    if (token && strlen(token) == 36) {
+        strcpy(api->session.resumeToken, token);
+    }
+
+    /* Den nya anslutningen förhandlar protokollet på nytt; handtagen
+       behålls eftersom klienten har kvar sin plats i sessionen */
+    protocol_load(api, resp);
+
+    /* Hosten kan ha migrerats medan vi var borta */
+    const char *hostId = json_string_value(json_object_get(resp, "hostId"));
+    if (hostId && strlen(hostId) == 36) {
+        strcpy(api->session.hostId, hostId);
+    }
+
+    json_decref(resp);
+    return MPAPI_OK;
+}
+
+/* Ett försök att ansluta igen och återuppta sessionen. Anroparen äger
+   mottagarsidan. */
+static int resume_session(mpapi *api) {
+    int fd = connect_to_server(api);
+    if (fd < 0) return MPAPI_ERR_CONNECT;
+
+    /* sockfd byts under både send_lock och lock. mpapi_destroy sätter
+       closing och stänger av socketen under lock, så syns closing inte här
+       stänger destroy av den nya socketen; annars skulle mottagarsidan
+       blockera på den. */
+    pthread_mutex_lock(&api->send_lock);
+    pthread_mutex_lock(&api->lock);
+    bool closing = api->closing;
+    int old = api->sockfd;
+    if (!closing) api->sockfd = fd;
+    pthread_mutex_unlock(&api->lock);
+    pthread_mutex_unlock(&api->send_lock);
+    if (closing) {
+        close(fd);
+        return MPAPI_ERR_STATE;
+    }
+    if (old >= 0) close(old);
+
+    RecvBuffer *rx = &api->rx;
+    rx->head = 0;
+    rx->len = 0;
+    rx->scanned = 0;
+    rx->want = 0;
+
+    int rc = resume_handshake(api);
+    if (rc == MPAPI_OK && is_closing(api)) {
+        pthread_mutex_lock(&api->send_lock);
+        pthread_mutex_lock(&api->lock);
+        fd = api->sockfd;
+        api->sockfd = -1;
+        pthread_mutex_unlock(&api->lock);
+        pthread_mutex_unlock(&api->send_lock);
+        shutdown(fd, SHUT_RDWR);
+        close(fd);
+        return MPAPI_ERR_STATE;
+    }
+    if (rc != MPAPI_OK) return rc;
+
+    atomic_store(&api->link_down, 0);
+    if (api->txq) {
+        /* Det som köats under avbrottet skickas nu */
+        atomic_store(&api->txq->error, 0);
+        sem_post(&api->txq->items);
+    }
+
+    return MPAPI_OK;
+}
+
+/* Försöker återuppta sessionen med exponentiell backoff tills det lyckas,
+   servern vägrar eller försöken tar slut. */
+static int reconnect_loop(mpapi *api) {
+    unsigned int seed = (unsigned int)monotonic_ms() ^ (unsigned int)(uintptr_t)api;
+    int delay = MPAPI_RECONNECT_MIN_MS;
+
+    for (int attempt = 0;
+         api->reconnect_max_attempts == 0 || attempt < api->reconnect_max_attempts;
+         ++attempt) {
+        /* Första försöket görs direkt, sedan slumpas väntan mellan delay/2
+           och delay så att många klienter inte återansluter i takt */
+        int wait = attempt == 0 ? 0 : delay / 2 + (int)(rand_r(&seed) % (unsigned int)(delay / 2 + 1));
+        if (wait_closing(api, wait)) return MPAPI_ERR_STATE;
+        if (attempt > 0) {
+            delay = delay * 2 > MPAPI_RECONNECT_MAX_MS ? MPAPI_RECONNECT_MAX_MS : delay * 2;
+        }
+
+        int rc = resume_session(api);
+        if (rc == MPAPI_OK) return MPAPI_OK;
+        if (rc == MPAPI_ERR_REJECTED || rc == MPAPI_ERR_PROTOCOL) return rc;
+    }
+
+    return MPAPI_ERR_CONNECT;
+}
+
+/* Återanslutning för instanser på en reaktor; reaktortrådarna ska inte
+   blockeras av backoff och connect. */
+static void *reconnect_thread_main(void *arg) {
+    mpapi *api = (mpapi *)arg;
+
+    if (reconnect_loop(api) == MPAPI_OK) {
+        reactor_replace_socket(api);
+    }
+    return NULL;
+}
+
+static void start_reconnect_thread(mpapi *api) {
+    pthread_mutex_lock(&api->lock);
+    bool started = api->reconnect_thread_started;
+    pthread_t prev = api->reconnect_thread;
+    api->reconnect_thread_started = false;
+    pthread_mutex_unlock(&api->lock);
+
+    /* Förra återanslutningen har redan armerat socketen och är på väg ut */
+    if (started) pthread_join(prev, NULL);
+
+    pthread_mutex_lock(&api->lock);
+    if (!api->closing && pthread_create(&api->reconnect_thread, NULL, reconnect_thread_main, api) == 0) {
+        api->reconnect_thread_started = true;
+    }
+    pthread_mutex_unlock(&api->lock);
+}
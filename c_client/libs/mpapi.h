@@ -11,6 +11,9 @@ extern "C" {
 
 typedef struct mpapi mpapi;
 
+/* Delad händelseloop (epoll + trådpool) som kan driva många instanser. */
+typedef struct mpapi_reactor mpapi_reactor;
+
 typedef struct mpapi_session {
     char* id;
 	char clientId[37];
@@ -22,6 +25,7 @@ typedef struct mpapi_session {
 	bool isPrivate;
 	json_t* clients;
 	json_t* payload;
+	char resumeToken[37];   /* tom om servern inte erbjuder återupptagning */
 
 } mpapi_session;
 
@@ -34,6 +38,87 @@ typedef void (*mpapiListener)(
     void *context         /* godtycklig pekare som skickas vidare */
 );
 
+/* Händelsetyper, används som index i lyssnartabellen. */
+typedef enum mpapi_event_type {
+    MPAPI_EVT_JOINED = 0,
+    MPAPI_EVT_LEAVED = 1,
+    MPAPI_EVT_GAME = 2,
+    MPAPI_EVT_COUNT
+} mpapi_event_type;
+
+/* Händelse som skickas till en mpapiEventListener. Data tolkas först när
+   lyssnaren frågar efter den via mpapi_event_data. Allt i strukturen gäller
+   bara under anropet. */
+typedef struct mpapi_event {
+    mpapi_event_type type;
+    const char *event;      /* "joined", "leaved", "game" */
+    int64_t messageId;      /* sekventiellt meddelande‑ID (från host) */
+    const char *clientId;   /* avsändarens klient‑ID (eller NULL) */
+
+    /* Interna fält, läs via mpapi_event_data / mpapi_event_raw */
+    const char *raw_data;
+    size_t raw_data_len;
+    json_t *data;
+    json_arena_t *arena;
+} mpapi_event;
+
+/* Callback‑typ för händelser med lat tolkning av data. */
+typedef void (*mpapiEventListener)(
+    mpapi_event *ev,
+    void *context           /* godtycklig pekare som skickas vidare */
+);
+
+/* Callback när mpapi_host_async / mpapi_join_async är klar. status är
+   MPAPI_OK, MPAPI_ERR_REJECTED eller annan felkod. session pekar på
+   instansens sessionsinformation (NULL vid fel) och gäller bara under
+   anropet. */
+typedef void (*mpapiSessionCallback)(
+    mpapi *api,
+    int status,
+    const mpapi_session *session,
+    void *context           /* godtycklig pekare som skickas vidare */
+);
+
+/* Callback när mpapi_list_async är klar. list är en lånad array med
+   sessioner (NULL vid fel); använd json_incref för att behålla den. */
+typedef void (*mpapiListCallback)(
+    mpapi *api,
+    int status,
+    json_t *list,
+    void *context           /* godtycklig pekare som skickas vidare */
+);
+
+/* Urval för mpapi_list. Nollställd betyder alla publika sessioner. */
+typedef struct mpapi_list_filter {
+    size_t offset;          /* hoppa över så många träffar, för sidvisning */
+    size_t limit;           /* högst så många sessioner, 0 = alla */
+    bool notFull;           /* bara sessioner där det finns plats */
+    const char *namePrefix; /* bara sessioner vars namn börjar så, NULL = alla */
+} mpapi_list_filter;
+
+/* Räknare för prestandamätning, se mpapi_getStats. */
+typedef struct mpapi_stats {
+	uint64_t rx_frames;          /* mottagna rader */
+	uint64_t rx_frames_spilled;  /* rader som låg över ringbuffertens slut och kopierades */
+	uint64_t tx_queue_depth;     /* meddelanden som väntar i sändkön */
+	uint64_t tx_dropped;         /* meddelanden som slängts eller avvisats för att kön var full */
+	uint64_t tx_batches;         /* writev-anrop från sändkön */
+	uint64_t tx_frames;          /* meddelanden skickade via sändkön */
+} mpapi_stats;
+
+/* Vad mpapi_game gör när sändkön är full. */
+typedef enum mpapi_send_policy {
+	MPAPI_SEND_BLOCK = 0,        /* vänta tills det finns plats */
+	MPAPI_SEND_DROP_OLDEST = 1,  /* släng det äldsta köade meddelandet */
+	MPAPI_SEND_FAIL = 2          /* returnera MPAPI_ERR_FULL */
+} mpapi_send_policy;
+
+/* Hur JSON‑meddelanden avgränsas på anslutningen, se mpapi_set_framing. */
+typedef enum mpapi_framing {
+	MPAPI_FRAMING_NEWLINE = 0,   /* en rad per meddelande */
+	MPAPI_FRAMING_LENGTH = 1     /* längdprefix, ingen sökning efter radslut */
+} mpapi_framing;
+
 /* Returkoder */
 enum {
     MPAPI_OK = 0,
@@ -42,7 +127,8 @@ enum {
     MPAPI_ERR_CONNECT = 3,
     MPAPI_ERR_PROTOCOL = 4,
     MPAPI_ERR_IO = 5,
-    MPAPI_ERR_REJECTED = 6  /* t.ex. ogiltigt sessions‑ID vid join */
+    MPAPI_ERR_REJECTED = 6, /* t.ex. ogiltigt sessions‑ID vid join */
+    MPAPI_ERR_FULL = 7      /* sändkön är full (MPAPI_SEND_FAIL) */
 };
 
 /* Skapar en ny API‑instans. Returnerar NULL vid fel. */
@@ -52,13 +138,97 @@ void mpapi_debug(mpapi *api, bool enable);
 
 void mpapi_getSessionInfo(mpapi* api, mpapi_session* out_session);
 
+/* Kopierar instansens räknare till out_stats. */
+void mpapi_getStats(mpapi* api, mpapi_stats* out_stats);
+
+/* Tidsgräns i millisekunder för att ansluta till servern, från
+   uppslagningen tills en av serverns adresser svarat (standard 10000).
+   0 betyder ingen gräns. Gäller från nästa anslutningsförsök. */
+int mpapi_set_connect_timeout(mpapi *api, int timeout_ms);
+
+/* Automatisk återanslutning. När anslutningen bryts försöker instansen
+   ansluta igen med exponentiell backoff och återuppta sessionen med den
+   resumeToken servern gav vid host/join; servern skickar då de
+   game‑meddelanden som missats. max_attempts 0 betyder obegränsat antal
+   försök. Under avbrottet returnerar mpapi_game MPAPI_ERR_IO, medan
+   meddelanden i sändkön ligger kvar och skickas efteråt. Väntande
+   förfrågningar avslutas med MPAPI_ERR_IO. Måste sättas före
+   mpapi_host/mpapi_join. */
+int mpapi_set_reconnect(mpapi *api, bool enable, int max_attempts);
+
+/* Binärt protokoll för game‑meddelanden (på som standard). Vid host/join
+   ber instansen om binära ramar; går servern med på det skickas
+   game‑meddelanden med numeriska handtag i stället för identifier, session
+   och clientId. Äldre servrar svarar utan och då används text som förut.
+   Måste sättas före mpapi_host/mpapi_join. */
+int mpapi_set_binary(mpapi *api, bool enable);
+
+/* Tolkar data i händelser i en arena som återställs efter varje händelse,
+   i stället för att allokera och släppa varje värde för sig (av som
+   standard). Datan är skrivskyddad och gäller bara under anropet. Den får
+   inte ändras, inte heller i mpapiListener som får en json_t * utan const:
+   json_object_set* och json_object_del skulle släppa arenaminne med free.
+   json_incref behåller den inte, så använd json_deep_copy för det som ska
+   sparas eller ändras. Svar på förfrågningar påverkas inte. Måste sättas
+   före mpapi_host/mpapi_join. */
+int mpapi_set_arena(mpapi *api, bool enable);
+
+/* Ber servern om längdprefixerade JSON‑meddelanden vid host/join. Båda
+   sidor läser då exakt storlek i stället för att leta efter radslut, och
+   mpapi_game_raw tillåter radbrytningar i texten. Äldre servrar svarar
+   utan och då används rader som förut. Måste sättas före
+   mpapi_host/mpapi_join. */
+int mpapi_set_framing(mpapi *api, mpapi_framing framing);
+
+/* Gör ett försök att ansluta igen och återuppta sessionen, för trådlöst
+   läge efter att mpapi_poll returnerat −1. Blockerar under försöket.
+   Socketen byts ut, så mpapi_fd måste läsas om efteråt. Returnerar
+   MPAPI_ERR_REJECTED om servern inte längre har sessionen. */
+int mpapi_reconnect(mpapi *api);
+
+/* Trådlöst läge: ingen mottagar‑ eller skrivtråd startas, i stället driver
+   anroparen instansen med mpapi_poll från sin egen händelseloop och alla
+   callbacks körs på anroparens tråd. Måste sättas före mpapi_host/mpapi_join. */
+int mpapi_set_threadless(mpapi *api, bool enable);
+
+/* Returnerar anslutningens socket för epoll/poll, eller −1 om instansen
+   inte är ansluten. Används bara för att vänta på läsbarhet. */
+int mpapi_fd(mpapi *api);
+
+/* Läser det som finns på socketen utan att blockera, delar upp det i
+   meddelanden och skickar dem till lyssnarna på anroparens tråd. Tömmer
+   också sändkön om en sådan är aktiverad. Högst max_events meddelanden
+   hanteras per anrop (<= 0 betyder obegränsat); returneras max_events kan
+   fler meddelanden redan ligga buffrade. Returnerar antal hanterade
+   meddelanden, eller −1 om anslutningen stängts eller ett fel uppstått. */
+int mpapi_poll(mpapi *api, int max_events);
+
+/* Skapar en reaktor med threads trådar (<= 0 betyder en per processorkärna).
+   Returnerar NULL vid fel. */
+mpapi_reactor *mpapi_reactor_create(int threads);
+
+/* Stoppar reaktorns trådar och frigör den. Alla instanser som skapats med
+   mpapi_create_on måste ha förstörts först. */
+void mpapi_reactor_destroy(mpapi_reactor *reactor);
+
+/* Som mpapi_create, men instansen får inga egna trådar. Efter mpapi_host /
+   mpapi_join läses socketen av reaktorns trådar och callbacks körs där.
+   Callbacks för en och samma instans körs aldrig samtidigt och alltid i
+   den ordning meddelandena kom. mpapi_destroy får inte anropas från en
+   callback för samma instans. Returnerar NULL vid fel. */
+mpapi *mpapi_create_on(mpapi_reactor *reactor,
+                       const char *server_host,
+                       uint16_t server_port,
+                       const char *identifier);
+
 /* Stänger ner anslutning, stoppar mottagartråd och frigör minne. */
 void mpapi_destroy(mpapi *api);
 
 /* Hostar en ny session. Blockerar tills svar erhållits eller fel uppstår.
    out_session / out_clientId pekar på nyallokerade strängar (malloc) som
    anroparen ansvarar för att free:a. out_data (om ej NULL) får ett json_t*
-   med extra data från servern (anroparen ska json_decref när klart). */
+   med extra data från servern (anroparen ska json_decref när klart).
+   De blockerande anropen får inte göras från en callback. */
 int mpapi_host(mpapi *api,
 				json_t *data,
                 char **out_session,
@@ -67,11 +237,22 @@ int mpapi_host(mpapi *api,
 
 /*
    Hämtar en lista över tillgängliga publika sessioner.
+   filter väljer ut en del av listan (NULL = alla), se mpapi_list_filter.
    Returnerar MPAPI_OK vid framgång, annan felkod vid fel.
    Anroparen ansvarar för att json_decref:a out_list när klar. */
 int mpapi_list(mpapi *api,
+                  const mpapi_list_filter *filter,
                   json_t **out_list);
 
+/* Asynkrona varianter av mpapi_host, mpapi_list och mpapi_join. Anropen
+   skickar förfrågan och returnerar direkt; cb anropas från mottagarsidan
+   (mottagartråden, reaktorn eller mpapi_poll) när svaret kommit, eller
+   med MPAPI_ERR_IO om anslutningen stängs innan dess. Flera förfrågningar
+   kan vara ute samtidigt. Returneras en felkod anropas inte cb. */
+int mpapi_host_async(mpapi *api, json_t *data, mpapiSessionCallback cb, void *context);
+int mpapi_list_async(mpapi *api, const mpapi_list_filter *filter, mpapiListCallback cb, void *context);
+int mpapi_join_async(mpapi *api, const char *sessionId, json_t *data, mpapiSessionCallback cb, void *context);
+
 /* Går med i befintlig session.
    sessionId: sessionskod (t.ex. "ABC123").
    data: valfri JSON‑payload med spelarinformation (kan vara NULL).
@@ -89,15 +270,60 @@ int mpapi_join(mpapi *api,
                 char **out_clientId,
                 json_t **out_data);
 
-/* Skickar ett "game"‑meddelande med godtycklig JSON‑data till sessionen. */
+/* Skickar ett "game"‑meddelande med godtycklig JSON‑data till sessionen.
+   Med sändkö aktiverad serialiseras data direkt och läggs i kön; själva
+   sändningen görs av en skrivtråd. */
 int mpapi_game(mpapi *api, json_t *data, const char* destination);
 
+/* Som mpapi_game men med färdigserialiserad JSON (ett objekt, len byte)
+   som skarvas in i meddelandet utan att tolkas eller kopieras. Texten får
+   inte innehålla radbrytningar om meddelandet skickas som en rad, dvs. när
+   varken binära ramar eller MPAPI_FRAMING_LENGTH är förhandlade. Med
+   mpapi_debug aktiverat kontrolleras att texten är giltig JSON. */
+int mpapi_game_raw(mpapi *api, const char *json, size_t len, const char *destination);
+
+/* Aktiverar asynkron sändning för mpapi_game via en begränsad kö med
+   plats för capacity meddelanden (avrundas uppåt till en tvåpotens).
+   Skrivtråden slår ihop allt som väntar till ett writev per varv.
+   Måste anropas innan mpapi_host/mpapi_join. */
+int mpapi_send_queue(mpapi *api, size_t capacity, mpapi_send_policy policy);
+
+/* Blockerar tills allt i sändkön har skickats. */
+int mpapi_flush(mpapi *api);
+
+/* Antal meddelanden som väntar i sändkön. */
+size_t mpapi_send_queue_depth(mpapi *api);
+
 /* Registrerar en lyssnare för inkommande events.
    Returnerar ett positivt listener‑ID, eller −1 vid fel. */
 int mpapi_listen(mpapi *api,
                   mpapiListener cb,
                   void *context);
 
+/* Som mpapi_listen, men data tolkas bara om lyssnaren anropar
+   mpapi_event_data. Returnerar ett positivt listener‑ID, eller −1 vid fel. */
+int mpapi_listen_lazy(mpapi *api,
+                  mpapiEventListener cb,
+                  void *context);
+
+/* Registrerar en lyssnare för en enda händelsetyp. Ett game‑meddelande
+   når bara lyssnare registrerade för MPAPI_EVT_GAME (samt de som lyssnar på
+   allt via mpapi_listen/mpapi_listen_lazy).
+   Returnerar ett positivt listener‑ID, eller −1 vid fel. */
+int mpapi_listen_event(mpapi *api,
+                  mpapi_event_type type,
+                  mpapiEventListener cb,
+                  void *context);
+
+/* Tolkar händelsens data vid första anropet och returnerar den (alltid ett
+   objekt). Referensen är lånad och gäller bara under callbacken; använd
+   json_incref för att behålla den. */
+json_t *mpapi_event_data(mpapi_event *ev);
+
+/* Returnerar data som rå JSON‑text utan tolkning (ej nollterminerad), eller
+   NULL om den inte finns tillgänglig. */
+const char *mpapi_event_raw(const mpapi_event *ev, size_t *out_len);
+
 /* Avregistrerar lyssnare. Listener‑ID är värdet från mpapi_listen. */
 void mpapi_unlisten(mpapi *api, int listener_id);
 
@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "jansson/jansson.h"
+#include "relay.h"
+
+static relay *g_relay = NULL;
+
+static void on_signal(int sig) {
+    (void)sig;
+    relay_stop(g_relay);
+}
+
+static void usage(const char *name) {
+    printf("Användning: %s [flaggor]\n", name);
+    printf("  -p, --port PORT       port att lyssna på (9001)\n");
+    printf("  -b, --bind ADRESS     adress att lyssna på (alla)\n");
+    printf("  -t, --threads N       arbetstrådar, 0 = en per kärna (0)\n");
+    printf("  -g, --grace MS        hur länge en tappad klient kan återuppta (30000)\n");
+    printf("  -r, --replay N        game-meddelanden per session som sparas (1024)\n");
+    printf("  -a, --alloc-pools     ta JSON-värden ur trådlokala pooler i stället för malloc\n");
+    printf("  -v, --verbose         skriv ut anslutningar och sessioner\n");
+}
+
+static void print_alloc_stats(void) {
+    static const char *const names[JSON_ALLOC_TYPES] = {
+        "object", "array", "string", "integer", "real", "pair", "other"
+    };
+    json_alloc_stats_t st;
+    json_get_alloc_stats(&st);
+    printf("JSON-allokeringar (varav ur pool):\n");
+    for (int i = 0; i < JSON_ALLOC_TYPES; ++i) {
+        printf("  %-8s %zu (%zu)\n", names[i], st.count[i], st.pooled[i]);
+    }
+}
+
+int main(int argc, char **argv) {
+    relay_options opt;
+    relay_default_options(&opt);
+
+    static const struct option long_options[] = {
+        { "port", required_argument, NULL, 'p' },
+        { "bind", required_argument, NULL, 'b' },
+        { "threads", required_argument, NULL, 't' },
+        { "grace", required_argument, NULL, 'g' },
+        { "replay", required_argument, NULL, 'r' },
+        { "alloc-pools", no_argument, NULL, 'a' },
+        { "verbose", no_argument, NULL, 'v' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    bool pools = false;
+    int ch;
+    while ((ch = getopt_long(argc, argv, "p:b:t:g:r:avh", long_options, NULL)) != -1) {
+        switch (ch) {
+        case 'p': opt.port = (uint16_t)atoi(optarg); break;
+        case 'b': opt.bind = optarg; break;
+        case 't': opt.threads = atoi(optarg); break;
+        case 'g': opt.resume_grace_ms = atoi(optarg); break;
+        case 'r': opt.replay_limit = atoi(optarg); break;
+        case 'a':
+            json_set_alloc_pools(1);
+            pools = true;
+            break;
+        case 'v': opt.verbose = true; break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    g_relay = relay_create(&opt);
+    if (!g_relay) {
+        fprintf(stderr, "Kunde inte starta relay på port %u\n", opt.port);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    printf("mpapi relay listening on port: %u\n", opt.port);
+    fflush(stdout);
+
+    int rc = relay_run(g_relay);
+    relay_destroy(g_relay);
+    if (opt.verbose && pools) print_alloc_stats();
+    return rc == RELAY_OK ? 0 : 1;
+}
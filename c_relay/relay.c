@@ -0,0 +1,2372 @@
+#define _GNU_SOURCE
+#include "relay.h"
+#include "jansson/jansson.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <math.h>
+#include <stdatomic.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <uuid/uuid.h>
+
+/*
+ * Upplägg
+ *
+ * Varje arbetstråd har en egen epoll och en egen lyssnande socket (SO_REUSEPORT),
+ * så kärnan fördelar nya anslutningar mellan trådarna.
+ *
+ * Sessionerna är fördelade på trådarna. Ett sessions‑id väljs så att dess hash
+ * pekar ut tråden som skapade sessionen, och den tråden äger sedan sessionen,
+ * dess klienter och deras anslutningar. Återupptagningsnycklar väljs på samma
+ * sätt. Allt som rör en session sker därför på en och samma tråd, utan lås.
+ *
+ * När en klient gör join eller resume mot en session på en annan tråd lämnas
+ * anslutningen över till den tråden via dess inkorg. Meddelandet ligger kvar
+ * i mottagningsbufferten och läses om där. En klient utan session flyttas på
+ * samma sätt av andra kommandon mot en annan tråds session; för en klient i
+ * en session här finns de andra trådarnas sessioner inte. Bara listan över
+ * sessioner för list delas mellan trådarna och skyddas av relay->directory_lock.
+ *
+ * Client är klienten i protokollet (clientId, session, handtag) och Conn är
+ * TCP‑anslutningen. En klient med resumeToken finns kvar utan anslutning en
+ * stund efter att den tappats och får en ny Conn när den återansluter.
+ */
+
+#define RELAY_RX_INITIAL_CAP  (16 * 1024)
+#define RELAY_RX_KEEP_CAP     (256 * 1024)
+#define RELAY_RX_MIN_READ     (4 * 1024)
+#define RELAY_TX_KEEP_CAP     (256 * 1024)
+#define RELAY_TX_MAX          (64 * 1024 * 1024)  /* osänt innan klienten kopplas bort */
+#define RELAY_MAX_FRAME       (16 * 1024 * 1024)
+
+/* Binära ramar, se backend/mpapiServer.js */
+#define RELAY_FRAME_GAME      'G'
+#define RELAY_FRAME_JSON      'J'
+#define RELAY_GAME_DIRECTED   0x01
+#define RELAY_GAME_COMPACT    0x02  /* reserverad för kompakt kodning av data */
+#define RELAY_BIN_HEAD_MAX    32
+
+#define RELAY_EVENTS          64
+#define RELAY_SWEEP_MS        1000
+#define RELAY_NAME_MAX        64    /* tecken, inte byte */
+#define RELAY_MAP_INITIAL     64
+#define RELAY_SCAN_DEPTH      1024  /* nästling som snabbvägen klarar */
+
+typedef struct Worker Worker;
+typedef struct Conn Conn;
+typedef struct Client Client;
+typedef struct Session Session;
+typedef struct Listing Listing;
+
+/* Enkel hashtabell med strängnycklar. Nyckeln ägs av värdet. */
+typedef struct MapNode {
+    const char *key;
+    void *value;
+    struct MapNode *next;
+} MapNode;
+
+typedef struct Map {
+    MapNode **buckets;
+    size_t mask;
+    size_t count;
+} Map;
+
+/* Meddelande som hålls kvar åt en frånkopplad klient, som JSON‑text */
+typedef struct HeldMessage {
+    struct HeldMessage *next;
+    size_t len;
+    char text[];
+} HeldMessage;
+
+/* Ett game‑meddelande. Textformen och den binära ramen byggs först när någon
+   mottagare behöver dem, och högst en gång. Sparas i sessionens replay‑ring. */
+typedef struct GameEntry {
+    int64_t messageId;
+    char *destination;      /* NULL = till alla */
+    char clientId[37];
+    int handle;
+    char *data;             /* data som JSON‑text, precis som avsändaren skrev den */
+    size_t data_len;
+    char *serialized;
+    size_t serialized_len;
+    unsigned char *frame;
+    size_t frame_len;
+} GameEntry;
+
+struct Conn {
+    int fd;
+    Worker *worker;
+    Conn *prev, *next;      /* ägartrådens lista, eller inkorgen under överlämning */
+
+    char *rx;
+    size_t rx_len;
+    size_t rx_cap;
+    size_t rx_scan;         /* så långt en påbörjad rad redan sökts igenom */
+    size_t rx_need;         /* storlek på påbörjad ram, 0 om den inte är känd */
+
+    char *tx;
+    size_t tx_off;
+    size_t tx_len;
+    size_t tx_cap;
+    bool tx_armed;          /* EPOLLOUT är påslaget */
+    bool dead;
+
+    Client *client;
+    Worker *move_to;        /* ska lämnas över till en annan tråd */
+};
+
+struct Client {
+    char clientId[37];
+    char resumeToken[37];   /* tom om klienten inte kan återuppta */
+    int64_t resume_from;    /* sessionens messageId när nyckeln gavs ut */
+    Conn *conn;             /* NULL medan klienten är frånkopplad */
+    Session *session;
+    int handle;             /* -1 utanför session */
+    bool binary;
+    bool length_framing;
+
+    bool detached;
+    int64_t detached_at;    /* sessionens messageId vid frånkopplingen */
+    int64_t expires_ms;
+    HeldMessage *held_head, *held_tail;
+    size_t held_count;
+    bool held_overflow;
+    Client *detached_prev, *detached_next;
+};
+
+struct Session {
+    char id[7];
+    char *identifier;
+    char *name;
+    int64_t messageId;
+    bool isPrivate;
+    bool hostMigration;
+    double maxClients;
+    json_t *payload;        /* NULL om hosten inte skickat någon */
+    Client *host;
+    Client **clients;
+    size_t count;
+    size_t cap;
+    int nextHandle;
+    GameEntry **replay;     /* opt.replay_limit platser, bara medan någon kan återuppta */
+    Listing *listing;
+    Session *prev, *next;   /* i den ordning sessionerna skapades */
+};
+
+/* Publika sessioner med samma identifier, i den ordning de blev publika */
+typedef struct ListIndex {
+    char *identifier;
+    Listing *first, *last;
+} ListIndex;
+
+/* Det list visar om en session. Delas mellan trådarna under
+   relay->directory_lock, men ändras bara av tråden som äger sessionen. */
+struct Listing {
+    ListIndex *index;       /* NULL medan sessionen är privat */
+    char *entry;            /* {"id","name","clients"} som JSON‑text */
+    size_t entry_len;
+    char *name;             /* kopia för namePrefix */
+    size_t count;
+    double maxClients;
+    Listing *prev, *next;   /* i indexet */
+};
+
+struct Worker {
+    relay *r;
+    int index;
+    pthread_t thread;
+    bool thread_started;
+    int epfd;
+    int listen_fd;
+    int wake_fd;
+    Conn *conns;
+
+    /* Trådens del av sessionerna. Rörs bara av tråden själv. */
+    Map sessions;
+    Session *first_session, *last_session;
+    Map tokens;
+    Client *detached;
+
+    pthread_mutex_t inbox_lock;
+    Conn *inbox;            /* överlämnade anslutningar, länkade med next, nyast först */
+};
+
+struct relay {
+    relay_options opt;
+    int threads;
+    Worker *workers;
+    atomic_int stop;
+
+    pthread_mutex_t directory_lock;
+    Map directory;          /* identifier -> ListIndex */
+};
+
+static void send_game(Worker *w, Client *c, GameEntry *e);
+
+/* --- Hjälpfunktioner --- */
+
+static int64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void new_uuid(char out[37]) {
+    uuid_t id;
+    uuid_generate_random(id);
+    uuid_unparse_lower(id, out);
+}
+
+static size_t varint_put(unsigned char *p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (unsigned char)v;
+    return n;
+}
+
+/* Som readVarint i servern: högst fem byte. Returnerar antal byte, 0 om
+   varinten inte är komplett och -1 om den är för lång. */
+static int varint_get(const unsigned char *p, size_t len, uint64_t *out) {
+    uint64_t v = 0;
+    for (int i = 0; i < 5; ++i) {
+        if ((size_t)i >= len) return 0;
+        v |= (uint64_t)(p[i] & 0x7f) << (7 * i);
+        if (!(p[i] & 0x80)) {
+            *out = v;
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+/* JSON‑tal som i JavaScript: heltal skrivs utan decimaler */
+static json_t *json_from_number(double v) {
+    if (v > -9007199254740992.0 && v < 9007199254740992.0 && v == (double)(json_int_t)v)
+        return json_integer((json_int_t)v);
+    return json_real(v);
+}
+
+/* Sant för värden som räknas som sanna i JavaScript */
+static bool json_truthy(const json_t *v) {
+    if (!v || json_is_null(v) || json_is_false(v)) return false;
+    if (json_is_string(v)) return json_string_length(v) > 0;
+    if (json_is_number(v)) {
+        double d = json_number_value(v);
+        return d != 0 && d == d;
+    }
+    return true;
+}
+
+static void set_optional(json_t *obj, const char *key, json_t *value) {
+    if (value) json_object_set_new(obj, key, value);
+}
+
+/* Lägger till n byte sist i en växande buffert. */
+static int text_append(char **buf, size_t *len, size_t *cap, const char *p, size_t n) {
+    if (*len + n > *cap) {
+        size_t c = *cap ? *cap : 256;
+        while (c < *len + n) c *= 2;
+        char *q = (char *)realloc(*buf, c);
+        if (!q) return -1;
+        *buf = q;
+        *cap = c;
+    }
+    memcpy(*buf + *len, p, n);
+    *len += n;
+    return 0;
+}
+
+static int text_append_str(char **buf, size_t *len, size_t *cap, const char *str) {
+    return text_append(buf, len, cap, str, strlen(str));
+}
+
+/* --- Hashtabell --- */
+
+static uint32_t map_hash(const char *s) {
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int map_init(Map *m) {
+    m->buckets = (MapNode **)calloc(RELAY_MAP_INITIAL, sizeof(MapNode *));
+    m->mask = RELAY_MAP_INITIAL - 1;
+    m->count = 0;
+    return m->buckets ? 0 : -1;
+}
+
+static void map_free(Map *m) {
+    if (!m->buckets) return;
+    for (size_t i = 0; i <= m->mask; ++i) {
+        MapNode *n = m->buckets[i];
+        while (n) {
+            MapNode *next = n->next;
+            free(n);
+            n = next;
+        }
+    }
+    free(m->buckets);
+    m->buckets = NULL;
+}
+
+static void *map_get(const Map *m, const char *key) {
+    for (MapNode *n = m->buckets[map_hash(key) & m->mask]; n; n = n->next) {
+        if (strcmp(n->key, key) == 0) return n->value;
+    }
+    return NULL;
+}
+
+static int map_put(Map *m, const char *key, void *value) {
+    if (m->count >= m->mask + 1) {
+        size_t cap = (m->mask + 1) * 2;
+        MapNode **buckets = (MapNode **)calloc(cap, sizeof(MapNode *));
+        if (buckets) {
+            for (size_t i = 0; i <= m->mask; ++i) {
+                MapNode *n = m->buckets[i];
+                while (n) {
+                    MapNode *next = n->next;
+                    size_t b = map_hash(n->key) & (cap - 1);
+                    n->next = buckets[b];
+                    buckets[b] = n;
+                    n = next;
+                }
+            }
+            free(m->buckets);
+            m->buckets = buckets;
+            m->mask = cap - 1;
+        }
+    }
+
+    MapNode *n = (MapNode *)malloc(sizeof(MapNode));
+    if (!n) return -1;
+    size_t b = map_hash(key) & m->mask;
+    n->key = key;
+    n->value = value;
+    n->next = m->buckets[b];
+    m->buckets[b] = n;
+    m->count++;
+    return 0;
+}
+
+static void map_remove(Map *m, const char *key) {
+    MapNode **pp = &m->buckets[map_hash(key) & m->mask];
+    while (*pp) {
+        MapNode *n = *pp;
+        if (strcmp(n->key, key) == 0) {
+            *pp = n->next;
+            free(n);
+            m->count--;
+            return;
+        }
+        pp = &n->next;
+    }
+}
+
+/* Tråden som äger sessionen eller återupptagningsnyckeln key */
+static Worker *key_owner(relay *r, const char *key) {
+    return &r->workers[map_hash(key) % (uint32_t)r->threads];
+}
+
+/* --- Sändning --- */
+
+/* Lägger iov sist i anslutningens utbuffert. Om bufferten är tom skrivs så
+   mycket som möjligt direkt. Anropas bara av tråden som äger anslutningen. */
+static void conn_write(Conn *conn, const struct iovec *iov, int iovcnt) {
+    if (conn->dead) return;
+
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; ++i) total += iov[i].iov_len;
+
+    size_t sent = 0;
+    if (conn->tx_len == conn->tx_off) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = (struct iovec *)iov;
+        msg.msg_iovlen = (size_t)iovcnt;
+
+        ssize_t n;
+        do {
+            n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        } while (n < 0 && errno == EINTR);
+
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            conn->dead = true;
+            shutdown(conn->fd, SHUT_RDWR);
+            return;
+        }
+        if (n > 0) sent = (size_t)n;
+    }
+
+    if (sent < total) {
+        size_t left = total - sent;
+        size_t pending = conn->tx_len - conn->tx_off;
+
+        if (pending + left > RELAY_TX_MAX) {
+            /* Klienten läser inte, koppla bort den hellre än att växa utan gräns */
+            conn->dead = true;
+            shutdown(conn->fd, SHUT_RDWR);
+            return;
+        }
+
+        if (conn->tx_off > 0 && conn->tx_len + left > conn->tx_cap) {
+            memmove(conn->tx, conn->tx + conn->tx_off, pending);
+            conn->tx_len = pending;
+            conn->tx_off = 0;
+        }
+        if (conn->tx_len + left > conn->tx_cap) {
+            size_t cap = conn->tx_cap ? conn->tx_cap : 4096;
+            while (cap < conn->tx_len + left) cap *= 2;
+            char *p = (char *)realloc(conn->tx, cap);
+            if (!p) {
+                conn->dead = true;
+                shutdown(conn->fd, SHUT_RDWR);
+                return;
+            }
+            conn->tx = p;
+            conn->tx_cap = cap;
+        }
+
+        size_t skip = sent;
+        for (int i = 0; i < iovcnt; ++i) {
+            size_t len = iov[i].iov_len;
+            if (skip >= len) {
+                skip -= len;
+                continue;
+            }
+            memcpy(conn->tx + conn->tx_len, (const char *)iov[i].iov_base + skip, len - skip);
+            conn->tx_len += len - skip;
+            skip = 0;
+        }
+
+        if (!conn->tx_armed) {
+            struct epoll_event ev;
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+            ev.data.ptr = conn;
+            epoll_ctl(conn->worker->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+            conn->tx_armed = true;
+        }
+    }
+}
+
+/* Skickar det som ligger i utbufferten. Anropas av ägartråden vid EPOLLOUT.
+   Returnerar -1 om anslutningen ska stängas. */
+static int conn_flush(Conn *conn) {
+    int rc = 0;
+
+    while (!conn->dead && conn->tx_off < conn->tx_len) {
+        ssize_t n = send(conn->fd, conn->tx + conn->tx_off, conn->tx_len - conn->tx_off, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) conn->dead = true;
+            break;
+        }
+        conn->tx_off += (size_t)n;
+    }
+
+    if (conn->dead) {
+        rc = -1;
+    } else if (conn->tx_off == conn->tx_len) {
+        conn->tx_off = 0;
+        conn->tx_len = 0;
+        if (conn->tx_cap > RELAY_TX_KEEP_CAP) {
+            free(conn->tx);
+            conn->tx = NULL;
+            conn->tx_cap = 0;
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = conn;
+        epoll_ctl(conn->worker->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->tx_armed = false;
+    }
+
+    return rc;
+}
+
+/* Skickar ett JSON‑meddelande som rad eller J‑ram beroende på vad klienten
+   förhandlat fram. En frånkopplad klient får det sparat tills den återansluter. */
+static void client_send_text(Worker *w, Client *c, const char *text, size_t len) {
+    if (!c->conn) {
+        if (!c->detached) return;
+        if (c->held_count >= (size_t)w->r->opt.replay_limit) {
+            c->held_overflow = true;
+            return;
+        }
+
+        HeldMessage *m = (HeldMessage *)malloc(sizeof(HeldMessage) + len);
+        if (!m) {
+            c->held_overflow = true;
+            return;
+        }
+        m->next = NULL;
+        m->len = len;
+        memcpy(m->text, text, len);
+        if (c->held_tail) c->held_tail->next = m;
+        else c->held_head = m;
+        c->held_tail = m;
+        c->held_count++;
+        return;
+    }
+
+    struct iovec iov[2];
+    if (c->length_framing) {
+        unsigned char head[16];
+        head[0] = RELAY_FRAME_JSON;
+        size_t head_len = 1 + varint_put(head + 1, len);
+        iov[0].iov_base = head;
+        iov[0].iov_len = head_len;
+        iov[1].iov_base = (void *)text;
+        iov[1].iov_len = len;
+        conn_write(c->conn, iov, 2);
+    } else {
+        /* Varje JSON‑meddelande avslutas med '\n' */
+        iov[0].iov_base = (void *)text;
+        iov[0].iov_len = len;
+        iov[1].iov_base = (void *)"\n";
+        iov[1].iov_len = 1;
+        conn_write(c->conn, iov, 2);
+    }
+}
+
+/* Serialiserar och skickar msg, som frigörs. */
+static void client_send_json(Worker *w, Client *c, json_t *msg) {
+    char *text = json_dumps(msg, JSON_COMPACT);
+    if (text) {
+        client_send_text(w, c, text, strlen(text));
+        free(text);
+    }
+    json_decref(msg);
+}
+
+/* --- Sessioner och klienter --- */
+
+static Client *client_new(void) {
+    Client *c = (Client *)calloc(1, sizeof(Client));
+    if (!c) return NULL;
+    new_uuid(c->clientId);
+    c->handle = -1;
+    return c;
+}
+
+static void client_free_held(Client *c) {
+    HeldMessage *m = c->held_head;
+    while (m) {
+        HeldMessage *next = m->next;
+        free(m);
+        m = next;
+    }
+    c->held_head = c->held_tail = NULL;
+    c->held_count = 0;
+}
+
+static void game_entry_free(GameEntry *e) {
+    if (!e) return;
+    free(e->destination);
+    free(e->data);
+    free(e->serialized);
+    free(e->frame);
+    free(e);
+}
+
+static Session *session_find(Worker *w, const char *id) {
+    return id ? (Session *)map_get(&w->sessions, id) : NULL;
+}
+
+static int session_index(const Session *s, const Client *c) {
+    for (size_t i = 0; i < s->count; ++i) {
+        if (s->clients[i] == c) return (int)i;
+    }
+    return -1;
+}
+
+static int session_add(Session *s, Client *c) {
+    if (s->count == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 8;
+        Client **p = (Client **)realloc(s->clients, cap * sizeof(Client *));
+        if (!p) return -1;
+        s->clients = p;
+        s->cap = cap;
+    }
+    s->clients[s->count++] = c;
+    return 0;
+}
+
+/* Tar bort c ur listan men behåller ordningen, som avgör ny host */
+static void session_remove(Session *s, Client *c) {
+    int i = session_index(s, c);
+    if (i < 0) return;
+    memmove(&s->clients[i], &s->clients[i + 1], (s->count - (size_t)i - 1) * sizeof(Client *));
+    s->count--;
+}
+
+static json_t *session_client_ids(const Session *s) {
+    json_t *ids = json_array();
+    for (size_t i = 0; i < s->count; ++i) {
+        json_array_append_new(ids, json_string(s->clients[i]->clientId));
+    }
+    return ids;
+}
+
+static json_t *session_handles(const Session *s) {
+    json_t *handles = json_array();
+    for (size_t i = 0; i < s->count; ++i) {
+        json_array_append_new(handles, json_integer(s->clients[i]->handle));
+    }
+    return handles;
+}
+
+static Session *session_create(Worker *w, const char *identifier) {
+    static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+
+    Session *s = (Session *)calloc(1, sizeof(Session));
+    if (!s) return NULL;
+    s->identifier = strdup(identifier);
+    if (!s->identifier) {
+        free(s);
+        return NULL;
+    }
+
+    /* Id:t ska peka ut den här tråden, se key_owner */
+    do {
+        unsigned char rnd[6];
+        if (getrandom(rnd, sizeof(rnd), 0) != (ssize_t)sizeof(rnd)) {
+            for (int i = 0; i < 6; ++i) rnd[i] = (unsigned char)rand();
+        }
+        for (int i = 0; i < 6; ++i) {
+            s->id[i] = chars[rnd[i] % (sizeof(chars) - 1)];
+        }
+        s->id[6] = '\0';
+    } while (key_owner(w->r, s->id) != w || map_get(&w->sessions, s->id));
+
+    s->listing = (Listing *)calloc(1, sizeof(Listing));
+    if (!s->listing || map_put(&w->sessions, s->id, s) != 0) {
+        free(s->listing);
+        free(s->identifier);
+        free(s);
+        return NULL;
+    }
+
+    s->prev = w->last_session;
+    if (w->last_session) w->last_session->next = s;
+    else w->first_session = s;
+    w->last_session = s;
+    return s;
+}
+
+/* Tar bort posten ur sitt index. Anroparen håller directory_lock. */
+static void listing_unlink(relay *r, Listing *l) {
+    ListIndex *idx = l->index;
+    if (idx) {
+        if (l->prev) l->prev->next = l->next;
+        else idx->first = l->next;
+        if (l->next) l->next->prev = l->prev;
+        else idx->last = l->prev;
+        if (!idx->first) {
+            map_remove(&r->directory, idx->identifier);
+            free(idx->identifier);
+            free(idx);
+        }
+    }
+    free(l->entry);
+    free(l->name);
+    memset(l, 0, sizeof(*l));
+}
+
+/* Lägger posten sist i indexet för identifier. Anroparen håller directory_lock. */
+static int listing_link(relay *r, Listing *l, const char *identifier) {
+    ListIndex *idx = (ListIndex *)map_get(&r->directory, identifier);
+    if (!idx) {
+        idx = (ListIndex *)calloc(1, sizeof(ListIndex));
+        if (idx) idx->identifier = strdup(identifier);
+        if (!idx || !idx->identifier || map_put(&r->directory, idx->identifier, idx) != 0) {
+            if (idx) free(idx->identifier);
+            free(idx);
+            return -1;
+        }
+    }
+    l->index = idx;
+    l->next = NULL;
+    l->prev = idx->last;
+    if (idx->last) idx->last->next = l;
+    else idx->first = l;
+    idx->last = l;
+    return 0;
+}
+
+/* Uppdaterar det list visar om sessionen. Posten byggs här, när sessionen
+   ändras, så att list bara behöver sätta ihop färdig text. */
+static void session_publish(Worker *w, Session *s) {
+    char *text = NULL, *name = NULL;
+    if (!s->isPrivate) {
+        json_t *entry = json_pack("{s:s,s:s,s:o}", "id", s->id, "name", s->name, "clients", session_client_ids(s));
+        text = entry ? json_dumps(entry, JSON_COMPACT) : NULL;
+        json_decref(entry);
+        name = strdup(s->name);
+    }
+
+    relay *r = w->r;
+    Listing *l = s->listing;
+    pthread_mutex_lock(&r->directory_lock);
+    if (text && name) {
+        free(l->entry);
+        free(l->name);
+        l->entry = text;
+        l->entry_len = strlen(text);
+        l->name = name;
+        l->count = s->count;
+        l->maxClients = s->maxClients;
+        text = name = NULL;
+        if (!l->index && listing_link(r, l, s->identifier) != 0) listing_unlink(r, l);
+    } else {
+        listing_unlink(r, l);
+    }
+    pthread_mutex_unlock(&r->directory_lock);
+    free(text);
+    free(name);
+}
+
+static void session_drop_replay(Worker *w, Session *s) {
+    if (!s->replay) return;
+    for (int i = 0; i < w->r->opt.replay_limit; ++i) game_entry_free(s->replay[i]);
+    free(s->replay);
+    s->replay = NULL;
+}
+
+static void session_destroy(Worker *w, Session *s) {
+    relay *r = w->r;
+    pthread_mutex_lock(&r->directory_lock);
+    listing_unlink(r, s->listing);
+    pthread_mutex_unlock(&r->directory_lock);
+    free(s->listing);
+
+    map_remove(&w->sessions, s->id);
+    if (s->prev) s->prev->next = s->next;
+    else w->first_session = s->next;
+    if (s->next) s->next->prev = s->prev;
+    else w->last_session = s->prev;
+
+    session_drop_replay(w, s);
+    if (s->payload) json_decref(s->payload);
+    free(s->clients);
+    free(s->identifier);
+    free(s->name);
+    free(s);
+}
+
+static void drop_resume(Worker *w, Client *c) {
+    if (c->resumeToken[0]) {
+        map_remove(&w->tokens, c->resumeToken);
+        c->resumeToken[0] = '\0';
+    }
+}
+
+/* Som finishClose: tar bort klienten ur sin session. Var den host flyttas
+   rollen till nästa klient eller så stängs sessionen. */
+static void client_finish_close(Worker *w, Client *c) {
+    Session *s = c->session;
+    c->session = NULL;
+    c->handle = -1;
+    if (!s) return;
+
+    session_remove(s, c);
+
+    /* Replay‑ringen behövs bara så länge någon i sessionen kan återuppta */
+    if (s->replay) {
+        size_t i = 0;
+        while (i < s->count && !s->clients[i]->resumeToken[0]) ++i;
+        if (i == s->count) session_drop_replay(w, s);
+    }
+
+    if (s->host != c) {
+        session_publish(w, s);
+        return;
+    }
+
+    if (s->hostMigration && s->count > 1) {
+        s->host = s->clients[0];
+
+        json_t *msg = json_pack("{s:s,s:{s:s,s:s}}", "cmd", "event",
+                                "data", "host", s->host->clientId, "reason", "host_migrated");
+        char *text = json_dumps(msg, JSON_COMPACT);
+        if (text) {
+            size_t len = strlen(text);
+            for (size_t i = 0; i < s->count; ++i) client_send_text(w, s->clients[i], text, len);
+            free(text);
+        }
+        json_decref(msg);
+
+        session_publish(w, s);
+        if (w->r->opt.verbose) printf("Session %s migrated to %s\n", s->id, s->host->clientId);
+    } else {
+        json_t *msg = json_pack("{s:s,s:{s:s}}", "cmd", "closed", "data", "reason", "host_disconnected");
+        char *text = json_dumps(msg, JSON_COMPACT);
+        size_t len = text ? strlen(text) : 0;
+        for (size_t i = 0; i < s->count; ++i) {
+            Client *other = s->clients[i];
+            if (text) client_send_text(w, other, text, len);
+            other->session = NULL;
+            other->handle = -1;
+        }
+        free(text);
+        json_decref(msg);
+
+        if (w->r->opt.verbose) printf("Session %s closed\n", s->id);
+        session_destroy(w, s);
+    }
+}
+
+static void detached_unlink(Worker *w, Client *c) {
+    if (c->detached_prev) c->detached_prev->detached_next = c->detached_next;
+    else w->detached = c->detached_next;
+    if (c->detached_next) c->detached_next->detached_prev = c->detached_prev;
+    c->detached_prev = c->detached_next = NULL;
+    c->detached = false;
+}
+
+/* Klienten ligger kvar i sessionen utan anslutning. Det som skickas till
+   den sparas tills den återansluter eller tiden går ut. */
+static void client_detach(Worker *w, Client *c) {
+    if (w->r->opt.verbose) printf("Client detached: %s\n", c->clientId);
+
+    Conn *conn = c->conn;
+    if (conn) {
+        /* Den gamla anslutningen kan fortfarande vara halvöppen */
+        conn->client = NULL;
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    c->conn = NULL;
+
+    c->detached = true;
+    c->detached_at = c->session->messageId;
+    /* Det som hålls kvar sparas som text, den nya anslutningen kan ta emot båda */
+    c->binary = false;
+    c->expires_ms = monotonic_ms() + w->r->opt.resume_grace_ms;
+
+    c->detached_prev = NULL;
+    c->detached_next = w->detached;
+    if (w->detached) w->detached->detached_prev = c;
+    w->detached = c;
+}
+
+/* Klienten kommer inte tillbaka */
+static void client_expire(Worker *w, Client *c) {
+    detached_unlink(w, c);
+    drop_resume(w, c);
+    client_finish_close(w, c);
+    client_free_held(c);
+    free(c);
+}
+
+/* Anslutningen är borta. Returnerar true om klienten kan frigöras. */
+static bool client_disconnected(Worker *w, Client *c) {
+    c->conn = NULL;
+
+    /* Klienter med resumeToken får en stund på sig att återansluta */
+    if (c->resumeToken[0] && c->session) {
+        client_detach(w, c);
+        return false;
+    }
+
+    if (w->r->opt.verbose) printf("Client disconnected: %s\n", c->clientId);
+    drop_resume(w, c);
+    client_finish_close(w, c);
+    return true;
+}
+
+/* Ger klienten en resumeToken om den bett om det med resumable: true */
+static json_t *enable_resume(Worker *w, Client *c, json_t *payload) {
+    if (!json_is_true(json_object_get(payload, "resumable"))) return NULL;
+
+    /* En nyckel som följt med från en annan tråd hittas inte av resume, som
+       letar på nyckelns tråd. Klienten får en ny i svaret. */
+    if (c->resumeToken[0] && key_owner(w->r, c->resumeToken) != w) drop_resume(w, c);
+
+    if (!c->resumeToken[0]) {
+        /* Nyckeln ska peka ut den här tråden, se key_owner */
+        do {
+            new_uuid(c->resumeToken);
+        } while (key_owner(w->r, c->resumeToken) != w);
+        if (map_put(&w->tokens, c->resumeToken, c) != 0) {
+            c->resumeToken[0] = '\0';
+            return NULL;
+        }
+    }
+    /* Det som skickades innan klienten kom med ska inte spelas upp igen */
+    c->resume_from = c->session ? c->session->messageId : 0;
+    return json_string(c->resumeToken);
+}
+
+/* Binära ramar bara om klienten bett om det med binary: 1 */
+static json_t *enable_binary(Client *c, json_t *payload) {
+    json_t *v = json_object_get(payload, "binary");
+    c->binary = json_is_number(v) && json_number_value(v) == 1;
+    return c->binary ? json_integer(1) : NULL;
+}
+
+/* Längdprefixerade JSON‑meddelanden om klienten bett om det med
+   framing: "length". Svaret där det bekräftas skickas redan som ram. */
+static json_t *enable_framing(Client *c, json_t *payload) {
+    json_t *v = json_object_get(payload, "framing");
+    c->length_framing = json_is_string(v) && strcmp(json_string_value(v), "length") == 0;
+    return c->length_framing ? json_string("length") : NULL;
+}
+
+/* --- Snabbväg för game ---
+ *
+ * Game‑meddelanden skickas vidare utan att tolkas. Meddelandet gås igenom en
+ * gång utan att något träd byggs, och data skickas vidare som de byte
+ * klienten skickade. Allt som inte är enkelt tolkas fullt ut med jansson.
+ */
+
+typedef struct ScanState {
+    bool newline;           /* radbrytning mellan värden */
+    bool escaped;           /* senaste strängen innehöll escape‑sekvenser */
+} ScanState;
+
+typedef struct GameFields {
+    const char *session;
+    size_t session_len;
+    const char *destination;   /* NULL = till alla */
+    size_t destination_len;
+    const char *data;
+    size_t data_len;
+} GameFields;
+
+static const char *scan_ws(const char *p, const char *end, ScanState *st) {
+    while (p < end) {
+        if (*p == ' ' || *p == '\t' || *p == '\r') {
+            p++;
+        } else if (*p == '\n') {
+            st->newline = true;
+            p++;
+        } else {
+            break;
+        }
+    }
+    return p;
+}
+
+static bool is_hex(char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+/* Längden på en giltig UTF‑8‑sekvens som börjar med en byte >= 0x80, eller
+   0. Överlånga former, surrogat och tecken över U+10FFFF godtas inte, precis
+   som när jansson tolkar. */
+static size_t utf8_length(const unsigned char *p, const unsigned char *end) {
+    unsigned char c = p[0];
+    size_t n;
+    unsigned char lo = 0x80, hi = 0xbf;
+
+    if (c >= 0xc2 && c <= 0xdf) {
+        n = 2;
+    } else if (c >= 0xe0 && c <= 0xef) {
+        n = 3;
+        if (c == 0xe0) lo = 0xa0;
+        if (c == 0xed) hi = 0x9f;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        n = 4;
+        if (c == 0xf0) lo = 0x90;
+        if (c == 0xf4) hi = 0x8f;
+    } else {
+        return 0;
+    }
+
+    if ((size_t)(end - p) < n) return 0;
+    if (p[1] < lo || p[1] > hi) return 0;
+    for (size_t i = 2; i < n; ++i) {
+        if ((p[i] & 0xc0) != 0x80) return 0;
+    }
+    return n;
+}
+
+/* p pekar på '"'. Returnerar pekaren efter strängen eller NULL. */
+static const char *scan_string(const char *p, const char *end, ScanState *st) {
+    const unsigned char *u = (const unsigned char *)p + 1;
+    const unsigned char *e = (const unsigned char *)end;
+
+    while (u < e) {
+        unsigned char c = *u;
+        if (c == '"') return (const char *)u + 1;
+
+        if (c == '\\') {
+            st->escaped = true;
+            if (u + 1 >= e) return NULL;
+            unsigned char x = u[1];
+            if (x == 'u') {
+                if (e - u < 6 || !is_hex((char)u[2]) || !is_hex((char)u[3]) || !is_hex((char)u[4]) || !is_hex((char)u[5]))
+                    return NULL;
+                u += 6;
+            } else if (x == '"' || x == '\\' || x == '/' || x == 'b' || x == 'f' || x == 'n' || x == 'r' || x == 't') {
+                u += 2;
+            } else {
+                return NULL;
+            }
+        } else if (c < 0x20) {
+            return NULL;
+        } else if (c >= 0x80) {
+            size_t n = utf8_length(u, e);
+            if (n == 0) return NULL;
+            u += n;
+        } else {
+            u++;
+        }
+    }
+    return NULL;
+}
+
+static const char *scan_digits(const char *p, const char *end) {
+    const char *start = p;
+    while (p < end && *p >= '0' && *p <= '9') p++;
+    return p > start ? p : NULL;
+}
+
+/* Tal, true, false eller null */
+static const char *scan_scalar(const char *p, const char *end) {
+    size_t left = (size_t)(end - p);
+    if (*p == 't') return left >= 4 && memcmp(p, "true", 4) == 0 ? p + 4 : NULL;
+    if (*p == 'f') return left >= 5 && memcmp(p, "false", 5) == 0 ? p + 5 : NULL;
+    if (*p == 'n') return left >= 4 && memcmp(p, "null", 4) == 0 ? p + 4 : NULL;
+
+    const char *start = p;
+    bool real = false;
+    if (*p == '-') p++;
+    if (p < end && *p == '0') {
+        p++;
+    } else {
+        p = scan_digits(p, end);
+        if (!p) return NULL;
+    }
+    if (p < end && *p == '.') {
+        real = true;
+        p = scan_digits(p + 1, end);
+        if (!p) return NULL;
+    }
+    bool exponent = false;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        real = exponent = true;
+        p++;
+        if (p < end && (*p == '+' || *p == '-')) p++;
+        p = scan_digits(p, end);
+        if (!p) return NULL;
+    }
+
+    /* Korta tal får alltid plats. Andra kontrolleras som jansson gör, som
+       inte godtar heltal utanför json_int_t eller flyttal som blir oändliga. */
+    size_t len = (size_t)(p - start);
+    if (len <= 18 && !exponent) return p;
+
+    char small[64];
+    char *copy = len < sizeof(small) ? small : (char *)malloc(len + 1);
+    if (!copy) return NULL;
+    memcpy(copy, start, len);
+    copy[len] = '\0';
+
+    bool fits;
+    errno = 0;
+    if (real) {
+        double value = strtod(copy, NULL);
+        fits = !(errno == ERANGE && (value == HUGE_VAL || value == -HUGE_VAL));
+    } else {
+        (void)strtoll(copy, NULL, 10);
+        fits = errno != ERANGE;
+    }
+    if (copy != small) free(copy);
+    return fits ? p : NULL;
+}
+
+/* Nyckel och ':' i ett objekt. Returnerar pekaren efter ':' eller NULL. */
+static const char *scan_key(const char *p, const char *end, ScanState *st) {
+    p = scan_ws(p, end, st);
+    if (p >= end || *p != '"') return NULL;
+    p = scan_string(p, end, st);
+    if (!p) return NULL;
+    p = scan_ws(p, end, st);
+    return p < end && *p == ':' ? p + 1 : NULL;
+}
+
+/* Går igenom ett JSON‑värde utan att bygga något. Nästlingen hålls i en
+   egen stack så att djup data inte kan spränga anropsstacken. Returnerar
+   pekaren efter värdet eller NULL om det inte är giltig JSON. */
+static const char *scan_value(const char *p, const char *end, ScanState *st) {
+    char stack[RELAY_SCAN_DEPTH];
+    int depth = 0;
+
+    for (;;) {
+        p = scan_ws(p, end, st);
+        if (p >= end) return NULL;
+
+        char c = *p;
+        if (c == '{' || c == '[') {
+            char close = c == '{' ? '}' : ']';
+            p = scan_ws(p + 1, end, st);
+            if (p < end && *p == close) {
+                p++;
+            } else {
+                if (depth == RELAY_SCAN_DEPTH) return NULL;
+                stack[depth++] = close;
+                if (c == '{' && !(p = scan_key(p, end, st))) return NULL;
+                continue;
+            }
+        } else if (c == '"') {
+            p = scan_string(p, end, st);
+        } else {
+            p = scan_scalar(p, end);
+        }
+        if (!p) return NULL;
+
+        /* Efter ett värde kommer ',' eller slutet på behållaren */
+        for (;;) {
+            if (depth == 0) return p;
+
+            p = scan_ws(p, end, st);
+            if (p >= end) return NULL;
+
+            if (*p == ',') {
+                p++;
+                if (stack[depth - 1] == '}' && !(p = scan_key(p, end, st))) return NULL;
+                break;
+            }
+            if (*p != stack[depth - 1]) return NULL;
+            depth--;
+            p++;
+        }
+    }
+}
+
+static bool key_is(const char *key, size_t len, const char *name) {
+    return strlen(name) == len && memcmp(key, name, len) == 0;
+}
+
+/* Plockar ut session, destination och data ur ett game‑meddelande. Returnerar
+   0 om meddelandet kan tas den snabba vägen, annars -1. */
+static int scan_game_message(const char *buf, size_t len, GameFields *out) {
+    const char *end = buf + len;
+    ScanState st = { false, false };
+    bool is_game = false;
+    bool identifier = false;
+
+    memset(out, 0, sizeof(*out));
+
+    const char *p = scan_ws(buf, end, &st);
+    if (p >= end || *p != '{') return -1;
+    p = scan_ws(p + 1, end, &st);
+
+    if (p < end && *p != '}') {
+        for (;;) {
+            if (p >= end || *p != '"') return -1;
+
+            st.escaped = false;
+            const char *key = p + 1;
+            p = scan_string(p, end, &st);
+            if (!p || st.escaped) return -1;
+            size_t key_len = (size_t)(p - 1 - key);
+
+            p = scan_ws(p, end, &st);
+            if (p >= end || *p != ':') return -1;
+            p = scan_ws(p + 1, end, &st);
+
+            st.escaped = false;
+            const char *value = p;
+            bool is_string = p < end && *p == '"';
+            p = scan_value(p, end, &st);
+            if (!p) return -1;
+
+            /* Som vid fullständig tolkning gäller den sista av flera likadana nycklar */
+            if (key_is(key, key_len, "cmd")) {
+                if (is_string && st.escaped) return -1;
+                is_game = is_string && key_is(value + 1, (size_t)(p - value - 2), "game");
+            } else if (key_is(key, key_len, "identifier")) {
+                identifier = is_string;
+            } else if (key_is(key, key_len, "session")) {
+                if (is_string && st.escaped) return -1;
+                out->session = is_string ? value + 1 : NULL;
+                out->session_len = is_string ? (size_t)(p - value - 2) : 0;
+            } else if (key_is(key, key_len, "destination")) {
+                if (is_string && st.escaped) return -1;
+                out->destination = is_string ? value + 1 : NULL;
+                out->destination_len = is_string ? (size_t)(p - value - 2) : 0;
+            } else if (key_is(key, key_len, "data")) {
+                out->data = value;
+                out->data_len = (size_t)(p - value);
+            }
+
+            p = scan_ws(p, end, &st);
+            if (p < end && *p == ',') {
+                p = scan_ws(p + 1, end, &st);
+                continue;
+            }
+            if (p >= end || *p != '}') return -1;
+            break;
+        }
+    }
+
+    if (scan_ws(p + 1, end, &st) != end) return -1;
+
+    /* Saknad identifier ger ett felsvar, det sköts av den vanliga vägen */
+    if (!is_game || !identifier) return -1;
+
+    /* Rader får inte innehålla radbrytningar */
+    if (st.newline) return -1;
+
+    /* Data som inte är objekt, array eller null skickas vidare som {} */
+    if (!out->data || (out->data[0] != '{' && out->data[0] != '[' && out->data[0] != 'n')) {
+        out->data = "{}";
+        out->data_len = 2;
+    }
+    return 0;
+}
+
+/* --- Game‑meddelanden --- */
+
+static void send_game(Worker *w, Client *c, GameEntry *e) {
+    if (c->binary && c->conn) {
+        if (!e->frame) {
+            unsigned char body_head[RELAY_BIN_HEAD_MAX];
+            size_t body_head_len = 0;
+            body_head[body_head_len++] = e->destination ? RELAY_GAME_DIRECTED : 0;
+            body_head_len += varint_put(body_head + body_head_len, (uint64_t)e->messageId);
+            body_head_len += varint_put(body_head + body_head_len, (uint64_t)(e->handle < 0 ? 0 : e->handle));
+
+            unsigned char head[16];
+            head[0] = RELAY_FRAME_GAME;
+            size_t head_len = 1 + varint_put(head + 1, body_head_len + e->data_len);
+
+            e->frame_len = head_len + body_head_len + e->data_len;
+            e->frame = (unsigned char *)malloc(e->frame_len);
+            if (!e->frame) return;
+            memcpy(e->frame, head, head_len);
+            memcpy(e->frame + head_len, body_head, body_head_len);
+            memcpy(e->frame + head_len + body_head_len, e->data, e->data_len);
+        }
+
+        struct iovec iov;
+        iov.iov_base = e->frame;
+        iov.iov_len = e->frame_len;
+        conn_write(c->conn, &iov, 1);
+        return;
+    }
+
+    /* data fogas in som den är, clientId är alltid ett uuid */
+    if (!e->serialized) {
+        char head[160];
+        int head_len = snprintf(head, sizeof(head), "{\"cmd\":\"game\",\"messageId\":%lld,\"clientId\":\"%s\",\"broadcast\":%s,\"data\":",
+                                (long long)e->messageId, e->clientId, e->destination ? "false" : "true");
+        if (head_len < 0 || (size_t)head_len >= sizeof(head)) return;
+
+        e->serialized_len = (size_t)head_len + e->data_len + 1;
+        e->serialized = (char *)malloc(e->serialized_len);
+        if (!e->serialized) return;
+        memcpy(e->serialized, head, (size_t)head_len);
+        memcpy(e->serialized + head_len, e->data, e->data_len);
+        e->serialized[e->serialized_len - 1] = '}';
+    }
+    client_send_text(w, c, e->serialized, e->serialized_len);
+}
+
+/* Skickar data från c till sessionen. data är JSON‑text utan radbrytningar
+   som aldrig tolkas, utan fogas in som den är i både text och binära ramar.
+   En tom destination går till alla, precis som saknad. */
+static void route_game(Worker *w, Client *c, Session *s, const char *destination, size_t destination_len,
+                       const char *data, size_t data_len) {
+    if (destination_len == 0) destination = NULL;
+
+    GameEntry *e = (GameEntry *)calloc(1, sizeof(GameEntry));
+    if (!e) return;
+
+    e->messageId = s->messageId++;
+    memcpy(e->clientId, c->clientId, sizeof(e->clientId));
+    e->handle = c->handle;
+    e->data = (char *)malloc(data_len + 1);
+    if (destination) e->destination = strndup(destination, destination_len);
+    if (!e->data || (destination && !e->destination)) {
+        game_entry_free(e);
+        return;
+    }
+    memcpy(e->data, data, data_len);
+    e->data[data_len] = '\0';
+    e->data_len = data_len;
+
+    bool resumable = false;
+    for (size_t i = 0; i < s->count; ++i) {
+        Client *other = s->clients[i];
+        if (other->resumeToken[0]) resumable = true;
+        if (!e->destination || strcmp(other->clientId, e->destination) == 0) {
+            send_game(w, other, e);
+        }
+    }
+
+    /* Sparas så att en klient som återansluter kan få det den missat */
+    if (resumable && !s->replay) s->replay = (GameEntry **)calloc((size_t)w->r->opt.replay_limit, sizeof(GameEntry *));
+    if (resumable && s->replay) {
+        size_t slot = (size_t)(e->messageId % w->r->opt.replay_limit);
+        game_entry_free(s->replay[slot]);
+        s->replay[slot] = e;
+    } else {
+        game_entry_free(e);
+    }
+}
+
+/* Binär game‑ram från en klient som förhandlat fram binärt läge.
+   Sessionen ges av anslutningen, så identifier och session behövs inte. */
+static void handle_game_frame(Worker *w, Conn *conn, const unsigned char *body, size_t len) {
+    if (len == 0) return;
+
+    const unsigned char flags = body[0];
+    size_t offset = 1;
+    if (flags & RELAY_GAME_COMPACT) return;
+
+    uint64_t target_handle = 0;
+    if (flags & RELAY_GAME_DIRECTED) {
+        int used = varint_get(body + offset, len - offset, &target_handle);
+        if (used <= 0) return;
+        offset += (size_t)used;
+    }
+
+    const char *end = (const char *)body + len;
+    ScanState st = { false, false };
+    const char *value = scan_ws((const char *)body + offset, end, &st);
+    const char *value_end = scan_value(value, end, &st);
+    if (!value_end || scan_ws(value_end, end, &st) != end) return;
+
+    /* Data som inte är ett objekt skickas vidare som {} precis som för text */
+    const char *data = "{}";
+    size_t data_len = 2;
+    char *compact = NULL;
+    if (*value == '{') {
+        if (!st.newline) {
+            data = value;
+            data_len = (size_t)(value_end - value);
+        } else {
+            /* Radbrytningar tas bort innan det kan skickas som rad */
+            json_error_t jerr;
+            json_t *parsed = json_loadb(value, (size_t)(value_end - value), 0, &jerr);
+            if (!parsed) return;
+            compact = json_dumps(parsed, JSON_COMPACT);
+            json_decref(parsed);
+            if (!compact) return;
+            data = compact;
+            data_len = strlen(compact);
+        }
+    }
+
+    Client *c = conn->client;
+    Session *s = c ? c->session : NULL;
+    if (s) {
+        const char *destination = NULL;
+        bool found = true;
+        if (flags & RELAY_GAME_DIRECTED) {
+            found = false;
+            for (size_t i = 0; i < s->count; ++i) {
+                if (s->clients[i]->handle >= 0 && (uint64_t)s->clients[i]->handle == target_handle) {
+                    destination = s->clients[i]->clientId;
+                    found = true;
+                    break;
+                }
+            }
+        }
+
+        if (found) route_game(w, c, s, destination, destination ? strlen(destination) : 0, data, data_len);
+    }
+    free(compact);
+}
+
+/* --- Kommandon --- */
+
+/* Svar som bara bär ett fel, för join och resume */
+static void reply_error(Worker *w, Client *c, const char *cmd, json_t *session, json_t *requestId, const char *reason) {
+    json_t *msg = json_object();
+    json_object_set(msg, "session", session ? session : json_null());
+    json_object_set_new(msg, "cmd", json_string(cmd));
+    if (requestId) json_object_set(msg, "requestId", requestId);
+    json_object_set_new(msg, "clientId", json_string(c->clientId));
+    json_object_set_new(msg, "error", json_string(reason));
+    client_send_json(w, c, msg);
+}
+
+/* Namnet kortas till RELAY_NAME_MAX tecken */
+static char *session_name(json_t *name) {
+    if (!json_is_string(name) || json_string_length(name) == 0) return strdup("Unnamed");
+
+    const char *s = json_string_value(name);
+    size_t len = json_string_length(name);
+    size_t pos = 0;
+    for (int chars = 0; pos < len && chars < RELAY_NAME_MAX; ++chars) {
+        pos++;
+        while (pos < len && ((unsigned char)s[pos] & 0xc0) == 0x80) pos++;
+    }
+    return strndup(s, pos);
+}
+
+static void cmd_host(Worker *w, Client *c, json_t *payload, json_t *data, const char *identifier, json_t *requestId) {
+    /* En klient är bara med i en session åt gången */
+    client_finish_close(w, c);
+
+    Session *s = session_create(w, identifier);
+    if (!s) return;
+
+    json_t *max = json_object_get(data, "maxClients");
+    json_t *host_payload = json_object_get(data, "payload");
+
+    s->name = session_name(json_object_get(data, "name"));
+    s->isPrivate = json_is_true(json_object_get(data, "private"));
+    s->maxClients = json_is_number(max) ? json_number_value(max) : 0;
+    s->hostMigration = json_is_true(json_object_get(data, "hostMigration"));
+    s->payload = json_truthy(host_payload) ? json_incref(host_payload) : NULL;
+    s->host = c;
+    s->nextHandle = 1;
+
+    if (!s->name || session_add(s, c) != 0) {
+        session_destroy(w, s);
+        return;
+    }
+    c->session = s;
+    c->handle = 0;
+    session_publish(w, s);
+
+    if (w->r->opt.verbose) printf("Session %s hosted by %s\n", s->id, c->clientId);
+
+    json_t *msg = json_object();
+    json_object_set_new(msg, "session", json_string(s->id));
+    json_object_set_new(msg, "cmd", json_string("host"));
+    if (requestId) json_object_set(msg, "requestId", requestId);
+    json_object_set_new(msg, "clientId", json_string(c->clientId));
+    json_object_set_new(msg, "name", json_string(s->name));
+    json_object_set_new(msg, "maxClients", json_from_number(s->maxClients));
+    json_object_set_new(msg, "hostMigration", json_boolean(s->hostMigration));
+    json_object_set_new(msg, "isPrivate", json_boolean(s->isPrivate));
+    json_object_set_new(msg, "clients", session_client_ids(s));
+    json_object_set_new(msg, "handle", json_integer(c->handle));
+    json_object_set_new(msg, "handles", session_handles(s));
+    json_object_set_new(msg, "payload", s->payload ? json_incref(s->payload) : json_object());
+    set_optional(msg, "resumeToken", enable_resume(w, c, payload));
+    set_optional(msg, "binary", enable_binary(c, payload));
+    set_optional(msg, "framing", enable_framing(c, payload));
+    client_send_json(w, c, msg);
+}
+
+static void cmd_host_setup(Worker *w, Client *c, Session *s, json_t *data, const char *identifier, json_t *requestId) {
+    if (!s) return;
+
+    const char *reason = NULL;
+    if (strcmp(s->identifier, identifier) != 0) {
+        reason = "identifier_mismatch";
+    } else if (s->host != c) {
+        reason = "not_host";
+    } else {
+        /* Uppdatera sessionsinställningar */
+        json_t *v = json_object_get(data, "name");
+        if (json_is_string(v)) {
+            char *name = strdup(json_string_value(v));
+            if (name) {
+                free(s->name);
+                s->name = name;
+            }
+        }
+
+        v = json_object_get(data, "private");
+        if (json_is_boolean(v)) s->isPrivate = json_is_true(v);
+
+        v = json_object_get(data, "maxClients");
+        if (json_is_number(v)) s->maxClients = json_number_value(v);
+
+        v = json_object_get(data, "hostMigration");
+        if (json_is_boolean(v)) s->hostMigration = json_is_true(v);
+
+        v = json_object_get(data, "payload");
+        if (json_is_object(v) || json_is_array(v) || json_is_null(v)) {
+            if (s->payload) json_decref(s->payload);
+            s->payload = json_is_null(v) ? NULL : json_incref(v);
+        }
+        session_publish(w, s);
+    }
+
+    json_t *msg = json_object();
+    json_object_set_new(msg, "session", json_string(s->id));
+    json_object_set_new(msg, "cmd", json_string("host_setup"));
+    if (requestId) json_object_set(msg, "requestId", requestId);
+    json_object_set_new(msg, "clientId", json_string(c->clientId));
+    if (reason) {
+        json_object_set_new(msg, "data", json_pack("{s:s,s:s}", "status", "error", "reason", reason));
+    } else {
+        json_object_set_new(msg, "data", json_pack("{s:s}", "status", "ok"));
+    }
+    client_send_json(w, c, msg);
+}
+
+static void cmd_join(Worker *w, Client *c, Session *s, json_t *payload, json_t *data, const char *identifier,
+                     json_t *session_id, json_t *requestId) {
+    if (!s) {
+        reply_error(w, c, "join", session_id, requestId, "session_not_found");
+        return;
+    }
+    if (strcmp(s->identifier, identifier) != 0) {
+        reply_error(w, c, "join", session_id, requestId, "identifier_mismatch");
+        return;
+    }
+    if (s->maxClients > 0 && (double)s->count >= s->maxClients) {
+        reply_error(w, c, "join", session_id, requestId, "session_full");
+        return;
+    }
+    if (session_index(s, c) >= 0) {
+        reply_error(w, c, "join", session_id, requestId, "already_joined");
+        return;
+    }
+
+    client_finish_close(w, c);
+    c->session = s;
+    c->handle = s->nextHandle++;
+
+    json_t *msg = json_object();
+    json_object_set_new(msg, "session", json_string(s->id));
+    json_object_set_new(msg, "cmd", json_string("join"));
+    if (requestId) json_object_set(msg, "requestId", requestId);
+    json_object_set_new(msg, "clientId", json_string(c->clientId));
+    json_object_set_new(msg, "hostId", json_string(s->host->clientId));
+    json_object_set_new(msg, "name", json_string(s->name));
+    json_object_set_new(msg, "maxClients", json_from_number(s->maxClients));
+    json_object_set_new(msg, "hostMigration", json_boolean(s->hostMigration));
+    json_object_set_new(msg, "isPrivate", json_boolean(s->isPrivate));
+    json_object_set_new(msg, "clients", session_client_ids(s));
+    json_object_set_new(msg, "handle", json_integer(c->handle));
+    json_object_set_new(msg, "handles", session_handles(s));
+    json_object_set_new(msg, "payload", s->payload ? json_incref(s->payload) : json_object());
+    set_optional(msg, "resumeToken", enable_resume(w, c, payload));
+    set_optional(msg, "binary", enable_binary(c, payload));
+    set_optional(msg, "framing", enable_framing(c, payload));
+    client_send_json(w, c, msg);
+
+    json_t *joined = json_object();
+    json_object_set_new(joined, "session", json_string(s->id));
+    json_object_set_new(joined, "cmd", json_string("joined"));
+    json_object_set_new(joined, "clientId", json_string(c->clientId));
+    json_object_set_new(joined, "handle", json_integer(c->handle));
+    json_object_set(joined, "data", data);
+    char *text = json_dumps(joined, JSON_COMPACT);
+    if (text) {
+        size_t len = strlen(text);
+        for (size_t i = 0; i < s->count; ++i) client_send_text(w, s->clients[i], text, len);
+        free(text);
+    }
+    json_decref(joined);
+
+    if (session_add(s, c) != 0) {
+        c->session = NULL;
+        c->handle = -1;
+    }
+    session_publish(w, s);
+}
+
+static void cmd_leave(Worker *w, Client *c, Session *s, json_t *data) {
+    if (!s) return;
+
+    session_remove(s, c);
+    session_publish(w, s);
+
+    json_t *msg = json_object();
+    json_object_set_new(msg, "cmd", json_string("left"));
+    json_object_set_new(msg, "clientId", json_string(c->clientId));
+    json_object_set(msg, "data", data);
+    char *text = json_dumps(msg, JSON_COMPACT);
+    if (text) {
+        size_t len = strlen(text);
+        for (size_t i = 0; i < s->count; ++i) client_send_text(w, s->clients[i], text, len);
+        free(text);
+    }
+    json_decref(msg);
+
+    /* Den som lämnar frivilligt ska inte kunna återuppta */
+    drop_resume(w, c);
+    client_finish_close(w, c);
+}
+
+/* offset och limit ska vara heltal större än noll, annars gäller standardvärdet */
+static size_t list_count_param(json_t *data, const char *key, size_t fallback) {
+    json_t *v = json_object_get(data, key);
+    double d = json_is_number(v) ? json_number_value(v) : 0;
+    if (!(d > 0) || d != floor(d)) return fallback;
+    return d < (double)SIZE_MAX ? (size_t)d : SIZE_MAX;
+}
+
+/* Sessionerna kan ägas av andra trådar, så svaret byggs av de färdiga
+   posterna i indexet för identifier */
+static void cmd_list(Worker *w, Client *c, json_t *data, const char *identifier, json_t *requestId) {
+    relay *r = w->r;
+    size_t offset = list_count_param(data, "offset", 0);
+    size_t limit = list_count_param(data, "limit", SIZE_MAX);
+    bool notFull = json_is_true(json_object_get(data, "notFull"));
+    const char *prefix = json_string_value(json_object_get(data, "namePrefix"));
+    size_t prefix_len = prefix ? strlen(prefix) : 0;
+
+    char *text = NULL;
+    size_t len = 0, cap = 0;
+    int rc = text_append_str(&text, &len, &cap, "{\"cmd\":\"list\"");
+
+    char *id = requestId ? json_dumps(requestId, JSON_COMPACT | JSON_ENCODE_ANY) : NULL;
+    if (id) {
+        rc |= text_append_str(&text, &len, &cap, ",\"requestId\":");
+        rc |= text_append_str(&text, &len, &cap, id);
+        free(id);
+    }
+    rc |= text_append_str(&text, &len, &cap, ",\"data\":{\"list\":[");
+
+    size_t skipped = 0, shown = 0;
+    pthread_mutex_lock(&r->directory_lock);
+    ListIndex *idx = (ListIndex *)map_get(&r->directory, identifier);
+    for (Listing *l = idx ? idx->first : NULL; l && rc == 0 && shown < limit; l = l->next) {
+        if (notFull && l->maxClients > 0 && (double)l->count >= l->maxClients) continue;
+        if (prefix_len && strncmp(l->name, prefix, prefix_len) != 0) continue;
+        if (skipped < offset) {
+            skipped++;
+            continue;
+        }
+        if (shown) rc |= text_append_str(&text, &len, &cap, ",");
+        rc |= text_append(&text, &len, &cap, l->entry, l->entry_len);
+        shown++;
+    }
+    pthread_mutex_unlock(&r->directory_lock);
+
+    rc |= text_append_str(&text, &len, &cap, "]}}");
+    if (rc == 0) client_send_text(w, c, text, len);
+    free(text);
+}
+
+static void cmd_resume(Worker *w, Conn *conn, Client *c, json_t *payload, json_t *data, const char *identifier,
+                       json_t *session_id, json_t *requestId) {
+    json_t *token = json_object_get(data, "resumeToken");
+    json_t *last = json_object_get(data, "lastMessageId");
+    int64_t lastMessageId = json_is_number(last) ? (int64_t)json_number_value(last) : -1;
+
+    Client *old = json_is_string(token) ? (Client *)map_get(&w->tokens, json_string_value(token)) : NULL;
+    Session *s = old ? old->session : NULL;
+
+    if (!old || !s || old == c) {
+        reply_error(w, c, "resume", session_id, requestId, "unknown_token");
+        return;
+    }
+    if (lastMessageId < old->resume_from - 1) lastMessageId = old->resume_from - 1;
+    if (strcmp(s->identifier, identifier) != 0) {
+        reply_error(w, c, "resume", session_id, requestId, "identifier_mismatch");
+        return;
+    }
+    if (c->session) {
+        reply_error(w, c, "resume", session_id, requestId, "already_joined");
+        return;
+    }
+
+    /* Servern har inte märkt att den gamla anslutningen är död */
+    if (!old->detached) client_detach(w, old);
+
+    /* Allt mellan lastMessageId och frånkopplingen måste finnas kvar */
+    bool available = !old->held_overflow;
+    for (int64_t id = lastMessageId + 1; available && id < old->detached_at; id++) {
+        GameEntry *e = s->replay && id >= 0 ? s->replay[id % w->r->opt.replay_limit] : NULL;
+        if (!e || e->messageId != id) available = false;
+    }
+    if (!available) {
+        reply_error(w, c, "resume", session_id, requestId, "replay_unavailable");
+        client_expire(w, old);
+        return;
+    }
+
+    detached_unlink(w, old);
+
+    /* Den nya anslutningen tar över klientens identitet och plats i sessionen */
+    drop_resume(w, c);
+    conn->client = old;
+    old->conn = conn;
+    free(c);
+
+    if (w->r->opt.verbose) printf("Client resumed: %s\n", old->clientId);
+
+    json_t *msg = json_object();
+    json_object_set_new(msg, "session", json_string(s->id));
+    json_object_set_new(msg, "cmd", json_string("resume"));
+    if (requestId) json_object_set(msg, "requestId", requestId);
+    json_object_set_new(msg, "clientId", json_string(old->clientId));
+    json_object_set_new(msg, "hostId", json_string(s->host->clientId));
+    json_object_set_new(msg, "resumeToken", json_string(old->resumeToken));
+    set_optional(msg, "binary", enable_binary(old, payload));
+    set_optional(msg, "framing", enable_framing(old, payload));
+    client_send_json(w, old, msg);
+
+    for (int64_t id = lastMessageId + 1; id < old->detached_at; id++) {
+        GameEntry *e = s->replay[id % w->r->opt.replay_limit];
+        if (!e->destination || strcmp(e->destination, old->clientId) == 0) {
+            send_game(w, old, e);
+        }
+    }
+
+    for (HeldMessage *m = old->held_head; m; m = m->next) {
+        client_send_text(w, old, m->text, m->len);
+    }
+    client_free_held(old);
+    old->held_overflow = false;
+}
+
+/* Tråden som äger sessionen med id:t, eller w om id:t inte kan finnas */
+static Worker *session_owner(Worker *w, json_t *session_id) {
+    if (!session_id || json_string_length(session_id) != 6) return w;
+    return key_owner(w->r, json_string_value(session_id));
+}
+
+/* Anslutningen lämnas över till owner, som läser om meddelandet och utför det.
+   Bara klienter utan session flyttas, så klienten följer med oförändrad.
+   tokens får bara peka ut den här trådens klienter; conn_adopt lägger in
+   nyckeln hos den nya tråden. */
+static void conn_move(Worker *w, Conn *conn, Worker *owner) {
+    Client *c = conn->client;
+    if (c->resumeToken[0]) map_remove(&w->tokens, c->resumeToken);
+    conn->move_to = owner;
+}
+
+/* Utför ett tolkat kommando. */
+static void handle_command(Worker *w, Conn *conn, json_t *payload) {
+    Client *c = conn->client;
+    if (!c) return;
+
+    json_t *identifier_val = json_object_get(payload, "identifier");
+    if (!json_is_string(identifier_val)) {
+        json_t *msg = json_pack("{s:s,s:s,s:{s:s}}", "cmd", "error", "clientId", c->clientId,
+                                "data", "reason", "missing_identifier");
+        client_send_json(w, c, msg);
+        return;
+    }
+    const char *identifier = json_string_value(identifier_val);
+
+    json_t *cmd_val = json_object_get(payload, "cmd");
+    const char *cmd = json_is_string(cmd_val) ? json_string_value(cmd_val) : "";
+
+    json_t *data = json_object_get(payload, "data");
+    json_t *empty = NULL;
+    if (!json_is_object(data) && !json_is_array(data) && !json_is_null(data)) {
+        data = empty = json_object();
+    }
+
+    json_t *session_id = json_object_get(payload, "session");
+    if (!json_is_string(session_id)) session_id = NULL;
+    Session *s = session_id ? session_find(w, json_string_value(session_id)) : NULL;
+
+    /* Skickas tillbaka i svaret så att klienten kan para ihop svar och förfrågan */
+    json_t *requestId = json_object_get(payload, "requestId");
+    if (!json_is_number(requestId) && !json_is_string(requestId)) requestId = NULL;
+
+    /* En klient utan session flyttar till sessionens tråd utan att något går
+       förlorat. En klient i en session här kan inte byta till en session på
+       en annan tråd: den gamla får inte lämnas förrän ägaren godkänt join,
+       och ägaren kan inte röra den. Annars finns sessionen inte för klienten. */
+    bool moves = !c->session && (strcmp(cmd, "join") == 0 || strcmp(cmd, "host_setup") == 0 ||
+                                 strcmp(cmd, "leave") == 0 || strcmp(cmd, "game") == 0);
+    Worker *owner = session_owner(w, session_id);
+    if (owner != w && c->session && strcmp(cmd, "join") == 0) {
+        reply_error(w, c, "join", session_id, requestId, "already_joined");
+        if (empty) json_decref(empty);
+        return;
+    }
+    if (moves && owner != w) {
+        conn_move(w, conn, owner);
+        if (empty) json_decref(empty);
+        return;
+    }
+
+    if (strcmp(cmd, "host") == 0) {
+        cmd_host(w, c, payload, data, identifier, requestId);
+    } else if (strcmp(cmd, "host_setup") == 0) {
+        cmd_host_setup(w, c, s, data, identifier, requestId);
+    } else if (strcmp(cmd, "join") == 0) {
+        cmd_join(w, c, s, payload, data, identifier, session_id, requestId);
+    } else if (strcmp(cmd, "leave") == 0) {
+        cmd_leave(w, c, s, data);
+    } else if (strcmp(cmd, "list") == 0) {
+        cmd_list(w, c, data, identifier, requestId);
+    } else if (strcmp(cmd, "game") == 0) {
+        /* Hit kommer bara det snabbvägen inte klarade */
+        char *text = s ? json_dumps(data, JSON_COMPACT | JSON_ENCODE_ANY) : NULL;
+        if (text) {
+            json_t *destination = json_object_get(payload, "destination");
+            route_game(w, c, s, json_string_value(destination), json_string_length(destination), text, strlen(text));
+            free(text);
+        }
+    } else if (strcmp(cmd, "resume") == 0) {
+        /* Nyckeln pekar ut tråden, en klient i en session här får sitt fel här */
+        json_t *token = json_object_get(data, "resumeToken");
+        Worker *token_owner = json_is_string(token) && !c->session ? key_owner(w->r, json_string_value(token)) : w;
+        if (token_owner != w) conn_move(w, conn, token_owner);
+        else cmd_resume(w, conn, c, payload, data, identifier, session_id, requestId);
+    }
+
+    if (empty) json_decref(empty);
+}
+
+/* Tolkar ett JSON‑meddelande och utför kommandot. */
+static void handle_message(Worker *w, Conn *conn, const char *text, size_t len) {
+    /* Tomma rader och ren whitespace hoppas över */
+    size_t i = 0;
+    while (i < len && (text[i] == ' ' || text[i] == '\t' || text[i] == '\r' || text[i] == '\n')) i++;
+    if (i == len) return;
+
+    GameFields game;
+    if (scan_game_message(text, len, &game) == 0) {
+        Client *c = conn->client;
+        Session *s = NULL;
+        if (c && game.session && game.session_len < sizeof(s->id)) {
+            char id[sizeof(s->id)];
+            memcpy(id, game.session, game.session_len);
+            id[game.session_len] = '\0';
+            s = session_find(w, id);
+
+            Worker *owner = game.session_len == 6 ? key_owner(w->r, id) : w;
+            if (owner != w && !c->session) {
+                conn_move(w, conn, owner);
+                return;
+            }
+        }
+        if (s) route_game(w, c, s, game.destination, game.destination_len, game.data, game.data_len);
+        return;
+    }
+
+    json_error_t jerr;
+    json_t *payload = json_loadb(text, len, JSON_DECODE_ANY, &jerr);
+    if (!payload) return;
+
+    handle_command(w, conn, payload);
+    json_decref(payload);
+}
+
+/* --- Anslutningar --- */
+
+/* Läser ut alla kompletta meddelanden ur mottagningsbufferten. Returnerar
+   -1 om klienten skickat något trasigt. */
+static int conn_process(Worker *w, Conn *conn) {
+    size_t pos = 0;
+    int rc = 0;
+
+    while (pos < conn->rx_len) {
+        const unsigned char *p = (const unsigned char *)conn->rx + pos;
+        size_t avail = conn->rx_len - pos;
+
+        if (p[0] == RELAY_FRAME_GAME || p[0] == RELAY_FRAME_JSON) {
+            uint64_t body_len;
+            int used = varint_get(p + 1, avail - 1, &body_len);
+            if (used == 0) break;
+            if (used < 0 || body_len > RELAY_MAX_FRAME) {
+                rc = -1;
+                break;
+            }
+
+            size_t total = 1 + (size_t)used + (size_t)body_len;
+            if (avail < total) {
+                conn->rx_need = total;
+                break;
+            }
+
+            if (p[0] == RELAY_FRAME_GAME) {
+                handle_game_frame(w, conn, p + 1 + used, (size_t)body_len);
+            } else {
+                handle_message(w, conn, (const char *)p + 1 + used, (size_t)body_len);
+            }
+            if (conn->move_to) break;
+            pos += total;
+        } else {
+            /* Rad: sök bara igenom det som tillkommit sedan förra gången */
+            const char *nl = (const char *)memchr(p + conn->rx_scan, '\n', avail - conn->rx_scan);
+            if (!nl) {
+                conn->rx_scan = avail;
+                if (avail > RELAY_MAX_FRAME) rc = -1;
+                break;
+            }
+
+            handle_message(w, conn, (const char *)p, (size_t)(nl - (const char *)p));
+            if (conn->move_to) break;
+            pos += (size_t)(nl - (const char *)p) + 1;
+        }
+
+        conn->rx_scan = 0;
+        conn->rx_need = 0;
+    }
+
+    /* Meddelandet som ledde till flytten ligger kvar och läses om, tillsammans
+       med resten av bufferten, av tråden som tar över */
+    if (conn->move_to) {
+        conn->rx_scan = 0;
+        conn->rx_need = 0;
+    }
+
+    if (pos > 0) {
+        conn->rx_len -= pos;
+        memmove(conn->rx, conn->rx + pos, conn->rx_len);
+    }
+
+    /* En stor ram ska inte hålla kvar minnet */
+    if (conn->rx_cap > RELAY_RX_KEEP_CAP && conn->rx_len < RELAY_RX_INITIAL_CAP && conn->rx_need == 0) {
+        char *p = (char *)realloc(conn->rx, RELAY_RX_INITIAL_CAP);
+        if (p) {
+            conn->rx = p;
+            conn->rx_cap = RELAY_RX_INITIAL_CAP;
+        }
+    }
+
+    return rc;
+}
+
+/* Returnerar -1 om anslutningen ska stängas. */
+static int conn_read(Worker *w, Conn *conn) {
+    size_t want = conn->rx_len + RELAY_RX_MIN_READ;
+    if (conn->rx_need > want) want = conn->rx_need;
+
+    if (want > conn->rx_cap) {
+        size_t cap = conn->rx_cap ? conn->rx_cap : RELAY_RX_INITIAL_CAP;
+        while (cap < want) cap *= 2;
+        char *p = (char *)realloc(conn->rx, cap);
+        if (!p) return -1;
+        conn->rx = p;
+        conn->rx_cap = cap;
+    }
+
+    ssize_t n = recv(conn->fd, conn->rx + conn->rx_len, conn->rx_cap - conn->rx_len, 0);
+    if (n == 0) return -1;
+    if (n < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    }
+    conn->rx_len += (size_t)n;
+
+    return conn_process(w, conn);
+}
+
+static void conn_unlink(Worker *w, Conn *conn) {
+    if (conn->prev) conn->prev->next = conn->next;
+    else w->conns = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    conn->prev = conn->next = NULL;
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+}
+
+static void conn_free(Conn *conn) {
+    close(conn->fd);
+    free(conn->rx);
+    free(conn->tx);
+    free(conn);
+}
+
+static void conn_close(Worker *w, Conn *conn) {
+    Client *c = conn->client;
+    conn->client = NULL;
+    if (c && client_disconnected(w, c)) free(c);
+
+    conn_unlink(w, conn);
+    conn_free(conn);
+}
+
+/* Lämnar anslutningen till tråden i conn->move_to. Den här tråden rör den
+   inte mer efter det. */
+static void conn_hand_off(Worker *w, Conn *conn) {
+    Worker *owner = conn->move_to;
+    conn_unlink(w, conn);
+
+    pthread_mutex_lock(&owner->inbox_lock);
+    conn->next = owner->inbox;
+    owner->inbox = conn;
+    pthread_mutex_unlock(&owner->inbox_lock);
+
+    uint64_t one = 1;
+    if (write(owner->wake_fd, &one, sizeof(one)) < 0) {
+    }
+}
+
+/* Tar över en anslutning från en annan tråd och läser det som redan kommit */
+static void conn_adopt(Worker *w, Conn *conn) {
+    conn->worker = w;
+    conn->move_to = NULL;
+    conn->next = w->conns;
+    if (w->conns) w->conns->prev = conn;
+    w->conns = conn;
+
+    /* Nyckeln följer med klienten, se conn_move */
+    Client *c = conn->client;
+    if (c && c->resumeToken[0] && map_put(&w->tokens, c->resumeToken, c) != 0) {
+        c->resumeToken[0] = '\0';
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | (conn->tx_armed ? EPOLLOUT : 0);
+    ev.data.ptr = conn;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, conn->fd, &ev) != 0) {
+        conn_close(w, conn);
+        return;
+    }
+
+    if (conn_process(w, conn) != 0) conn_close(w, conn);
+    else if (conn->move_to) conn_hand_off(w, conn);
+}
+
+static void take_handoffs(Worker *w) {
+    pthread_mutex_lock(&w->inbox_lock);
+    Conn *conn = w->inbox;
+    w->inbox = NULL;
+    pthread_mutex_unlock(&w->inbox_lock);
+
+    /* Äldst först */
+    Conn *ordered = NULL;
+    while (conn) {
+        Conn *next = conn->next;
+        conn->next = ordered;
+        ordered = conn;
+        conn = next;
+    }
+
+    while (ordered) {
+        conn = ordered;
+        ordered = conn->next;
+        conn->next = NULL;
+        conn_adopt(w, conn);
+    }
+}
+
+static void accept_all(Worker *w) {
+    for (;;) {
+        int fd = accept4(w->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        Conn *conn = (Conn *)calloc(1, sizeof(Conn));
+        Client *c = client_new();
+        if (!conn || !c) {
+            free(conn);
+            free(c);
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->worker = w;
+        conn->client = c;
+        c->conn = conn;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = conn;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            free(conn);
+            free(c);
+            close(fd);
+            continue;
+        }
+
+        conn->next = w->conns;
+        if (w->conns) w->conns->prev = conn;
+        w->conns = conn;
+
+        if (w->r->opt.verbose) printf("New TCP mpapi connection: %s (worker %d)\n", c->clientId, w->index);
+    }
+}
+
+/* Släpper frånkopplade klienter vars tid gått ut */
+static void sweep_detached(Worker *w) {
+    int64_t now = monotonic_ms();
+
+    Client *c = w->detached;
+    while (c) {
+        Client *next = c->detached_next;
+        if (c->expires_ms <= now) client_expire(w, c);
+        c = next;
+    }
+}
+
+static void *worker_main(void *arg) {
+    Worker *w = (Worker *)arg;
+    relay *r = w->r;
+    struct epoll_event events[RELAY_EVENTS];
+    int64_t next_sweep = monotonic_ms() + RELAY_SWEEP_MS;
+
+    while (!atomic_load(&r->stop)) {
+        int n = epoll_wait(w->epfd, events, RELAY_EVENTS, RELAY_SWEEP_MS);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            void *ptr = events[i].data.ptr;
+            uint32_t mask = events[i].events;
+
+            if (ptr == &w->wake_fd) {
+                uint64_t v;
+                if (read(w->wake_fd, &v, sizeof(v)) < 0) {
+                }
+                take_handoffs(w);
+                continue;
+            }
+            if (ptr == &w->listen_fd) {
+                accept_all(w);
+                continue;
+            }
+
+            Conn *conn = (Conn *)ptr;
+            int alive = 1;
+            if (mask & EPOLLOUT) alive = conn_flush(conn) == 0;
+            if (alive && (mask & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) alive = conn_read(w, conn) == 0;
+            if (!alive) conn_close(w, conn);
+            else if (conn->move_to) conn_hand_off(w, conn);
+        }
+
+        /* Varje tråd släpper sina egna frånkopplade klienter */
+        int64_t now = monotonic_ms();
+        if (now >= next_sweep) {
+            sweep_detached(w);
+            next_sweep = now + RELAY_SWEEP_MS;
+        }
+    }
+
+    return NULL;
+}
+
+/* --- Publikt API --- */
+
+void relay_default_options(relay_options *opt) {
+    if (!opt) return;
+    memset(opt, 0, sizeof(*opt));
+    opt->port = 9001;
+    opt->resume_grace_ms = 30000;
+    opt->replay_limit = 1024;
+}
+
+static int open_listener(const relay_options *opt) {
+    struct sockaddr_in6 addr6;
+    struct sockaddr_in addr4;
+    struct sockaddr *addr;
+    socklen_t addr_len;
+    int family;
+
+    memset(&addr6, 0, sizeof(addr6));
+    memset(&addr4, 0, sizeof(addr4));
+
+    if (!opt->bind) {
+        family = AF_INET6;
+        addr6.sin6_family = AF_INET6;
+        addr6.sin6_addr = in6addr_any;
+        addr6.sin6_port = htons(opt->port);
+        addr = (struct sockaddr *)&addr6;
+        addr_len = sizeof(addr6);
+    } else if (inet_pton(AF_INET, opt->bind, &addr4.sin_addr) == 1) {
+        family = AF_INET;
+        addr4.sin_family = AF_INET;
+        addr4.sin_port = htons(opt->port);
+        addr = (struct sockaddr *)&addr4;
+        addr_len = sizeof(addr4);
+    } else if (inet_pton(AF_INET6, opt->bind, &addr6.sin6_addr) == 1) {
+        family = AF_INET6;
+        addr6.sin6_family = AF_INET6;
+        addr6.sin6_port = htons(opt->port);
+        addr = (struct sockaddr *)&addr6;
+        addr_len = sizeof(addr6);
+    } else {
+        return -1;
+    }
+
+    int fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 && !opt->bind) {
+        /* Ingen IPv6 på maskinen */
+        family = AF_INET;
+        addr4.sin_family = AF_INET;
+        addr4.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr4.sin_port = htons(opt->port);
+        addr = (struct sockaddr *)&addr4;
+        addr_len = sizeof(addr4);
+        fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    }
+    if (fd < 0) return -1;
+
+    int one = 1, zero = 0;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    if (family == AF_INET6 && !opt->bind) setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+
+    if (bind(fd, addr, addr_len) != 0 || listen(fd, SOMAXCONN) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+relay *relay_create(const relay_options *opt) {
+    relay *r = (relay *)calloc(1, sizeof(relay));
+    if (!r) return NULL;
+
+    if (opt) r->opt = *opt;
+    else relay_default_options(&r->opt);
+    if (r->opt.replay_limit < 1) r->opt.replay_limit = 1;
+    if (r->opt.resume_grace_ms < 0) r->opt.resume_grace_ms = 0;
+
+    r->threads = r->opt.threads;
+    if (r->threads <= 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        r->threads = n > 0 ? (int)n : 1;
+    }
+
+    /* Hashfröet sätts innan flera trådar börjar skapa objekt */
+    json_object_seed(0);
+
+    pthread_mutex_init(&r->directory_lock, NULL);
+    if (map_init(&r->directory) != 0) {
+        relay_destroy(r);
+        return NULL;
+    }
+
+    r->workers = (Worker *)calloc((size_t)r->threads, sizeof(Worker));
+    if (!r->workers) {
+        relay_destroy(r);
+        return NULL;
+    }
+
+    for (int i = 0; i < r->threads; ++i) {
+        Worker *w = &r->workers[i];
+        w->r = r;
+        w->index = i;
+        w->epfd = -1;
+        w->wake_fd = -1;
+        w->listen_fd = -1;
+        pthread_mutex_init(&w->inbox_lock, NULL);
+    }
+
+    for (int i = 0; i < r->threads; ++i) {
+        Worker *w = &r->workers[i];
+        if (map_init(&w->sessions) != 0 || map_init(&w->tokens) != 0) {
+            relay_destroy(r);
+            return NULL;
+        }
+
+        w->epfd = epoll_create1(EPOLL_CLOEXEC);
+        w->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        w->listen_fd = open_listener(&r->opt);
+        if (w->epfd < 0 || w->wake_fd < 0 || w->listen_fd < 0) {
+            relay_destroy(r);
+            return NULL;
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &w->listen_fd;
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->listen_fd, &ev);
+        ev.data.ptr = &w->wake_fd;
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wake_fd, &ev);
+    }
+
+    return r;
+}
+
+int relay_run(relay *r) {
+    if (!r) return RELAY_ERR_ARGUMENT;
+
+    for (int i = 1; i < r->threads; ++i) {
+        Worker *w = &r->workers[i];
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+            relay_stop(r);
+            break;
+        }
+        w->thread_started = true;
+    }
+
+    worker_main(&r->workers[0]);
+
+    for (int i = 1; i < r->threads; ++i) {
+        Worker *w = &r->workers[i];
+        if (w->thread_started) {
+            pthread_join(w->thread, NULL);
+            w->thread_started = false;
+        }
+    }
+
+    return RELAY_OK;
+}
+
+void relay_stop(relay *r) {
+    if (!r) return;
+    atomic_store(&r->stop, 1);
+
+    for (int i = 0; i < r->threads; ++i) {
+        if (r->workers && r->workers[i].wake_fd >= 0) {
+            uint64_t one = 1;
+            if (write(r->workers[i].wake_fd, &one, sizeof(one)) < 0) {
+            }
+        }
+    }
+}
+
+void relay_destroy(relay *r) {
+    if (!r) return;
+
+    if (r->workers) {
+        for (int i = 0; i < r->threads; ++i) {
+            Worker *w = &r->workers[i];
+            Conn *conn = w->conns;
+            while (conn) {
+                Conn *next = conn->next;
+                free(conn->client);
+                conn_free(conn);
+                conn = next;
+            }
+
+            /* Anslutningar som var på väg hit */
+            conn = w->inbox;
+            while (conn) {
+                Conn *next = conn->next;
+                free(conn->client);
+                conn_free(conn);
+                conn = next;
+            }
+
+            Client *c = w->detached;
+            while (c) {
+                Client *next = c->detached_next;
+                client_free_held(c);
+                free(c);
+                c = next;
+            }
+
+            Session *s = w->first_session;
+            while (s) {
+                Session *next = s->next;
+                session_destroy(w, s);
+                s = next;
+            }
+
+            map_free(&w->sessions);
+            map_free(&w->tokens);
+            pthread_mutex_destroy(&w->inbox_lock);
+            if (w->listen_fd >= 0) close(w->listen_fd);
+            if (w->wake_fd >= 0) close(w->wake_fd);
+            if (w->epfd >= 0) close(w->epfd);
+        }
+        free(r->workers);
+    }
+
+    map_free(&r->directory);
+    pthread_mutex_destroy(&r->directory_lock);
+    free(r);
+}
@@ -0,0 +1,50 @@
+#ifndef MPAPI_RELAY_H
+#define MPAPI_RELAY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Relay‑server för mpapi över TCP. Talar samma protokoll som TCP‑delen av
+   backend/mpapiServer.js (host, host_setup, join, leave, list, game, resume,
+   binära game‑ramar och längdprefixerade JSON‑ramar) och kan ersätta den på
+   port 9001. */
+typedef struct relay relay;
+
+typedef struct relay_options {
+    const char *bind;       /* adress att lyssna på, NULL = alla */
+    uint16_t port;          /* 9001 */
+    int threads;            /* arbetstrådar, 0 = en per kärna */
+    int resume_grace_ms;    /* hur länge en tappad klient får vara borta, 30000 */
+    int replay_limit;       /* game‑meddelanden per session som sparas, 1024 */
+    bool verbose;           /* skriv ut anslutningar och sessioner */
+} relay_options;
+
+#define RELAY_OK              0
+#define RELAY_ERR_ARGUMENT    1
+#define RELAY_ERR_IO          2
+#define RELAY_ERR_MEMORY      3
+
+/* Fyller i standardvärden. */
+void relay_default_options(relay_options *opt);
+
+/* Skapar servern och börjar lyssna. Returnerar NULL vid fel. */
+relay *relay_create(const relay_options *opt);
+
+/* Kör arbetstrådarna tills relay_stop anropas. */
+int relay_run(relay *r);
+
+/* Ber relay_run att avsluta. Får anropas från en signalhanterare. */
+void relay_stop(relay *r);
+
+/* Stänger alla anslutningar och frigör servern. */
+void relay_destroy(relay *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -206,14 +206,15 @@ export class mpapi {
 	}
 
 	// type can be 'sessions' or 'clients'
-	list(type = "sessions") {
+	// filter: { offset, limit, notFull, namePrefix }, all optional
+	list(type = "sessions", filter = {}) {
 		return new Promise((resolve, reject) => {
 			this.onList = (data) => {
 				this.onList = null;
 				return resolve(data);
 			};
 
-			const serialized = this._buildPayload('list', { type });
+			const serialized = this._buildPayload('list', { type, ...filter });
 			this._enqueueOrSend(serialized);
 		});
 	}